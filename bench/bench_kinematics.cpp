@@ -0,0 +1,52 @@
+#include <benchmark/benchmark.h>
+#include <cmath>
+#include <vector>
+
+#include "../src/kinematics.hpp"
+
+using namespace rfs;
+using namespace std;
+
+// A chain of `joints` links, alternating the axes so that it is not planar
+static KinematicChain make_chain(size_t joints)
+{
+    KinematicChain::Parameters parameters(joints);
+    for (size_t i = 0; i < joints; i++)
+        parameters[i] = {0.0, (i % 2) ? 0.0f : static_cast<float>(M_PI / 2.0), 50.0};
+    return KinematicChain(parameters);
+}
+
+static void BM_ForwardKinematics(benchmark::State &state)
+{
+    KinematicChain chain = make_chain(state.range(0));
+    vector<float> angles(state.range(0), 0.1);
+    for (auto _: state) {
+        // Change the first angle, so that all the joints are computed again
+        angles[0] = -angles[0];
+        chain.set_angles(angles);
+        benchmark::DoNotOptimize(chain.forward_kinematics());
+    }
+}
+BENCHMARK(BM_ForwardKinematics)->DenseRange(2, 8, 2);
+
+static void BM_InverseKinematics(benchmark::State &state, IKSolver solver)
+{
+    KinematicChain chain = make_chain(state.range(0));
+    chain.set_solver(solver);
+    const vector<float> start(state.range(0), 0.3);
+    chain.set_angles(start);
+    const vec3 target = chain.forward_kinematics();
+    const vector<float> angles(state.range(0), 0.2);
+
+    int64_t iterations = 0;
+    for (auto _: state) {
+        chain.set_angles(angles);
+        const IKResult result = chain.inverse_kinematics(target, 64, 0.1);
+        iterations += result.iterations;
+        benchmark::DoNotOptimize(result);
+    }
+    state.counters["ik_iterations"] = benchmark::Counter(iterations, benchmark::Counter::kAvgIterations);
+}
+BENCHMARK_CAPTURE(BM_InverseKinematics, ccd, IKSolver::CCD)->DenseRange(2, 8, 2);
+BENCHMARK_CAPTURE(BM_InverseKinematics, dls, IKSolver::DLS)->DenseRange(2, 8, 2);
+BENCHMARK_CAPTURE(BM_InverseKinematics, lm, IKSolver::LevenbergMarquardt)->DenseRange(2, 8, 2);
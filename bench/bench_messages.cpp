@@ -0,0 +1,55 @@
+#include <benchmark/benchmark.h>
+
+#include "../src/messages.hpp"
+
+using namespace rfs;
+using namespace std;
+
+static void BM_ServoCommandEncode(benchmark::State &state)
+{
+    const ServoCommand command(3, 45.0);
+    for (auto _: state) {
+        zmq::message_t message = command.to_zmq_message();
+        benchmark::DoNotOptimize(message.data());
+    }
+}
+BENCHMARK(BM_ServoCommandEncode);
+
+static void BM_ServoCommandDecode(benchmark::State &state)
+{
+    const zmq::message_t message = ServoCommand(3, 45.0).to_zmq_message();
+    for (auto _: state)
+        benchmark::DoNotOptimize(ServoCommand::from_zmq_message(message));
+}
+BENCHMARK(BM_ServoCommandDecode);
+
+static void BM_ServoFrameBuild(benchmark::State &state)
+{
+    ServoFrameBuilder builder(state.range(0));
+    uint64_t timestamp = 0;
+    for (auto _: state) {
+        builder.clear(timestamp++);
+        for (int32_t id = 0; id < state.range(0); id++)
+            builder.add(id, 45.0);
+        benchmark::DoNotOptimize(builder.bytes().data());
+    }
+}
+BENCHMARK(BM_ServoFrameBuild)->Arg(6)->Arg(18);
+
+static void BM_ServoFrameDecode(benchmark::State &state)
+{
+    ServoFrameBuilder builder(state.range(0));
+    builder.clear(0);
+    for (int32_t id = 0; id < state.range(0); id++)
+        builder.add(id, 45.0);
+    const zmq::message_t message = builder.to_zmq_message();
+
+    for (auto _: state) {
+        const expected<ServoFrame, Error> frame = ServoFrame::from_zmq_message(message);
+        float sum = 0.0;
+        for (const ServoFrameEntry &entry: frame->entries())
+            sum += entry.angle;
+        benchmark::DoNotOptimize(sum);
+    }
+}
+BENCHMARK(BM_ServoFrameDecode)->Arg(6)->Arg(18);
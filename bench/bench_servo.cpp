@@ -0,0 +1,77 @@
+#include <benchmark/benchmark.h>
+#include <vector>
+
+#include "../src/i2csimulator.hpp"
+#include "../src/pca9685.hpp"
+#include "../src/servo.hpp"
+#include "../src/servogroup.hpp"
+
+using namespace rfs;
+using namespace std;
+
+#define PCA9685_DEVICE "/dev/i2c-1"
+#define PCA9685_ADDRESS 0x40
+#define SERVOS_COUNT 16
+
+// The simulated devices don't wait for the bus unless the argument is 1, so that the
+// benchmarks measure either the library alone or the library with the bus at 400 kHz
+struct SimulatedController {
+    SimulatedPca9685 device;
+    I2cSimulator simulator;
+    Pca9685 controller;
+
+    SimulatedController(bool real_time):
+        device(PCA9685_ADDRESS), simulator(I2cSimulator::FAST_MODE_FREQUENCY, real_time),
+        controller(true, simulator)
+    {
+        simulator.add_device(device);
+        controller.open(PCA9685_DEVICE, PCA9685_ADDRESS);
+        controller.set_frequency(Servo::SERVO_FREQUENCY);
+    }
+};
+
+static void BM_ServoSetAngle(benchmark::State &state)
+{
+    SimulatedController simulated(state.range(0));
+    unique_ptr<Pwm> pwm = *simulated.controller.pwm(0);
+    Servo servo(pwm);
+    float angle = 45.0;
+    for (auto _: state) {
+        angle = -angle;
+        benchmark::DoNotOptimize(servo.set_angle(angle));
+    }
+    state.counters["bus_us"] = benchmark::Counter(
+        chrono::duration<double, micro>(simulated.simulator.get_bus_time()).count(), benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_ServoSetAngle)->Arg(0)->Arg(1);
+
+static void BM_StaticServoSetAngle(benchmark::State &state)
+{
+    SimulatedController simulated(state.range(0));
+    BasicServo<Pca9685StaticPwm> servo(*simulated.controller.static_pwm(0));
+    float angle = 45.0;
+    for (auto _: state) {
+        angle = -angle;
+        benchmark::DoNotOptimize(servo.set_angle(angle));
+    }
+}
+BENCHMARK(BM_StaticServoSetAngle)->Arg(0)->Arg(1);
+
+static void BM_ServoGroupCommit(benchmark::State &state, bool lookup_tables)
+{
+    SimulatedController simulated(state.range(0));
+    ServoGroup group(lookup_tables);
+    for (uint32_t channel = 0; channel < SERVOS_COUNT; channel++)
+        group.add_servo(simulated.controller, channel);
+    group.init();
+
+    vector<float> angles(group.size(), 45.0);
+    for (auto _: state) {
+        for (float &angle: angles)
+            angle = -angle;
+        benchmark::DoNotOptimize(group.set_angles(angles));
+    }
+    state.SetItemsProcessed(state.iterations() * group.size());
+}
+BENCHMARK_CAPTURE(BM_ServoGroupCommit, computed, false)->Arg(0)->Arg(1);
+BENCHMARK_CAPTURE(BM_ServoGroupCommit, lookup_tables, true)->Arg(0)->Arg(1);
@@ -0,0 +1,26 @@
+#include <benchmark/benchmark.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../src/web.hpp"
+
+using namespace rfs;
+using namespace std;
+
+// A route table as the one of a robot's UI: a few exact routes and some static directories
+static void BM_HTTPRouterFind(benchmark::State &state, const char *uri)
+{
+    vector<unique_ptr<HTTPEventHandler>> handlers;
+    HTTPRouter router;
+    for (const char *pattern: {"/", "/angles/", "/metrics", "/ws/angles/", "/static/#", "/api/servos/*", "/api/#"}) {
+        handlers.push_back(make_unique<HTTPEventHandler>());
+        router.add(pattern, handlers.back().get());
+    }
+
+    for (auto _: state)
+        benchmark::DoNotOptimize(router.find(uri));
+}
+BENCHMARK_CAPTURE(BM_HTTPRouterFind, exact, "/angles/");
+BENCHMARK_CAPTURE(BM_HTTPRouterFind, prefix, "/static/js/app.js");
+BENCHMARK_CAPTURE(BM_HTTPRouterFind, not_found, "/favicon.ico");
@@ -0,0 +1,406 @@
+#pragma once
+
+extern "C"
+{
+    #include <signal.h>
+    #include <unistd.h>
+}
+
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <expected>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "error.hpp"
+#include "servo.hpp"
+
+using namespace std;
+
+namespace rfs {
+
+/**
+ * The calibration of a servo, as given to the constructor of `Servo`.
+ */
+struct ServoCalibration {
+    float half_angle_duty_cycle;
+    float offset;
+};
+
+/**
+ * The configuration of the robot, read once from the environment and an optional file.
+ *
+ * All the values are parsed when the configuration is loaded, so getting them doesn't parse
+ * strings, allocate memory nor call `getenv()`: a `Config` is an immutable snapshot, that can be
+ * read from any thread. To change the configuration while running, load a new one and replace it
+ * in a `ConfigStore`.
+ *
+ * The calibration of the servos is taken from the variables `SERVO_HALF_ANGLE_DUTY_CYCLE_<n>` and
+ * `SERVO_OFFSET_<n>`, where `<n>` is the index of the servo, starting at 0 and below `MAX_SERVOS`.
+ */
+class Config {
+
+public:
+
+    /**
+     * The maximum length of the names of the indexed variables, with their index.
+     */
+    static constexpr size_t MAX_INDEXED_NAME_LENGTH = 63;
+
+    /**
+     * The maximum number of servos that can be calibrated.
+     */
+    static constexpr uint32_t MAX_SERVOS = 256;
+
+    /**
+     * Load the configuration from the environment and, if `path` is given, from that file.
+     *
+     * The file has a variable per line, as `NAME=value`. The empty lines and the ones starting
+     * with `#` are ignored, and so is the whitespace around the names and values. The variables
+     * of the environment override the ones of the file. Returns an `EINVAL` error if a line of the
+     * file is not a variable, or if the index of a servo is not below `MAX_SERVOS`.
+     */
+    static expected<shared_ptr<const Config>, rfs::Error> load(const char *path = nullptr)
+    {
+        shared_ptr<Config> config(new Config());
+        if (path) {
+            const expected<void, rfs::Error> file_result = config->parse_file(path);
+            if (!file_result)
+                return unexpected(file_result.error());
+        }
+        for (char **variable = environ; *variable; variable++) {
+            const string_view line(*variable);
+            const size_t equal = line.find('=');
+            if (equal != string_view::npos)
+                config->set(line.substr(0, equal), line.substr(equal + 1));
+        }
+        const expected<void, rfs::Error> servos_result = config->parse_servos();
+        if (!servos_result)
+            return unexpected(servos_result.error());
+        return shared_ptr<const Config>(std::move(config));
+    }
+
+    /**
+     * Return the value of `name` as a boolean.
+     *
+     * The values `true`, `True`, `yes`, `Yes`, `y`, `Y` and `1` are true, and any other is false.
+     * Returns `default_value` if the variable doesn't exist.
+     */
+    bool get_bool(string_view name, bool default_value = false) const
+    {
+        const Value *value = find(name);
+        return value ? value->boolean : default_value;
+    }
+
+    /**
+     * Return the value of `name` as a floating point number.
+     *
+     * Returns `default_value` if the variable doesn't exist or it is not a number.
+     */
+    float get_float(string_view name, float default_value = 0.0) const
+    {
+        const Value *value = find(name);
+        return value && value->real ? *value->real : default_value;
+    }
+
+    /**
+     * Return the value of `name` as an integer, in decimal, or in hexadecimal with the prefix `0x`.
+     *
+     * Returns `default_value` if the variable doesn't exist, it is not an integer or it is out of
+     * the range [`min_value`, `max_value`].
+     */
+    long get_long(string_view name, long default_value = 0, long min_value = LONG_MIN, long max_value = LONG_MAX) const
+    {
+        const Value *value = find(name);
+        if (!value || !value->integer || *value->integer < min_value || *value->integer > max_value)
+            return default_value;
+        return *value->integer;
+    }
+
+    /**
+     * Return the value of the variable `<name>_<index>` as an integer.
+     *
+     * See `get_long()`.
+     */
+    long get_long_indexed(string_view name, uint32_t index, long default_value = 0, long min_value = LONG_MIN,
+        long max_value = LONG_MAX) const
+    {
+        char indexed_name[MAX_INDEXED_NAME_LENGTH + 1];
+        const optional<string_view> full_name = make_indexed_name(name, index, indexed_name);
+        return full_name ? get_long(*full_name, default_value, min_value, max_value) : default_value;
+    }
+
+    /**
+     * Return the calibration of the servo with the given index.
+     *
+     * The values not configured are the default ones of `Servo`.
+     */
+    ServoCalibration get_servo_calibration(uint32_t index) const
+    {
+        if (index < servos.size())
+            return servos[index];
+        return {Servo::SERVO_HALF_ANGLE_DUTY_CYCLE_DEFAULT, Servo::SERVO_OFFSET_DEFAULT};
+    }
+
+    /**
+     * Return the calibration of all the servos configured.
+     *
+     * Their number is one more than the highest index configured.
+     */
+    span<const ServoCalibration> get_servo_calibrations() const
+    {
+        return servos;
+    }
+
+    /**
+     * Return the value of `name` as it was given, or `default_value` if it doesn't exist.
+     *
+     * The view is valid while the `Config` exists.
+     */
+    string_view get_string(string_view name, string_view default_value = "") const
+    {
+        const Value *value = find(name);
+        return value ? string_view(value->text) : default_value;
+    }
+
+    /**
+     * Return whether the variable `name` exists.
+     */
+    bool has(string_view name) const
+    {
+        return find(name) != nullptr;
+    }
+
+private:
+
+    friend class ConfigStore;
+
+    struct Value {
+        string text;
+        bool boolean;
+        optional<long> integer;
+        optional<float> real;
+    };
+
+    // To find the values by a string_view without building a string
+    struct StringHash {
+        using is_transparent = void;
+
+        size_t operator()(string_view text) const
+        {
+            return hash<string_view>()(text);
+        }
+    };
+
+    unordered_map<string, Value, StringHash, equal_to<>> values;
+    vector<ServoCalibration> servos;
+
+    Config()
+    {}
+
+    const Value *find(string_view name) const
+    {
+        const auto it = values.find(name);
+        return it == values.end() ? nullptr : &it->second;
+    }
+
+    static optional<string_view> make_indexed_name(string_view name, uint32_t index,
+        char (&buffer)[MAX_INDEXED_NAME_LENGTH + 1])
+    {
+        const int length = snprintf(buffer, sizeof(buffer), "%.*s_%u", static_cast<int>(name.size()), name.data(), index);
+        if (length < 0 || static_cast<size_t>(length) > MAX_INDEXED_NAME_LENGTH)
+            return nullopt;
+        return string_view(buffer, length);
+    }
+
+    static string_view trim(string_view text)
+    {
+        const size_t first = text.find_first_not_of(" \t\r");
+        if (first == string_view::npos)
+            return {};
+        return text.substr(first, text.find_last_not_of(" \t\r") - first + 1);
+    }
+
+    expected<void, rfs::Error> parse_file(const char *path)
+    {
+        ifstream file(path);
+        if (!file)
+            return unexpected(rfs::Error(errno ? errno : ENOENT, path));
+
+        string line;
+        size_t line_number = 0;
+        while (getline(file, line)) {
+            line_number++;
+            const string_view content = trim(line);
+            if (content.empty() || content[0] == '#')
+                continue;
+
+            const size_t equal = content.find('=');
+            if (equal == string_view::npos || trim(content.substr(0, equal)).empty())
+                return unexpected(rfs::Error(EINVAL, string(path) + ":" + to_string(line_number)));
+            set(trim(content.substr(0, equal)), trim(content.substr(equal + 1)));
+        }
+        return {};
+    }
+
+    expected<void, rfs::Error> parse_servos()
+    {
+        // The number of servos is given by the highest index of their variables
+        uint32_t servos_count = 0;
+        for (const string_view prefix: {"SERVO_HALF_ANGLE_DUTY_CYCLE_", "SERVO_OFFSET_"}) {
+            for (const auto &[name, value]: values) {
+                if (!string_view(name).starts_with(prefix))
+                    continue;
+                const string_view index_text = string_view(name).substr(prefix.size());
+                uint32_t index = 0;
+                const from_chars_result result = from_chars(index_text.data(), index_text.data() + index_text.size(), index);
+                if (index_text.empty() || result.ptr != index_text.data() + index_text.size())
+                    continue;
+                // Limited, so that a typo can't allocate the calibration of billions of servos
+                if (result.ec != errc() || index >= MAX_SERVOS)
+                    return unexpected(rfs::Error(EINVAL, name + ": servo index out of range"));
+                servos_count = std::max(servos_count, index + 1);
+            }
+        }
+
+        servos.resize(servos_count);
+        for (uint32_t i = 0; i < servos_count; i++) {
+            char half_angle_name[MAX_INDEXED_NAME_LENGTH + 1];
+            char offset_name[MAX_INDEXED_NAME_LENGTH + 1];
+            servos[i] = {
+                get_float(*make_indexed_name("SERVO_HALF_ANGLE_DUTY_CYCLE", i, half_angle_name),
+                    Servo::SERVO_HALF_ANGLE_DUTY_CYCLE_DEFAULT),
+                get_float(*make_indexed_name("SERVO_OFFSET", i, offset_name), Servo::SERVO_OFFSET_DEFAULT)
+            };
+        }
+        return {};
+    }
+
+    void set(string_view name, string_view text)
+    {
+        Value value{string(text), false, nullopt, nullopt};
+        for (const string_view true_value: {"true", "True", "yes", "Yes", "y", "Y", "1"})
+            value.boolean |= text == true_value;
+
+        // As strtol() with base 0 and strtof(), but the whole value must be a number
+        const string terminated(text);
+        char *end;
+        errno = 0;
+        const long integer = strtol(terminated.c_str(), &end, 0);
+        if (!terminated.empty() && *end == '\0' && errno == 0)
+            value.integer = integer;
+        errno = 0;
+        const float real = strtof(terminated.c_str(), &end);
+        if (!terminated.empty() && *end == '\0' && errno == 0)
+            value.real = real;
+
+        values.insert_or_assign(string(name), std::move(value));
+    }
+
+};
+
+/**
+ * Holds the current `Config`, and replaces it when it is reloaded.
+ *
+ * The readers get the current snapshot with `get()`, which never parses anything, and keep using
+ * it while they need consistent values: a reload doesn't modify it, it replaces it. The reload
+ * can be requested with the signal `SIGHUP`, once `handle_sighup()` has been called. As parsing is
+ * not allowed in a signal handler, the handler only marks the request, and the configuration is
+ * loaded the next time that `reload_if_requested()` is called, usually from a thread outside of the
+ * control loop.
+ */
+class ConfigStore {
+
+public:
+
+    /**
+     * Create the store, to load the configuration from the environment and from `path`, if given.
+     *
+     * Nothing is loaded yet: call `reload()` to load it and check for errors. Until then, `get()`
+     * returns an empty configuration.
+     */
+    ConfigStore(const string &path = ""): path(path), current(shared_ptr<const Config>(new Config()))
+    {}
+
+    /**
+     * Return the current configuration.
+     *
+     * It can be called from any thread.
+     */
+    shared_ptr<const Config> get() const
+    {
+        return current.load(memory_order_acquire);
+    }
+
+    /**
+     * Make `SIGHUP` request a reload of all the `ConfigStore` instances.
+     */
+    static expected<void, rfs::Error> handle_sighup()
+    {
+        struct sigaction action{};
+        action.sa_handler = [](int) { reload_requests().fetch_add(1, memory_order_relaxed); };
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        if (sigaction(SIGHUP, &action, nullptr) < 0)
+            return unexpected(rfs::Error(errno));
+        return {};
+    }
+
+    /**
+     * Load the configuration again, and replace the current one with it.
+     *
+     * If loading fails, the current configuration is kept and the error is returned.
+     */
+    expected<void, rfs::Error> reload()
+    {
+        const expected<shared_ptr<const Config>, rfs::Error> config = Config::load(path.empty() ? nullptr : path.c_str());
+        if (!config)
+            return unexpected(config.error());
+        current.store(*config, memory_order_release);
+        return {};
+    }
+
+    /**
+     * Reload the configuration if a reload was requested with `SIGHUP` since the last call, and
+     * return whether it was reloaded.
+     */
+    expected<bool, rfs::Error> reload_if_requested()
+    {
+        const uint32_t requests = reload_requests().load(memory_order_relaxed);
+        if (requests == handled_requests)
+            return false;
+        handled_requests = requests;
+
+        const expected<void, rfs::Error> reload_result = reload();
+        if (!reload_result)
+            return unexpected(reload_result.error());
+        return true;
+    }
+
+private:
+
+    static_assert(atomic<uint32_t>::is_always_lock_free, "the SIGHUP handler needs lock-free atomics");
+
+    string path;
+    atomic<shared_ptr<const Config>> current;
+    uint32_t handled_requests = 0;
+
+    static atomic<uint32_t> &reload_requests()
+    {
+        static atomic<uint32_t> requests{0};
+        return requests;
+    }
+
+};
+
+}
@@ -0,0 +1,426 @@
+#pragma once
+
+extern "C"
+{
+    #include <pthread.h>
+    #include <sched.h>
+    #include <sys/mman.h>
+    #include <time.h>
+}
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <expected>
+#include <functional>
+#include <string>
+
+#include "error.hpp"
+#include "metrics.hpp"
+
+using namespace std;
+
+namespace rfs {
+
+/**
+ * The statistics of a stage of a `ControlLoop`.
+ */
+struct ControlLoopStageStats {
+    /**
+     * The name given to the stage.
+     */
+    string name;
+
+    /**
+     * The maximum duration expected for the stage, or zero if it has none.
+     */
+    chrono::nanoseconds budget;
+
+    /**
+     * The duration of the last execution of the stage.
+     */
+    chrono::nanoseconds last;
+
+    /**
+     * The longest duration of the stage.
+     */
+    chrono::nanoseconds max;
+
+    /**
+     * The average duration of the stage.
+     */
+    chrono::nanoseconds average;
+
+    /**
+     * The number of executions that lasted longer than the budget.
+     */
+    uint64_t overruns;
+};
+
+/**
+ * Executes a sequence of stages periodically, at a fixed rate.
+ *
+ * The stages are functions executed one after the other in each cycle, in the order in which
+ * they were added, for instance to read the inputs, solve the inverse kinematics and send the
+ * angles to the servos. The cycles start at absolute instants, multiples of the period since the
+ * loop started, so the loop doesn't drift as a loop with `sleep_for()` does.
+ *
+ * A cycle that ends after the start of the next one is an overrun: the cycles that were missed
+ * are skipped, instead of executing them in a burst to catch up. The overruns are counted, and the
+ * duration of each stage is measured and compared with its budget.
+ *
+ * To reduce the jitter, the thread that executes the loop can get a real-time priority with
+ * `set_priority()`, be bound to a CPU with `set_cpu()` and lock the memory of the process with
+ * `set_memory_locked()`, so that it never waits for a page fault. The real-time priority usually
+ * requires `CAP_SYS_NICE`, or being root.
+ */
+class ControlLoop {
+
+public:
+
+    ControlLoop(float frequency):
+        period(chrono::duration_cast<chrono::nanoseconds>(chrono::duration<double>(1.0 / frequency))),
+        priority(0), cpu(-1), memory_locked(false), running(false), stop_requested(false), cycles(0),
+        overruns(0), max_wakeup_latency(0)
+    {}
+
+    ControlLoop(const ControlLoop &) = delete;
+    ControlLoop &operator=(const ControlLoop &) = delete;
+
+    /**
+     * Add a stage at the end of the cycle, and return its index.
+     *
+     * If `stage` returns an error, the loop stops and `run()` returns that error. `budget` is the
+     * maximum time that the stage is expected to last. If `histogram` is given, the duration of
+     * each execution is recorded in it, to export it with the rest of metrics. Returns an `EBUSY`
+     * error if the loop is running.
+     */
+    expected<size_t, rfs::Error> add_stage(const string &name, function<expected<void, rfs::Error>()> stage,
+        chrono::nanoseconds budget = chrono::nanoseconds::zero(), MetricsHistogram *histogram = nullptr)
+    {
+        if (running.load(memory_order_relaxed))
+            return unexpected(rfs::Error(EBUSY));
+
+        stages.emplace_back(name, std::move(stage), budget, histogram);
+        return stages.size() - 1;
+    }
+
+    /**
+     * Return the number of cycles executed.
+     */
+    uint64_t get_cycles_count() const
+    {
+        return cycles.load(memory_order_relaxed);
+    }
+
+    /**
+     * Return the longest delay between the instant in which a cycle should start and the instant in
+     * which the thread woke up to execute it.
+     */
+    chrono::nanoseconds get_max_wakeup_latency() const
+    {
+        return chrono::nanoseconds(max_wakeup_latency.load(memory_order_relaxed));
+    }
+
+    /**
+     * Return the number of cycles that ended after the start of the next one.
+     */
+    uint64_t get_overruns_count() const
+    {
+        return overruns.load(memory_order_relaxed);
+    }
+
+    /**
+     * Return the period of the loop.
+     */
+    chrono::nanoseconds get_period() const
+    {
+        return period;
+    }
+
+    /**
+     * Return the statistics of the stage with the given index.
+     *
+     * They can be read from any thread while the loop runs.
+     */
+    ControlLoopStageStats get_stage_stats(size_t index) const
+    {
+        const Stage &stage = stages[index];
+        const uint64_t executions = stage.executions.load(memory_order_relaxed);
+        return {
+            stage.name,
+            stage.budget,
+            chrono::nanoseconds(stage.last.load(memory_order_relaxed)),
+            chrono::nanoseconds(stage.max.load(memory_order_relaxed)),
+            chrono::nanoseconds(executions ? stage.total.load(memory_order_relaxed) / executions : 0),
+            stage.overruns.load(memory_order_relaxed)
+        };
+    }
+
+    /**
+     * Return the number of stages.
+     */
+    size_t get_stages_count() const
+    {
+        return stages.size();
+    }
+
+    /**
+     * Return whether the loop is running.
+     */
+    bool is_running() const
+    {
+        return running.load(memory_order_relaxed);
+    }
+
+    /**
+     * Execute the loop in the calling thread.
+     *
+     * It returns when `stop()` is called, after `max_cycles` cycles if it is not zero, or when a
+     * stage returns an error, which is then returned. Before starting, the priority, CPU and memory
+     * locking are applied to the calling thread; if any of them fails, its error is returned and
+     * the loop doesn't start. When it returns, the previous scheduling and CPUs of the thread are
+     * restored and the memory is unlocked. Returns an `EBUSY` error if the loop is already running.
+     */
+    expected<void, rfs::Error> run(uint64_t max_cycles = 0)
+    {
+        bool expected_running = false;
+        if (!running.compare_exchange_strong(expected_running, true))
+            return unexpected(rfs::Error(EBUSY));
+        stop_requested.store(false, memory_order_relaxed);
+
+        // It is running, so that no stage can be added nor another run() start, until the thread
+        // is restored
+        ThreadSettings previous_settings;
+        expected<void, rfs::Error> result = setup_thread(previous_settings);
+        if (result)
+            result = run_cycles(max_cycles);
+        restore_thread(previous_settings);
+        running.store(false);
+        return result;
+    }
+
+    /**
+     * Bind the thread that runs the loop to the CPU with the given index, or to any CPU if it is
+     * negative (the default).
+     *
+     * It takes effect the next time that `run()` is called.
+     */
+    void set_cpu(int cpu)
+    {
+        this->cpu = cpu;
+    }
+
+    /**
+     * Lock all the memory of the process, present and future, in RAM while the loop runs.
+     *
+     * It takes effect the next time that `run()` is called. The memory is unlocked when `run()`
+     * returns, even if it was locked before calling it.
+     */
+    void set_memory_locked(bool memory_locked)
+    {
+        this->memory_locked = memory_locked;
+    }
+
+    /**
+     * Run the loop with the scheduling policy `SCHED_FIFO` and the given priority, between 1 and
+     * 99, or with the normal scheduling if it is zero (the default).
+     *
+     * It takes effect the next time that `run()` is called.
+     */
+    void set_priority(int priority)
+    {
+        this->priority = priority;
+    }
+
+    /**
+     * Stop the loop after the current cycle.
+     *
+     * It can be called from any thread, and from the stages. The loop is still running until
+     * `run()` returns. If it is called before `run()`, it has no effect.
+     */
+    void stop()
+    {
+        stop_requested.store(true, memory_order_relaxed);
+    }
+
+private:
+
+    // The stack that is touched before the loop starts, so that it's present when the memory is locked
+    static const size_t PREFAULT_STACK_SIZE = 64 * 1024;
+
+    // What setup_thread() changed, and the previous values to restore
+    struct ThreadSettings {
+        bool memory_locked = false;
+        bool cpus_changed = false;
+        cpu_set_t cpus;
+        bool scheduling_changed = false;
+        int policy;
+        sched_param parameters;
+    };
+
+    struct Stage {
+        Stage(const string &name, function<expected<void, rfs::Error>()> &&function, chrono::nanoseconds budget,
+            MetricsHistogram *histogram):
+            name(name), function(std::move(function)), budget(budget), histogram(histogram)
+        {}
+
+        string name;
+        std::function<expected<void, rfs::Error>()> function;
+        chrono::nanoseconds budget;
+        MetricsHistogram *histogram;
+        atomic<uint64_t> executions{0};
+        atomic<uint64_t> last{0};
+        atomic<uint64_t> max{0};
+        atomic<uint64_t> total{0};
+        atomic<uint64_t> overruns{0};
+    };
+
+    chrono::nanoseconds period;
+    int priority;
+    int cpu;
+    bool memory_locked;
+    deque<Stage> stages;
+    atomic<bool> running;
+    atomic<bool> stop_requested;
+    atomic<uint64_t> cycles;
+    atomic<uint64_t> overruns;
+    atomic<uint64_t> max_wakeup_latency;
+
+    void record_wakeup(chrono::steady_clock::duration latency)
+    {
+        const uint64_t latency_ns = chrono::duration_cast<chrono::nanoseconds>(latency).count();
+        metrics::control_wakeup_seconds.record(latency);
+        // Only this thread writes it, so there's no need for a compare and swap
+        if (latency_ns > max_wakeup_latency.load(memory_order_relaxed))
+            max_wakeup_latency.store(latency_ns, memory_order_relaxed);
+    }
+
+    void restore_thread(const ThreadSettings &previous)
+    {
+        if (previous.scheduling_changed)
+            pthread_setschedparam(pthread_self(), previous.policy, &previous.parameters);
+        if (previous.cpus_changed)
+            pthread_setaffinity_np(pthread_self(), sizeof(previous.cpus), &previous.cpus);
+        if (previous.memory_locked)
+            munlockall();
+    }
+
+    expected<void, rfs::Error> run_cycle(chrono::steady_clock::time_point cycle_start)
+    {
+        chrono::steady_clock::time_point stage_start = cycle_start;
+        for (Stage &stage: stages) {
+            const expected<void, rfs::Error> stage_result = stage.function();
+            const chrono::steady_clock::time_point stage_end = chrono::steady_clock::now();
+            const chrono::nanoseconds duration = chrono::duration_cast<chrono::nanoseconds>(stage_end - stage_start);
+
+            stage.executions.fetch_add(1, memory_order_relaxed);
+            stage.last.store(duration.count(), memory_order_relaxed);
+            stage.total.fetch_add(duration.count(), memory_order_relaxed);
+            if (static_cast<uint64_t>(duration.count()) > stage.max.load(memory_order_relaxed))
+                stage.max.store(duration.count(), memory_order_relaxed);
+            if (stage.budget != chrono::nanoseconds::zero() && duration > stage.budget)
+                stage.overruns.fetch_add(1, memory_order_relaxed);
+            if (stage.histogram)
+                stage.histogram->record(duration);
+
+            if (!stage_result)
+                return stage_result;
+            stage_start = stage_end;
+        }
+        metrics::control_cycle_seconds.record(stage_start - cycle_start);
+        return {};
+    }
+
+    expected<void, rfs::Error> run_cycles(uint64_t max_cycles)
+    {
+        const uint64_t first_cycle = cycles.load(memory_order_relaxed);
+        chrono::steady_clock::time_point next_cycle = chrono::steady_clock::now();
+        while (!stop_requested.load(memory_order_relaxed)) {
+            if (max_cycles && cycles.load(memory_order_relaxed) - first_cycle >= max_cycles)
+                break;
+
+            sleep_until(next_cycle);
+            const chrono::steady_clock::time_point cycle_start = chrono::steady_clock::now();
+            record_wakeup(cycle_start - next_cycle);
+
+            const expected<void, rfs::Error> cycle_result = run_cycle(cycle_start);
+            cycles.fetch_add(1, memory_order_relaxed);
+            metrics::control_cycles.add();
+            if (!cycle_result)
+                return cycle_result;
+
+            // Skip the cycles that should have started already
+            next_cycle += period;
+            const chrono::steady_clock::time_point cycle_end = chrono::steady_clock::now();
+            if (cycle_end > next_cycle) {
+                overruns.fetch_add(1, memory_order_relaxed);
+                metrics::control_overruns.add();
+                next_cycle += ((cycle_end - next_cycle) / period + 1) * period;
+            }
+        }
+        return {};
+    }
+
+    // On error, what was already changed is in previous too, so restore_thread() undoes it
+    expected<void, rfs::Error> setup_thread(ThreadSettings &previous)
+    {
+        // Checked before changing anything
+        if (cpu >= CPU_SETSIZE)
+            return unexpected(rfs::Error(EINVAL, "wrong CPU"));
+        if (priority && (priority < sched_get_priority_min(SCHED_FIFO) || priority > sched_get_priority_max(SCHED_FIFO)))
+            return unexpected(rfs::Error(EINVAL, "wrong priority"));
+
+        if (memory_locked) {
+            if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+                return unexpected(rfs::Error(errno, "mlockall"));
+            previous.memory_locked = true;
+            [[maybe_unused]] volatile uint8_t stack[PREFAULT_STACK_SIZE];
+            for (size_t i = 0; i < PREFAULT_STACK_SIZE; i += 4096)
+                stack[i] = 0;
+        }
+
+        if (cpu >= 0) {
+            int error = pthread_getaffinity_np(pthread_self(), sizeof(previous.cpus), &previous.cpus);
+            if (error)
+                return unexpected(rfs::Error(error, "pthread_getaffinity_np"));
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(cpu, &cpus);
+            error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+            if (error)
+                return unexpected(rfs::Error(error, "pthread_setaffinity_np"));
+            previous.cpus_changed = true;
+        }
+
+        if (priority) {
+            int error = pthread_getschedparam(pthread_self(), &previous.policy, &previous.parameters);
+            if (error)
+                return unexpected(rfs::Error(error, "pthread_getschedparam"));
+            sched_param parameters{};
+            parameters.sched_priority = priority;
+            error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &parameters);
+            if (error)
+                return unexpected(rfs::Error(error, "pthread_setschedparam"));
+            previous.scheduling_changed = true;
+        }
+        return {};
+    }
+
+    // With an absolute time, so that the time spent in the cycle doesn't delay the next one
+    static void sleep_until(chrono::steady_clock::time_point instant)
+    {
+        // The clock of chrono::steady_clock is CLOCK_MONOTONIC
+        const chrono::nanoseconds since_epoch = chrono::duration_cast<chrono::nanoseconds>(instant.time_since_epoch());
+        timespec request;
+        request.tv_sec = since_epoch.count() / 1000000000;
+        request.tv_nsec = since_epoch.count() % 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &request, nullptr) == EINTR)
+            ;
+    }
+
+};
+
+}
@@ -0,0 +1,475 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <expected>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace rfs {
+
+template <typename T>
+class Task;
+
+class Executor;
+
+namespace detail {
+
+template <typename T>
+class TaskPromiseBase {
+
+public:
+
+    suspend_always initial_suspend() noexcept
+    {
+        return {};
+    }
+
+    auto final_suspend() noexcept
+    {
+        // Resume the coroutine that awaited this one, without growing the stack
+        struct FinalAwaiter {
+            bool await_ready() noexcept
+            {
+                return false;
+            }
+
+            coroutine_handle<> await_suspend(coroutine_handle<typename Task<T>::promise_type> handle) noexcept
+            {
+                const coroutine_handle<> continuation = handle.promise().continuation;
+                return continuation ? continuation : noop_coroutine();
+            }
+
+            void await_resume() noexcept
+            {}
+        };
+        return FinalAwaiter{};
+    }
+
+    // The library doesn't use exceptions
+    void unhandled_exception() noexcept
+    {
+        terminate();
+    }
+
+    coroutine_handle<> continuation;
+
+};
+
+template <typename T>
+class TaskPromise: public TaskPromiseBase<T> {
+
+public:
+
+    Task<T> get_return_object();
+
+    void return_value(T result)
+    {
+        value.emplace(std::move(result));
+    }
+
+    T result()
+    {
+        return std::move(*value);
+    }
+
+private:
+
+    optional<T> value;
+
+};
+
+template <>
+class TaskPromise<void>: public TaskPromiseBase<void> {
+
+public:
+
+    Task<void> get_return_object();
+
+    void return_void()
+    {}
+
+    void result()
+    {}
+
+};
+
+}
+
+/**
+ * A coroutine that returns a value of type `T`.
+ *
+ * The coroutine doesn't start when it is called: it starts when it is awaited with `co_await`
+ * from another coroutine, which is resumed when it finishes, or when it is given to
+ * `Executor::spawn()`. As the rest of the library, the coroutines report the errors in the
+ * value returned, usually an `expected`, instead of throwing exceptions.
+ */
+template <typename T = void>
+class [[nodiscard]] Task {
+
+public:
+
+    using promise_type = detail::TaskPromise<T>;
+
+    Task(Task &&other) noexcept: handle(exchange(other.handle, nullptr))
+    {}
+
+    ~Task()
+    {
+        if (handle)
+            handle.destroy();
+    }
+
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+
+    bool await_ready() const noexcept
+    {
+        return !handle || handle.done();
+    }
+
+    coroutine_handle<> await_suspend(coroutine_handle<> awaiting) noexcept
+    {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+
+    T await_resume()
+    {
+        return handle.promise().result();
+    }
+
+private:
+
+    friend class detail::TaskPromise<T>;
+
+    coroutine_handle<promise_type> handle;
+
+    explicit Task(coroutine_handle<promise_type> handle): handle(handle)
+    {}
+
+};
+
+template <typename T>
+Task<T> detail::TaskPromise<T>::get_return_object()
+{
+    return Task<T>(coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> detail::TaskPromise<void>::get_return_object()
+{
+    return Task<void>(coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+/**
+ * Executes coroutines in a single thread.
+ *
+ * The coroutines are suspended while they wait, for a delay with `sleep_for()` or for a function
+ * that completes in another thread with `await_callback()`, for instance an `I2cBus` transaction.
+ * In the meantime, the thread executes the rest of coroutines, so a single thread can interleave
+ * several slow sequences, like the initialization of several devices.
+ *
+ * The executor can own the thread, with `run()`, or be executed periodically from another loop,
+ * for instance as a stage of a `ControlLoop`, with `poll()`, which never waits. The coroutines
+ * must be spawned and awaited from the executor's thread, but they can be resumed from any thread.
+ */
+class Executor {
+
+public:
+
+    Executor(): tasks_count(0), stopped(false), timers_sequence(0)
+    {}
+
+    Executor(const Executor &) = delete;
+    Executor &operator=(const Executor &) = delete;
+
+    /**
+     * Return an awaitable for a function that completes by calling a function, possibly from
+     * another thread.
+     *
+     * `start` is called with the completion function, that accepts a `Result`, and returns an
+     * `expected<void, rfs::Error>`. If it returns an error, the completion function must not be
+     * called, and the error is the result of the `co_await`. Otherwise, the coroutine is resumed
+     * in the executor's thread with the value given to the completion function.
+     */
+    template <typename Result, typename Start>
+    auto await_callback(Start &&start)
+    {
+        return CallbackAwaiter<Result, decay_t<Start>>(*this, std::forward<Start>(start));
+    }
+
+    /**
+     * Return the number of coroutines spawned that have not finished.
+     */
+    size_t get_tasks_count() const
+    {
+        return tasks_count;
+    }
+
+    /**
+     * Resume the coroutines that are ready, without waiting, and return how many were resumed.
+     */
+    size_t poll()
+    {
+        {
+            lock_guard<mutex> lock(remote_mutex);
+            ready.insert(ready.end(), remote_ready.begin(), remote_ready.end());
+            remote_ready.clear();
+        }
+
+        const chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        while (!timers.empty() && timers.top().time <= now) {
+            ready.push_back(timers.top().handle);
+            timers.pop();
+        }
+
+        // The coroutines that become ready now are resumed in the next call
+        size_t resumed = 0;
+        for (size_t count = ready.size(); count > 0; count--) {
+            const coroutine_handle<> handle = ready.front();
+            ready.pop_front();
+            handle.resume();
+            resumed++;
+        }
+        return resumed;
+    }
+
+    /**
+     * Resume the coroutine `handle` in the executor's thread.
+     *
+     * It can be called from any thread.
+     */
+    void post(coroutine_handle<> handle)
+    {
+        // Notified with the lock held, as the executor can be destroyed as soon as it is released
+        lock_guard<mutex> lock(remote_mutex);
+        remote_ready.push_back(handle);
+        wakeup.notify_one();
+    }
+
+    /**
+     * Execute the coroutines in the calling thread until all the coroutines spawned finish, or
+     * until `stop()` is called.
+     *
+     * The thread sleeps while no coroutine is ready.
+     */
+    void run()
+    {
+        while (tasks_count > 0 && !stopped.load()) {
+            poll();
+            if (!ready.empty() || tasks_count == 0)
+                continue;
+
+            unique_lock<mutex> lock(remote_mutex);
+            if (!remote_ready.empty() || stopped.load())
+                continue;
+            if (timers.empty())
+                wakeup.wait(lock);
+            else
+                wakeup.wait_until(lock, timers.top().time);
+        }
+        stopped.store(false);
+    }
+
+    /**
+     * Return an awaitable that suspends the coroutine and resumes it after the rest of coroutines
+     * that are ready.
+     */
+    auto schedule()
+    {
+        return ScheduleAwaiter{*this};
+    }
+
+    /**
+     * Return an awaitable that resumes the coroutine after `duration`.
+     */
+    template <typename Rep, typename Period>
+    auto sleep_for(chrono::duration<Rep, Period> duration)
+    {
+        return sleep_until(chrono::steady_clock::now()
+            + chrono::duration_cast<chrono::steady_clock::duration>(duration));
+    }
+
+    /**
+     * Return an awaitable that resumes the coroutine at the instant `time`.
+     */
+    auto sleep_until(chrono::steady_clock::time_point time)
+    {
+        return SleepAwaiter{*this, time};
+    }
+
+    /**
+     * Start executing `task` in the executor, without waiting for it.
+     *
+     * Its result is discarded. The executor must be running until the task finishes, as it owns it.
+     */
+    template <typename T>
+    void spawn(Task<T> task)
+    {
+        tasks_count++;
+        detach(*this, std::move(task));
+    }
+
+    /**
+     * Make `run()` return.
+     *
+     * It can be called from any thread, also before `run()`, which then returns at once. The
+     * coroutines that didn't finish remain suspended, and continue when `run()` or `poll()` are
+     * called again.
+     */
+    void stop()
+    {
+        lock_guard<mutex> lock(remote_mutex);
+        stopped.store(true);
+        wakeup.notify_one();
+    }
+
+private:
+
+    struct Timer {
+        chrono::steady_clock::time_point time;
+        uint64_t sequence;
+        coroutine_handle<> handle;
+
+        bool operator>(const Timer &other) const
+        {
+            // The timers of the same instant expire in the order in which they were added
+            return time > other.time || (time == other.time && sequence > other.sequence);
+        }
+    };
+
+    struct ScheduleAwaiter {
+        Executor &executor;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(coroutine_handle<> handle)
+        {
+            executor.ready.push_back(handle);
+        }
+
+        void await_resume() const noexcept
+        {}
+    };
+
+    struct SleepAwaiter {
+        Executor &executor;
+        chrono::steady_clock::time_point time;
+
+        bool await_ready() const
+        {
+            return time <= chrono::steady_clock::now();
+        }
+
+        void await_suspend(coroutine_handle<> handle)
+        {
+            executor.timers.push({time, executor.timers_sequence++, handle});
+        }
+
+        void await_resume() const noexcept
+        {}
+    };
+
+    template <typename Result, typename Start>
+    class CallbackAwaiter {
+
+    public:
+
+        CallbackAwaiter(Executor &executor, Start &&start): executor(executor), start(std::move(start))
+        {}
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        bool await_suspend(coroutine_handle<> handle)
+        {
+            // The completion can run in another thread even before this method returns, but the
+            // coroutine is only resumed by the executor, after it
+            const auto started = start([this, handle](Result completion_result) {
+                result.emplace(std::move(completion_result));
+                executor.post(handle);
+            });
+            if (!started) {
+                result.emplace(unexpected(started.error()));
+                return false;
+            }
+            return true;
+        }
+
+        Result await_resume()
+        {
+            return std::move(*result);
+        }
+
+    private:
+
+        Executor &executor;
+        Start start;
+        optional<Result> result;
+
+    };
+
+    // A coroutine that destroys itself when it finishes, to own the tasks spawned
+    struct DetachedTask {
+        struct promise_type {
+            DetachedTask get_return_object() noexcept
+            {
+                return {};
+            }
+
+            suspend_never initial_suspend() noexcept
+            {
+                return {};
+            }
+
+            suspend_never final_suspend() noexcept
+            {
+                return {};
+            }
+
+            void return_void() noexcept
+            {}
+
+            void unhandled_exception() noexcept
+            {
+                terminate();
+            }
+        };
+    };
+
+    size_t tasks_count;
+    atomic<bool> stopped;
+    uint64_t timers_sequence;
+    deque<coroutine_handle<>> ready;
+    priority_queue<Timer, vector<Timer>, greater<Timer>> timers;
+    mutex remote_mutex;
+    condition_variable wakeup;
+    vector<coroutine_handle<>> remote_ready;
+
+    template <typename T>
+    static DetachedTask detach(Executor &executor, Task<T> task)
+    {
+        co_await executor.schedule();
+        co_await task;
+        executor.tasks_count--;
+    }
+
+};
+
+}
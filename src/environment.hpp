@@ -53,12 +53,16 @@ long read_env_long(const string &env, long default_value = 0, long min_value = L
 long read_env_long_indexed(const string &env, uint32_t index, long default_value = 0, long min_value = LONG_MIN, long max_value = LONG_MAX)
 {
     const string env_indexed = string(env) + "_" + to_string(index);
-    return read_env_long(env_indexed);
+    return read_env_long(env_indexed, default_value, min_value, max_value);
 }
 
 float read_env_float(const string &env, float default_value = 0.0)
 {
     const char *env_value = getenv(env.c_str());
+
+    if (!env_value)
+        return default_value;
+
     try {
         return stof(env_value);
     } catch (const exception &e) {
@@ -66,3 +70,22 @@ float read_env_float(const string &env, float default_value = 0.0)
     }
 }
 
+
+// The ways of sending messages between the processes of the robot
+enum class Transport {
+    ZeroMQ,
+    SharedMemory
+};
+
+Transport read_env_transport(const string &env, Transport default_value = Transport::ZeroMQ)
+{
+    const string value = read_env(env);
+
+    if (value == "zmq") {
+        return Transport::ZeroMQ;
+    } else if (value == "shm") {
+        return Transport::SharedMemory;
+    } else {
+        return default_value;
+    }
+}
@@ -7,10 +7,14 @@ extern "C" {
 }
 
 #include <fcntl.h>
+#include <span>
 #include <stdint.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 
+#include "i2cbackend.hpp"
+#include "metrics.hpp"
+
 namespace rfs {
 
 class i2c
@@ -18,11 +22,13 @@ class i2c
 
 private:
 
+    I2cBackend *backend;
     int fd;
 
 public:
 
-    i2c(): fd(-1) {}
+    // The backend must outlive this instance
+    i2c(I2cBackend &backend = I2cBackend::system()): backend(&backend), fd(-1) {}
 
     ~i2c()
     {
@@ -33,7 +39,7 @@ public:
 
     bool close()
     {
-        if (::close(fd) == -1) {
+        if (backend->close(fd) == -1) {
             return false;
         }
         fd = -1;
@@ -42,12 +48,12 @@ public:
 
     bool open(const char *device, uint8_t address)
     {
-        fd = ::open(device, O_RDWR);
+        fd = backend->open(device);
         if (fd < 0) {
             return false;
         }
-        if (ioctl(fd, I2C_SLAVE, address) < 0) {
-            ::close(fd);
+        if (backend->select(fd, address) < 0) {
+            backend->close(fd);
             fd = -1;
             return false;
         }
@@ -56,33 +62,40 @@ public:
 
     uint8_t read_block(uint8_t reg, uint8_t size, uint8_t *data, bool &error) const
     {
-        const int read_result = i2c_smbus_read_i2c_block_data(fd, reg, size, data);
+        const int read_result = metrics::measure_i2c(size, [&]() { return backend->read_block_data(fd, reg, size, data); });
         error = read_result < 0;
         return read_result;
     }
 
     uint8_t read_register(uint8_t reg, uint8_t size, bool &error) const
     {
-        const int read_result = i2c_smbus_read_byte_data(fd, reg);
+        const int read_result = metrics::measure_i2c(1, [&]() { return backend->read_byte_data(fd, reg); });
         error = read_result < 0;
         return read_result & 0x00ff;
     }
 
     uint8_t write_block(uint8_t reg, const uint8_t *data, uint8_t size, bool &error) const
     {
-        const int write_result = i2c_smbus_write_i2c_block_data(fd, reg, size, data);
+        const int write_result = metrics::measure_i2c(size, [&]() { return backend->write_block_data(fd, reg, size, data); });
         error = write_result < 0;
         return write_result;
     }
 
     bool write_byte(uint8_t value) const
     {
-        return i2c_smbus_write_byte(fd, value) >= 0;
+        return metrics::measure_i2c(1, [&]() { return backend->write_byte(fd, value); }) >= 0;
+    }
+
+    // Write the bytes in a single plain I2C transfer, without register address
+    bool write_bytes(std::span<const uint8_t> data) const
+    {
+        return metrics::measure_i2c(data.size(), [&]() { return backend->write(fd, data.data(), data.size()); })
+            == static_cast<ssize_t>(data.size());
     }
 
     bool write_register(uint8_t reg, uint8_t value) const
     {
-        return i2c_smbus_write_byte_data(fd, reg, value) >= 0;
+        return metrics::measure_i2c(1, [&]() { return backend->write_byte_data(fd, reg, value); }) >= 0;
     }
 
 };
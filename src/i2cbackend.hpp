@@ -0,0 +1,134 @@
+#pragma once
+
+extern "C"
+{
+    #include <fcntl.h>
+    #include <i2c/smbus.h>
+    #include <linux/i2c.h>
+    #include <linux/i2c-dev.h>
+    #include <sys/ioctl.h>
+    #include <unistd.h>
+}
+
+#include <cstddef>
+#include <cstdint>
+
+namespace rfs {
+
+/**
+ * The access to the I<SUP>2</SUP>C controllers, through which the classes of the devices communicate.
+ *
+ * This class calls the Linux I<SUP>2</SUP>C driver, and it is the one used by default (see
+ * `system()`). Its subclasses can replace the controllers, for instance `I2cSimulator`, to run the
+ * devices without hardware. Each method does the same as the system call or SMBus function that it
+ * replaces, with the same return values: in case of error, they return a negative value and set
+ * `errno`.
+ */
+class I2cBackend {
+
+public:
+
+    virtual ~I2cBackend()
+    {}
+
+    /**
+     * Close the controller. See `close(2)`.
+     */
+    virtual int close(int fd)
+    {
+        return ::close(fd);
+    }
+
+    /**
+     * Get the functionalities of the controller. See the `I2C_FUNCS` ioctl.
+     */
+    virtual int functionalities(int fd, unsigned long *funcs)
+    {
+        return ::ioctl(fd, I2C_FUNCS, funcs);
+    }
+
+    /**
+     * Open the controller with the path `device`. See `open(2)`.
+     */
+    virtual int open(const char *device)
+    {
+        return ::open(device, O_RDWR);
+    }
+
+    /**
+     * Read `size` bytes starting at the register `reg`. See `i2c_smbus_read_i2c_block_data()`.
+     */
+    virtual int32_t read_block_data(int fd, uint8_t reg, uint8_t size, uint8_t *data)
+    {
+        return i2c_smbus_read_i2c_block_data(fd, reg, size, data);
+    }
+
+    /**
+     * Read the register `reg`. See `i2c_smbus_read_byte_data()`.
+     */
+    virtual int32_t read_byte_data(int fd, uint8_t reg)
+    {
+        return i2c_smbus_read_byte_data(fd, reg);
+    }
+
+    /**
+     * Select the device to which the rest of methods go, except `transfer()`. See the `I2C_SLAVE` ioctl.
+     */
+    virtual int select(int fd, uint16_t address)
+    {
+        return ::ioctl(fd, I2C_SLAVE, address);
+    }
+
+    /**
+     * Execute several messages in a single transfer. See the `I2C_RDWR` ioctl.
+     */
+    virtual int transfer(int fd, i2c_msg *messages, uint32_t messages_count)
+    {
+        i2c_rdwr_ioctl_data data{messages, messages_count};
+        return ::ioctl(fd, I2C_RDWR, &data);
+    }
+
+    /**
+     * Write `size` bytes in a plain I<SUP>2</SUP>C transfer, without register address. See `write(2)`.
+     */
+    virtual ssize_t write(int fd, const uint8_t *data, size_t size)
+    {
+        return ::write(fd, data, size);
+    }
+
+    /**
+     * Write `size` bytes starting at the register `reg`. See `i2c_smbus_write_i2c_block_data()`.
+     */
+    virtual int32_t write_block_data(int fd, uint8_t reg, uint8_t size, const uint8_t *data)
+    {
+        return i2c_smbus_write_i2c_block_data(fd, reg, size, data);
+    }
+
+    /**
+     * Write a byte without register address. See `i2c_smbus_write_byte()`.
+     */
+    virtual int32_t write_byte(int fd, uint8_t value)
+    {
+        return i2c_smbus_write_byte(fd, value);
+    }
+
+    /**
+     * Write the register `reg`. See `i2c_smbus_write_byte_data()`.
+     */
+    virtual int32_t write_byte_data(int fd, uint8_t reg, uint8_t value)
+    {
+        return i2c_smbus_write_byte_data(fd, reg, value);
+    }
+
+    /**
+     * Return the backend that calls the Linux I<SUP>2</SUP>C driver.
+     */
+    static I2cBackend &system()
+    {
+        static I2cBackend backend;
+        return backend;
+    }
+
+};
+
+}
@@ -0,0 +1,398 @@
+#pragma once
+
+extern "C"
+{
+    #include <linux/i2c.h>
+    #include <linux/i2c-dev.h>
+}
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cinttypes>
+#include <expected>
+#include <functional>
+#include <future>
+#include <span>
+#include <string>
+#include <thread>
+
+#include "coroutine.hpp"
+#include "error.hpp"
+#include "i2cbackend.hpp"
+#include "lockfree.hpp"
+#include "metrics.hpp"
+
+using namespace std;
+
+namespace rfs {
+
+/**
+ * The priority classes of the I<SUP>2</SUP>C transactions submitted to an `I2cBus`.
+ *
+ * Pending transactions of a higher priority are always executed before the ones of a lower priority.
+ */
+enum class I2cPriority {
+    /**
+     * For transactions in the control loop, like sending the servo positions.
+     */
+    High    = 0,
+
+    /**
+     * For general purpose transactions, like reading sensors or configuring devices.
+     */
+    Normal  = 1,
+
+    /**
+     * For transactions that can wait, like writing text in a display.
+     */
+    Low     = 2
+};
+
+/**
+ * The function called when a transaction submitted to an `I2cBus` is completed.
+ *
+ * It is called in the thread of the `I2cBus`, so it must return quickly.
+ */
+using I2cCompletion = function<void(expected<void, rfs::Error>)>;
+
+/**
+ * An executor that owns an I<SUP>2</SUP>C bus and executes the transactions on it in its own thread.
+ *
+ * Several threads can submit transactions to the same `I2cBus` without blocking. Each transaction
+ * is addressed to a device on the bus, and it is made of an optional write followed by an optional
+ * read, executed as a single combined `I2C_RDWR` transfer. Use `I2cBusDevice` to send transactions
+ * to a given device.
+ *
+ * The I<SUP>2</SUP>C controller must support plain I<SUP>2</SUP>C transfers (not only SMBus).
+ */
+class I2cBus {
+
+public:
+
+    /**
+     * The maximum number of bytes written in a single transaction.
+     */
+    static constexpr size_t MAX_WRITE_SIZE = 128;
+
+    /**
+     * The maximum number of pending transactions of each priority.
+     */
+    static constexpr size_t QUEUE_SIZE = 64;
+
+    /**
+     * Create the bus, closed.
+     *
+     * `backend` is the access to the I<SUP>2</SUP>C controller, the system's one by default. It
+     * must outlive this instance.
+     */
+    I2cBus(I2cBackend &backend = I2cBackend::system()): backend(&backend), fd(-1), running(false), pending(0),
+        submitters(0)
+    {}
+
+    ~I2cBus()
+    {
+        if (fd >= 0)
+            close();
+    }
+
+    I2cBus(const I2cBus &) = delete;
+    I2cBus &operator=(const I2cBus &) = delete;
+
+    /**
+     * Stop the bus thread and close the I<SUP>2</SUP>C controller.
+     *
+     * The transactions still pending are completed with an `ECANCELED` error, in the calling
+     * thread. The ones submitted concurrently are either completed the same way or rejected with
+     * an `ENOTCONN` error, but never lost.
+     */
+    expected<void, rfs::Error> close()
+    {
+        if (worker.joinable()) {
+            running.store(false);
+
+            // The submitters that saw the bus running finish inserting their transactions
+            for (uint32_t count = submitters.load(); count != 0; count = submitters.load())
+                submitters.wait(count);
+
+            pending.fetch_add(1);
+            pending.notify_one();
+            worker.join();
+
+            Transaction transaction;
+            while (next(transaction)) {
+                if (transaction.on_complete)
+                    transaction.on_complete(unexpected(rfs::Error(ECANCELED)));
+            }
+        }
+
+        if (backend->close(fd) == -1)
+            return unexpected(rfs::Error(errno));
+        fd = -1;
+        return {};
+    }
+
+    /**
+     * Open the I<SUP>2</SUP>C controller and start the bus thread.
+     *
+     * `device` is the path in the filesystem of the I<SUP>2</SUP>C controller, usually something
+     * like `/dev/i2c-1`. Returns an `EBUSY` error if the bus is already open.
+     */
+    expected<void, rfs::Error> open(const string &device)
+    {
+        if (worker.joinable())
+            return unexpected(rfs::Error(EBUSY));
+
+        fd = backend->open(device.c_str());
+        if (fd < 0)
+            return unexpected(rfs::Error(errno));
+
+        unsigned long funcs = 0;
+        if (backend->functionalities(fd, &funcs) < 0 || !(funcs & I2C_FUNC_I2C)) {
+            backend->close(fd);
+            fd = -1;
+            return unexpected(rfs::Error(EOPNOTSUPP, "plain I2C transfers not supported"));
+        }
+
+        pending.store(0);
+        running.store(true);
+        worker = thread(&I2cBus::run, this);
+        return {};
+    }
+
+    /**
+     * Submit a transaction, and call `on_complete` when it is done.
+     *
+     * The transaction writes `write_data` to the device with the given 7-bit `address` and then
+     * reads `read_data.size()` bytes into `read_data`. Any of them can be empty. The contents of
+     * `write_data` are copied, but `read_data` must remain valid until the transaction is completed.
+     *
+     * Returns an `EAGAIN` error if there are too many pending transactions of the given `priority`,
+     * or an `ENOTCONN` error if the bus is not open, in which case `on_complete` is not called.
+     */
+    expected<void, rfs::Error> submit(I2cPriority priority, uint16_t address, span<const uint8_t> write_data,
+        span<uint8_t> read_data, I2cCompletion on_complete)
+    {
+        if (write_data.size() > MAX_WRITE_SIZE)
+            return unexpected(rfs::Error(EINVAL, "write_data too big"));
+
+        // Counted before checking that it runs, so close() waits for the transaction to be inserted
+        submitters.fetch_add(1);
+        const expected<void, rfs::Error> result = running.load()
+            ? push(priority, address, write_data, read_data, std::move(on_complete))
+            : unexpected(rfs::Error(ENOTCONN));
+        if (submitters.fetch_sub(1) == 1)
+            submitters.notify_all();
+        return result;
+    }
+
+    /**
+     * Submit a transaction, and return a future that holds its result.
+     *
+     * It works as the other `submit()` method, but the errors while submitting are also
+     * returned through the future.
+     */
+    future<expected<void, rfs::Error>> submit(I2cPriority priority, uint16_t address,
+        span<const uint8_t> write_data, span<uint8_t> read_data = {})
+    {
+        shared_ptr<promise<expected<void, rfs::Error>>> result = make_shared<promise<expected<void, rfs::Error>>>();
+        future<expected<void, rfs::Error>> result_future = result->get_future();
+
+        const expected<void, rfs::Error> submit_result = submit(priority, address, write_data, read_data,
+            [result](expected<void, rfs::Error> transaction_result) { result->set_value(transaction_result); });
+        if (!submit_result)
+            result->set_value(submit_result);
+        return result_future;
+    }
+
+private:
+
+    struct Transaction {
+        uint16_t address;
+        uint16_t write_size;
+        array<uint8_t, MAX_WRITE_SIZE> write_data;
+        span<uint8_t> read_data;
+        I2cCompletion on_complete;
+    };
+
+    static constexpr size_t PRIORITIES_COUNT = 3;
+
+    I2cBackend *backend;
+    int fd;
+    thread worker;
+    atomic<bool> running;
+    atomic<uint32_t> pending;
+    atomic<uint32_t> submitters;
+    array<MpscQueue<Transaction, QUEUE_SIZE>, PRIORITIES_COUNT> queues;
+
+    expected<void, rfs::Error> execute(Transaction &transaction)
+    {
+        i2c_msg messages[2];
+        uint32_t messages_count = 0;
+        if (transaction.write_size > 0)
+            messages[messages_count++] = {transaction.address, 0, transaction.write_size, transaction.write_data.data()};
+        if (!transaction.read_data.empty())
+            messages[messages_count++] = {transaction.address, I2C_M_RD,
+                static_cast<uint16_t>(transaction.read_data.size()), transaction.read_data.data()};
+        if (messages_count == 0)
+            return {};
+
+        if (metrics::measure_i2c(transaction.write_size + transaction.read_data.size(),
+            [&]() { return backend->transfer(fd, messages, messages_count); }) < 0)
+            return unexpected(rfs::Error(errno));
+        return {};
+    }
+
+    bool next(Transaction &transaction)
+    {
+        for (MpscQueue<Transaction, QUEUE_SIZE> &queue: queues) {
+            if (queue.pop(transaction))
+                return true;
+        }
+        return false;
+    }
+
+    expected<void, rfs::Error> push(I2cPriority priority, uint16_t address, span<const uint8_t> write_data,
+        span<uint8_t> read_data, I2cCompletion on_complete)
+    {
+        Transaction transaction;
+        transaction.address = address;
+        transaction.write_size = write_data.size();
+        copy(write_data.begin(), write_data.end(), transaction.write_data.begin());
+        transaction.read_data = read_data;
+        transaction.on_complete = std::move(on_complete);
+
+        // Counted before inserting it, so the bus thread never sees more transactions than counted
+        pending.fetch_add(1, memory_order_release);
+        if (!queues[static_cast<size_t>(priority)].push(std::move(transaction))) {
+            pending.fetch_sub(1, memory_order_relaxed);
+            return unexpected(rfs::Error(EAGAIN));
+        }
+        pending.notify_one();
+        return {};
+    }
+
+    void run()
+    {
+        Transaction transaction;
+        while (running.load()) {
+            pending.wait(0, memory_order_acquire);
+
+            // The queues are checked again after each transaction, so higher priorities go first
+            while (next(transaction)) {
+                pending.fetch_sub(1, memory_order_relaxed);
+                const expected<void, rfs::Error> result = execute(transaction);
+                if (transaction.on_complete)
+                    transaction.on_complete(result);
+            }
+        }
+    }
+
+};
+
+/**
+ * A device in an `I2cBus`.
+ *
+ * It submits the transactions to the bus with the device's address and a given priority. It also
+ * has blocking methods with the same interface as `i2c`, so it can be used with `i2cdisplay`, and
+ * awaitable methods, to be used from the coroutines of an `Executor`.
+ */
+class I2cBusDevice {
+
+public:
+
+    I2cBusDevice(I2cBus &bus, uint16_t address, I2cPriority priority = I2cPriority::Normal):
+        bus(&bus), address(address), priority(priority)
+    {}
+
+    /**
+     * Return an awaitable that writes `data` to the device, and resumes the coroutine in
+     * `executor` when the transaction is completed.
+     *
+     * `data` is copied when the awaitable is awaited. The result of `co_await` is the result of
+     * the transaction.
+     */
+    auto async_write(Executor &executor, span<const uint8_t> data) const
+    {
+        return executor.await_callback<expected<void, rfs::Error>>(
+            [this, data](I2cCompletion on_complete) {
+                return bus->submit(priority, address, data, {}, std::move(on_complete));
+            });
+    }
+
+    /**
+     * Return an awaitable that writes `write_data` to the device and then reads
+     * `read_data.size()` bytes from it, and resumes the coroutine in `executor` when done.
+     *
+     * `read_data` must remain valid until the coroutine is resumed.
+     */
+    auto async_write_read(Executor &executor, span<const uint8_t> write_data, span<uint8_t> read_data) const
+    {
+        return executor.await_callback<expected<void, rfs::Error>>(
+            [this, write_data, read_data](I2cCompletion on_complete) {
+                return bus->submit(priority, address, write_data, read_data, std::move(on_complete));
+            });
+    }
+
+    /**
+     * Write `data` to the device.
+     */
+    future<expected<void, rfs::Error>> write(span<const uint8_t> data) const
+    {
+        return bus->submit(priority, address, data);
+    }
+
+    /**
+     * Write `data` to the device, and call `on_complete` when done.
+     *
+     * See `I2cBus::submit()`.
+     */
+    expected<void, rfs::Error> write(span<const uint8_t> data, I2cCompletion on_complete) const
+    {
+        return bus->submit(priority, address, data, {}, std::move(on_complete));
+    }
+
+    /**
+     * Write `write_data` to the device and then read `read_data.size()` bytes from it.
+     *
+     * `read_data` must remain valid until the future is ready.
+     */
+    future<expected<void, rfs::Error>> write_read(span<const uint8_t> write_data, span<uint8_t> read_data) const
+    {
+        return bus->submit(priority, address, write_data, read_data);
+    }
+
+    /**
+     * Write a single byte to the device, and wait for the transaction to complete.
+     */
+    bool write_byte(uint8_t value) const
+    {
+        return write(span<const uint8_t>(&value, 1)).get().has_value();
+    }
+
+    /**
+     * Write several bytes to the device in a single transaction, and wait for it to complete.
+     */
+    bool write_bytes(span<const uint8_t> data) const
+    {
+        return write(data).get().has_value();
+    }
+
+    /**
+     * Write a register of the device, and wait for the transaction to complete.
+     */
+    bool write_register(uint8_t reg, uint8_t value) const
+    {
+        const array<uint8_t, 2> data{reg, value};
+        return write(data).get().has_value();
+    }
+
+private:
+
+    I2cBus *bus;
+    uint16_t address;
+    I2cPriority priority;
+
+};
+
+}
@@ -1,11 +1,39 @@
 
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <concepts>
+#include <expected>
+#include <span>
 #include <string_view>
 
+#include <unistd.h>
+
+#include "coroutine.hpp"
+#include "error.hpp"
+#include "metrics.hpp"
+
 namespace rfs {
 
+// The delays applied when writing to the display. The defaults are the minimums of the HD44780
+// datasheet plus a margin, and can be increased for slower display controllers.
+struct i2cdisplay_delays
+{
+    // Width of the ENABLE pulse (>= 450 ns)
+    unsigned int enable_pulse_us = 1;
+
+    // After most commands and characters (>= 37 us)
+    unsigned int command_us = 50;
+
+    // After the clear and return home commands (>= 1.52 ms)
+    unsigned int long_command_us = 2000;
+
+    // After each step of the initialization sequence (>= 4.1 ms)
+    unsigned int init_us = 4500;
+};
+
 
 template <typename T>
 class i2cdisplay
@@ -47,8 +75,13 @@ private:
     static constexpr uint8_t ENABLE = 0x04;
     static constexpr uint8_t REGISTER_SELECT = 0x01;
     static constexpr uint8_t CHAR = 0x01;
-    static constexpr unsigned int DELAY_US = 600;
     static constexpr uint8_t MAX_ROWS = 4;
+    static constexpr uint8_t MAX_COLUMNS = 40;
+
+    // Bytes sent to the I2C expander to write a byte in the display (3 per nibble)
+    static constexpr size_t BYTES_PER_WRITE = 6;
+    static constexpr size_t MAX_STREAM_CHARS = 16;
+    static constexpr size_t MAX_REFRESH_SIZE = MAX_ROWS * MAX_COLUMNS * 2 * BYTES_PER_WRITE + BYTES_PER_WRITE;
 
 
 // Public static constants
@@ -69,24 +102,145 @@ private:
     uint8_t backlight;
     uint8_t display_mode;
     uint8_t display_control;
+    i2cdisplay_delays delays;
+    bool streaming;
+
+    // Framebuffer
+    bool framebuffer;
+    uint8_t cursor_row;
+    uint8_t cursor_column;
+    std::array<char, MAX_ROWS * MAX_COLUMNS> frame;
+    std::array<char, MAX_ROWS * MAX_COLUMNS> flushed_frame;
+    bool flushed_valid;
+
+    // Bytes of the refresh in progress
+    std::array<uint8_t, MAX_REFRESH_SIZE> refresh_data;
+    size_t refresh_size;
+    size_t refresh_position;
+    std::atomic<bool> refreshing;
+    std::atomic<bool> refresh_failed;
 
 
 // Private methods
 
 private:
 
+    // Whether the driver can write without blocking, calling a function when done
+    static constexpr bool ASYNC_DRIVER = requires(const T &driver, std::span<const uint8_t> data) {
+        driver.write(data, [](std::expected<void, rfs::Error>) {});
+    };
+
+    // Whether the driver can write several bytes in a single transfer
+    static constexpr bool STREAMING_DRIVER = requires(const T &driver, std::span<const uint8_t> data) {
+        { driver.write_bytes(data) } -> std::convertible_to<bool>;
+    };
+
+    static void delay(unsigned int us)
+    {
+        if (us > 0) {
+            usleep(us);
+            metrics::display_sleep_seconds.add(us);
+        }
+    }
+
     bool write_to_i2c(uint8_t value) const
     {
+        // Don't mix the bytes with the ones of a refresh in progress
+        wait_refresh();
         return i2c_driver.write_byte(value | backlight);
     }
 
+    uint8_t ddram_address(uint8_t row, uint8_t column) const
+    {
+        const std::array ROW_OFFSETS = {0x00, 0x40, 0x00 + columns, 0x40 + columns};
+        return SET_DDRAM_ADDR | (ROW_OFFSETS[row] + column);
+    }
+
+    // The PCF8574 latches each byte as it arrives, so the bus clock gives the ENABLE pulse timing
+    uint8_t *encode_byte(uint8_t value, uint8_t mode, uint8_t *data) const
+    {
+        const uint8_t nibbles[2] = {static_cast<uint8_t>(value & 0xf0), static_cast<uint8_t>((value << 4) & 0xf0)};
+        for (uint8_t nibble: nibbles) {
+            const uint8_t nibble_data = nibble | mode | backlight;
+            *data++ = nibble_data;
+            *data++ = nibble_data | ENABLE;
+            *data++ = nibble_data & ~ENABLE;
+        }
+        return data;
+    }
+
+    void encode_byte(uint8_t value, uint8_t mode)
+    {
+        encode_byte(value, mode, refresh_data.data() + refresh_size);
+        refresh_size += BYTES_PER_WRITE;
+    }
+
+    void encode_refresh()
+    {
+        refresh_size = 0;
+        refresh_position = 0;
+
+        // The display's address counter moves to the next cell after each write
+        const bool increments = display_mode & ENTRY_LEFT;
+        int next_cell = -1;
+        for (uint8_t row = 0; row < rows; row++) {
+            for (uint8_t column = 0; column < columns; column++) {
+                const int cell = row * MAX_COLUMNS + column;
+                if (flushed_valid && frame[cell] == flushed_frame[cell])
+                    continue;
+
+                if (cell != next_cell || !increments)
+                    encode_byte(ddram_address(row, column), 0);
+                encode_byte(frame[cell], CHAR);
+                flushed_frame[cell] = frame[cell];
+                next_cell = cell + 1;
+            }
+        }
+
+        // Leave the visible cursor where the framebuffer's cursor is
+        if ((display_control & (CURSOR_ON | BLINK_ON)) && refresh_size > 0)
+            encode_byte(ddram_address(cursor_row, cursor_column), 0);
+        flushed_valid = true;
+    }
+
+    void refresh_step()
+    {
+        while (refresh_position < refresh_size) {
+            // When streaming, a whole display byte is sent at once
+            const size_t size = streaming ? std::min(BYTES_PER_WRITE, refresh_size - refresh_position) : 1;
+            const std::span<const uint8_t> data(&refresh_data[refresh_position], size);
+            refresh_position += size;
+
+            if constexpr (ASYNC_DRIVER) {
+                // Continue from the bus thread when these bytes have been written
+                const auto result = i2c_driver.write(data,
+                    [this](std::expected<void, rfs::Error> write_result) {
+                        if (!write_result)
+                            refresh_failed.store(true);
+                        refresh_step();
+                    });
+                if (result)
+                    return;
+                refresh_failed.store(true);
+                break;
+            } else if constexpr (STREAMING_DRIVER) {
+                if (!(streaming ? i2c_driver.write_bytes(data) : i2c_driver.write_byte(data[0])))
+                    refresh_failed.store(true);
+            } else {
+                if (!i2c_driver.write_byte(data[0]))
+                    refresh_failed.store(true);
+            }
+        }
+
+        refreshing.store(false, std::memory_order_release);
+        refreshing.notify_all();
+    }
+
     bool send_enable_pulse(uint8_t value) const
     {
-        usleep(DELAY_US);
         const bool result_enable = write_to_i2c(value | ENABLE);
-        usleep(DELAY_US);
+        delay(delays.enable_pulse_us);
         const bool result_disable = write_to_i2c(value & ~ENABLE);
-        usleep(DELAY_US);
 
         return result_enable && result_disable;
     }
@@ -98,10 +252,28 @@ private:
 
     bool write_byte(uint8_t value, uint8_t mode) const
     {
-        const uint8_t high_nibble = value & 0xf0;
-        const uint8_t low_nibble = (value << 4) & 0xf0;
+        bool result;
+        if (streaming) {
+            std::array<uint8_t, BYTES_PER_WRITE> data;
+            encode_byte(value, mode, data.data());
+            result = write_bytes_to_i2c(data);
+        } else {
+            const uint8_t high_nibble = value & 0xf0;
+            const uint8_t low_nibble = (value << 4) & 0xf0;
+            result = write_nibble(high_nibble | mode) && write_nibble(low_nibble | mode);
+        }
+        delay(delays.command_us);
 
-        return write_nibble(high_nibble | mode) && write_nibble(low_nibble | mode);
+        return result;
+    }
+
+    bool write_bytes_to_i2c(std::span<const uint8_t> data) const
+    {
+        wait_refresh();
+        if constexpr (STREAMING_DRIVER)
+            return i2c_driver.write_bytes(data);
+        else
+            return false;
     }
 
     bool send_command(uint8_t command) const
@@ -109,25 +281,177 @@ private:
         return write_byte(command, 0);
     }
 
+    // Write to the I2C expander, suspending the coroutine instead of blocking if the driver is asynchronous
+    Task<bool> async_write_to_i2c(Executor &executor, std::span<const uint8_t> data) const
+    {
+        if constexpr (ASYNC_DRIVER) {
+            const std::expected<void, rfs::Error> result = co_await executor.await_callback<std::expected<void, rfs::Error>>(
+                [this, data](auto on_complete) { return i2c_driver.write(data, std::move(on_complete)); });
+            co_return result.has_value();
+        } else if constexpr (STREAMING_DRIVER) {
+            co_return i2c_driver.write_bytes(data);
+        } else {
+            bool result = true;
+            for (const uint8_t value: data)
+                result &= i2c_driver.write_byte(value);
+            co_return result;
+        }
+    }
+
+    // As write_byte(), but the delays are timers of the executor. The ENABLE pulse is given by the
+    // bus clock, as in a refresh.
+    Task<bool> async_write_byte(Executor &executor, uint8_t value, uint8_t mode, unsigned int delay_us) const
+    {
+        std::array<uint8_t, BYTES_PER_WRITE> data;
+        encode_byte(value, mode, data.data());
+
+        bool result = true;
+        if (streaming) {
+            result = co_await async_write_to_i2c(executor, data);
+        } else {
+            for (size_t i = 0; i < data.size(); i++)
+                result &= co_await async_write_to_i2c(executor, std::span<const uint8_t>(&data[i], 1));
+        }
+        if (delay_us > 0)
+            co_await executor.sleep_for(std::chrono::microseconds(delay_us));
+        co_return result;
+    }
+
 
 // Public functions
 
 public:
 
     i2cdisplay(uint8_t rows, uint8_t columns, const T &i2c_driver):
-        rows(std::min(rows, MAX_ROWS)),
-        columns(columns),
+        // At least one row, as the cursor row is limited to rows - 1
+        rows(std::clamp<uint8_t>(rows, 1, MAX_ROWS)),
+        columns(std::min(columns, MAX_COLUMNS)),
         i2c_driver(i2c_driver),
         backlight(0),
         display_mode(ENTRY_LEFT),
-        display_control(DISPLAY_ON)
+        display_control(DISPLAY_ON),
+        streaming(false),
+        framebuffer(false),
+        cursor_row(0),
+        cursor_column(0),
+        flushed_valid(false),
+        refresh_size(0),
+        refresh_position(0),
+        refreshing(false),
+        refresh_failed(false)
     {
-
+        frame.fill(' ');
     }
 
     ~i2cdisplay()
     {
+        wait_refresh();
+    }
+
+    /**
+     * Initialize the display, as `init()`, without blocking the executor.
+     *
+     * The delays are timers of `executor`, and if the driver can write without blocking (like
+     * `I2cBusDevice`) the transfers are awaited too, so the executor's thread runs other coroutines
+     * in the meantime. As the other asynchronous methods, it returns `false` without doing anything
+     * if a refresh is in progress, and it must not be mixed with other calls to the display until
+     * it finishes.
+     */
+    Task<bool> async_init(Executor &executor)
+    {
+        if (refresh_in_progress())
+            co_return false;
+
+        bool result = true;
+        for (const uint8_t command: {0x03, 0x03, 0x03})
+            result &= co_await async_write_byte(executor, command, 0, delays.command_us + delays.init_us);
+        result &= co_await async_write_byte(executor, 0x02, 0, delays.command_us);
+
+        result &= co_await async_write_byte(executor, ENTRY_MODE_SET | display_mode, 0, delays.command_us);
+        result &= co_await async_write_byte(executor, FUNCTION_SET | LINE_2, 0, delays.command_us);
+        display_control |= DISPLAY_ON;
+        result &= co_await async_write_byte(executor, DISPLAY_CONTROL | display_control, 0, delays.command_us);
+        result &= co_await async_clear(executor);
+        result &= co_await async_go_home(executor);
+
+        co_return result;
+    }
+
+    /**
+     * Clear the display, as `clear()`, without blocking the executor.
+     *
+     * See `async_init()`.
+     */
+    Task<bool> async_clear(Executor &executor)
+    {
+        if (framebuffer)
+            co_return clear();
+        if (refresh_in_progress())
+            co_return false;
+        co_return co_await async_write_byte(executor, CLEAR_DISPLAY, 0, delays.command_us + delays.long_command_us);
+    }
 
+    /**
+     * Move the cursor to the first cell, as `go_home()`, without blocking the executor.
+     *
+     * See `async_init()`.
+     */
+    Task<bool> async_go_home(Executor &executor)
+    {
+        if (framebuffer)
+            co_return go_home();
+        if (refresh_in_progress())
+            co_return false;
+        co_return co_await async_write_byte(executor, RETURN_HOME, 0, delays.command_us + delays.long_command_us);
+    }
+
+    /**
+     * Print `str`, as `print()`, without blocking the executor.
+     *
+     * `str` must remain valid until the task finishes. See `async_init()`.
+     */
+    Task<bool> async_print(Executor &executor, std::string_view str)
+    {
+        if (framebuffer)
+            co_return print(str);
+        if (refresh_in_progress())
+            co_return false;
+
+        bool result = true;
+        if (streaming) {
+            // As in print(), several characters per transfer
+            std::array<uint8_t, MAX_STREAM_CHARS * BYTES_PER_WRITE> data;
+            while (!str.empty()) {
+                const std::string_view chunk = str.substr(0, MAX_STREAM_CHARS);
+                uint8_t *end = data.data();
+                for (const char c: chunk)
+                    end = encode_byte(c, CHAR, end);
+                result &= co_await async_write_to_i2c(executor, std::span<const uint8_t>(data.data(), end));
+                co_await executor.sleep_for(std::chrono::microseconds(delays.command_us));
+                str.remove_prefix(chunk.size());
+            }
+            co_return result;
+        }
+
+        for (const char c: str)
+            result &= co_await async_write_byte(executor, c, CHAR, delays.command_us);
+        co_return result;
+    }
+
+    /**
+     * Move the cursor, as `set_cursor_position()`, without blocking the executor.
+     *
+     * See `async_init()`.
+     */
+    Task<bool> async_set_cursor_position(Executor &executor, uint8_t row, uint8_t column)
+    {
+        if (framebuffer)
+            co_return set_cursor_position(row, column);
+        if (refresh_in_progress())
+            co_return false;
+        row = std::min<uint8_t>(rows - 1, row);
+        column = std::min(columns, column);
+        co_return co_await async_write_byte(executor, ddram_address(row, column), 0, delays.command_us);
     }
 
     bool init()
@@ -135,8 +459,11 @@ public:
         uint8_t display_function = LINE_2;
 
         bool result = send_command(0x03);
+        delay(delays.init_us);
         result &= send_command(0x03);
+        delay(delays.init_us);
         result &= send_command(0x03);
+        delay(delays.init_us);
         result &= send_command(0x02);
 
         result &= send_command(ENTRY_MODE_SET | display_mode);
@@ -148,9 +475,17 @@ public:
         return result;
     }
 
-    bool clear() const
+    bool clear()
     {
-        return send_command(CLEAR_DISPLAY);
+        if (framebuffer) {
+            frame.fill(' ');
+            cursor_row = 0;
+            cursor_column = 0;
+            return true;
+        }
+        const bool result = send_command(CLEAR_DISPLAY);
+        delay(delays.long_command_us);
+        return result;
     }
 
     bool create_char(uint8_t slot, const std::array<uint8_t, CUSTOM_SYMBOL_SIZE> &char_map) const
@@ -163,19 +498,47 @@ public:
         return result;
     }
 
-    bool go_home() const
+    bool go_home()
     {
-        return send_command(RETURN_HOME);
+        if (framebuffer) {
+            cursor_row = 0;
+            cursor_column = 0;
+            return true;
+        }
+        const bool result = send_command(RETURN_HOME);
+        delay(delays.long_command_us);
+        return result;
     }
 
-    bool print(char character) const
+    bool print(char character)
     {
+        if (framebuffer) {
+            // The characters beyond the last column are lost
+            if (cursor_column < columns)
+                frame[cursor_row * MAX_COLUMNS + cursor_column++] = character;
+            return true;
+        }
         return write_byte(character, CHAR);
     }
 
-    bool print(std::string_view str) const
+    bool print(std::string_view str)
     {
         bool result = true;
+        if (streaming && !framebuffer) {
+            // Several characters per transfer, the bus clock gives the time between them
+            std::array<uint8_t, MAX_STREAM_CHARS * BYTES_PER_WRITE> data;
+            while (!str.empty()) {
+                const std::string_view chunk = str.substr(0, MAX_STREAM_CHARS);
+                uint8_t *end = data.data();
+                for (const char c: chunk)
+                    end = encode_byte(c, CHAR, end);
+                result &= write_bytes_to_i2c(std::span<const uint8_t>(data.data(), end));
+                delay(delays.command_us);
+                str.remove_prefix(chunk.size());
+            }
+            return result;
+        }
+
         for (const char c: str)
         {
             result &= print(c);
@@ -183,6 +546,42 @@ public:
         return result;
     }
 
+    /**
+     * Send to the display the cells of the framebuffer that changed since the last refresh.
+     *
+     * A cursor move is only sent before a cell that doesn't follow the previous one sent. If the
+     * driver can write without blocking (like `I2cBusDevice`), the bytes are sent from the bus thread
+     * and this method returns immediately. Otherwise, they are sent before returning.
+     *
+     * Returns `false` if a previous refresh is still in progress, in which case nothing is done,
+     * or if the previous refresh failed, in which case the whole display is sent again.
+     */
+    bool refresh()
+    {
+        if (refreshing.load(std::memory_order_acquire))
+            return false;
+
+        const bool previous_failed = refresh_failed.exchange(false);
+        if (previous_failed)
+            flushed_valid = false;
+
+        encode_refresh();
+        if (refresh_size == 0)
+            return !previous_failed;
+
+        refreshing.store(true, std::memory_order_release);
+        refresh_step();
+        return !previous_failed;
+    }
+
+    /**
+     * Return whether a refresh is in progress.
+     */
+    bool refresh_in_progress() const
+    {
+        return refreshing.load(std::memory_order_acquire);
+    }
+
     bool scroll_left() const
     {
         return send_command(CURSOR_SHIFT | DISPLAY_MOVE);
@@ -241,13 +640,48 @@ public:
         return send_command(DISPLAY_CONTROL | display_control);
     }
 
-    bool set_cursor_position(uint8_t row, uint8_t column) const
+    bool set_cursor_position(uint8_t row, uint8_t column)
     {
-        const std::array ROW_OFFSETS = {0x00, 0x40, 0x00 + columns, 0x40 + columns};
-
-        row = std::min(rows, row);
+        row = std::min<uint8_t>(rows - 1, row);
         column = std::min(columns, column);
-        return send_command(SET_DDRAM_ADDR | (ROW_OFFSETS[row] + column));
+        if (framebuffer) {
+            cursor_row = row;
+            cursor_column = column;
+            return true;
+        }
+        return send_command(ddram_address(row, column));
+    }
+
+    /**
+     * Set the delays applied when writing to the display.
+     */
+    void set_delays(const i2cdisplay_delays &new_delays)
+    {
+        delays = new_delays;
+    }
+
+    /**
+     * Disable the framebuffer, after waiting for any refresh in progress.
+     */
+    bool set_framebuffer_off()
+    {
+        wait_refresh();
+        framebuffer = false;
+        return true;
+    }
+
+    /**
+     * Enable the framebuffer.
+     *
+     * When the framebuffer is enabled, `print()`, `set_cursor_position()`, `clear()` and `go_home()`
+     * don't communicate with the display, but modify a copy of its contents in memory. The display
+     * is updated when calling `refresh()`. The first refresh sends the whole framebuffer.
+     */
+    bool set_framebuffer_on()
+    {
+        framebuffer = true;
+        flushed_valid = false;
+        return true;
     }
 
     bool set_display_off()
@@ -262,6 +696,33 @@ public:
         return send_command(DISPLAY_CONTROL | display_control);
     }
 
+    /**
+     * Disable the streaming mode.
+     */
+    bool set_streaming_off()
+    {
+        wait_refresh();
+        streaming = false;
+        return true;
+    }
+
+    /**
+     * Enable the streaming mode.
+     *
+     * In streaming mode, all the bytes needed to write a character or a command (including the
+     * ENABLE pulses) are sent to the I2C expander in a single transfer, and so are the characters
+     * of a string, up to 16 per transfer. This needs a driver with a `write_bytes()` method, like
+     * `i2c` or `I2cBusDevice`. Returns `false` if the driver doesn't have it.
+     */
+    bool set_streaming_on()
+    {
+        if constexpr (!STREAMING_DRIVER)
+            return false;
+        wait_refresh();
+        streaming = true;
+        return true;
+    }
+
     bool set_text_left_to_right()
     {
         display_mode |= ENTRY_LEFT;
@@ -274,6 +735,14 @@ public:
         return send_command(ENTRY_MODE_SET | display_mode);
     }
 
+    /**
+     * Wait for the refresh in progress, if any, to finish.
+     */
+    void wait_refresh() const
+    {
+        refreshing.wait(true, std::memory_order_acquire);
+    }
+
 };
 
 }
\ No newline at end of file
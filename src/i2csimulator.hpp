@@ -0,0 +1,507 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "i2cbackend.hpp"
+
+using namespace std;
+
+namespace rfs {
+
+/**
+ * A device connected to an `I2cSimulator`.
+ *
+ * The simulator passes to the device the bytes of each message addressed to it, as the real
+ * device would receive them or send them.
+ */
+class I2cSimulatedDevice {
+
+public:
+
+    /**
+     * `address` is the 7-bit address of the device.
+     */
+    I2cSimulatedDevice(uint8_t address): address(address)
+    {}
+
+    virtual ~I2cSimulatedDevice()
+    {}
+
+    /**
+     * Return the address of the device.
+     */
+    uint8_t get_address() const
+    {
+        return address;
+    }
+
+    /**
+     * Send to the master the bytes of a read message.
+     */
+    virtual void read(span<uint8_t> data) = 0;
+
+    /**
+     * Return whether the device acknowledges the given address.
+     */
+    virtual bool responds_to(uint8_t address) const
+    {
+        return address == this->address;
+    }
+
+    /**
+     * Called at the STOP condition of a transfer in which the device took part.
+     */
+    virtual void stop()
+    {}
+
+    /**
+     * Receive the bytes of a write message.
+     */
+    virtual void write(span<const uint8_t> data) = 0;
+
+protected:
+
+    uint8_t address;
+
+};
+
+/**
+ * A simulated **PCA9685** device.
+ *
+ * It models the registers of the device: their values at power-up, the auto-increment of the
+ * register address, the ALL_LED registers, the PRESCALE register being writable only in sleep
+ * mode, the RESTART bit, and the ALL_CALL address and sub-addresses. It doesn't generate any signal.
+ */
+class SimulatedPca9685: public I2cSimulatedDevice {
+
+public:
+
+    SimulatedPca9685(uint8_t address = 0x40): I2cSimulatedDevice(address), pointer(0)
+    {
+        reset();
+    }
+
+    /**
+     * Return the value of a register.
+     */
+    uint8_t get_register(uint8_t reg) const
+    {
+        return read_register(reg);
+    }
+
+    virtual void read(span<uint8_t> data) override
+    {
+        for (uint8_t &byte: data) {
+            byte = read_register(pointer);
+            advance();
+        }
+    }
+
+    /**
+     * Return the registers to their values at power-up.
+     */
+    void reset()
+    {
+        registers.fill(0);
+        registers[MODE1_REGISTER] = MODE1_SLEEP | MODE1_ALLCALL;
+        registers[MODE2_REGISTER] = 0x04;
+        registers[2] = 0xe2;
+        registers[3] = 0xe4;
+        registers[4] = 0xe8;
+        registers[ALLCALL_REGISTER] = 0xe0;
+        for (uint32_t channel = 0; channel < CHANNELS_COUNT; channel++)
+            registers[LED0_REGISTER + channel * 4 + 3] = 0x10;
+        registers[PRESCALE_REGISTER] = 0x1e;
+        pointer = 0;
+    }
+
+    virtual bool responds_to(uint8_t address) const override
+    {
+        if (address == this->address)
+            return true;
+        // The ALL_CALL address and sub-addresses are stored as 8-bit addresses, each one enabled by a bit of MODE1
+        for (uint8_t i = 0; i < 4; i++) {
+            if ((registers[MODE1_REGISTER] & (MODE1_ALLCALL << i)) && address == (registers[ALLCALL_REGISTER - i] >> 1))
+                return true;
+        }
+        return false;
+    }
+
+    virtual void write(span<const uint8_t> data) override
+    {
+        if (data.empty())
+            return;
+        pointer = data[0];
+        for (const uint8_t byte: data.subspan(1)) {
+            write_register(pointer, byte);
+            advance();
+        }
+    }
+
+private:
+
+    static const uint8_t MODE1_REGISTER = 0;
+    static const uint8_t MODE2_REGISTER = 1;
+    static const uint8_t ALLCALL_REGISTER = 5;
+    static const uint8_t LED0_REGISTER = 6;
+    static const uint8_t LAST_LED_REGISTER = 69;
+    static const uint8_t ALL_LED_REGISTER = 250;
+    static const uint8_t PRESCALE_REGISTER = 254;
+    static const uint32_t CHANNELS_COUNT = 16;
+    static const uint8_t MODE1_RESTART = 0x80;
+    static const uint8_t MODE1_AI = 0x20;
+    static const uint8_t MODE1_SLEEP = 0x10;
+    static const uint8_t MODE1_ALLCALL = 0x01;
+
+    array<uint8_t, 256> registers;
+    uint8_t pointer;
+
+    void advance()
+    {
+        if (registers[MODE1_REGISTER] & MODE1_AI)
+            pointer = (pointer == LAST_LED_REGISTER) ? 0 : pointer + 1;
+    }
+
+    // Whether any channel is not always off
+    bool outputs_active() const
+    {
+        for (uint32_t channel = 0; channel < CHANNELS_COUNT; channel++) {
+            if (!(registers[LED0_REGISTER + channel * 4 + 3] & 0x10))
+                return true;
+        }
+        return false;
+    }
+
+    uint8_t read_register(uint8_t reg) const
+    {
+        // The ALL_LED registers always read as 0
+        if (reg >= ALL_LED_REGISTER && reg < PRESCALE_REGISTER)
+            return 0;
+        return registers[reg];
+    }
+
+    void write_register(uint8_t reg, uint8_t value)
+    {
+        if (reg == MODE1_REGISTER) {
+            // Going to sleep with any output active sets RESTART, and writing 1 to it while awake clears it
+            uint8_t restart = registers[reg] & MODE1_RESTART;
+            if (!(registers[reg] & MODE1_SLEEP) && (value & MODE1_SLEEP) && outputs_active())
+                restart = MODE1_RESTART;
+            else if ((value & MODE1_RESTART) && !(value & MODE1_SLEEP))
+                restart = 0;
+            registers[reg] = (value & ~MODE1_RESTART) | restart;
+        } else if (reg == PRESCALE_REGISTER) {
+            if (registers[MODE1_REGISTER] & MODE1_SLEEP)
+                registers[reg] = value;
+        } else if (reg >= ALL_LED_REGISTER && reg < PRESCALE_REGISTER) {
+            for (uint32_t channel = 0; channel < CHANNELS_COUNT; channel++)
+                registers[LED0_REGISTER + channel * 4 + reg - ALL_LED_REGISTER] = value;
+        } else if (reg <= LAST_LED_REGISTER) {
+            registers[reg] = value;
+        }
+    }
+
+};
+
+/**
+ * A simulated **PCF8574** I/O expander, as the ones that drive the displays.
+ *
+ * It keeps the value of its 8 outputs, which is the last byte written.
+ */
+class SimulatedPcf8574: public I2cSimulatedDevice {
+
+public:
+
+    SimulatedPcf8574(uint8_t address = 0x27): I2cSimulatedDevice(address), port(0xff), writes_count(0)
+    {}
+
+    /**
+     * Return the value of the outputs.
+     */
+    uint8_t get_port() const
+    {
+        return port;
+    }
+
+    /**
+     * Return the number of bytes written to the outputs.
+     */
+    uint64_t get_writes_count() const
+    {
+        return writes_count;
+    }
+
+    virtual void read(span<uint8_t> data) override
+    {
+        fill(data.begin(), data.end(), port);
+    }
+
+    virtual void write(span<const uint8_t> data) override
+    {
+        if (data.empty())
+            return;
+        port = data.back();
+        writes_count += data.size();
+    }
+
+private:
+
+    uint8_t port;
+    uint64_t writes_count;
+
+};
+
+/**
+ * An I<SUP>2</SUP>C controller with simulated devices, to run the device classes without hardware.
+ *
+ * The devices added with `add_device()` receive the messages addressed to them, and the time
+ * that the transfers would take on the bus is computed from the bus frequency (100 kHz or 400 kHz
+ * are the usual ones). If `real_time` is `true`, each transfer also waits that time, so that the
+ * simulated devices are as slow as the real ones. Any path can be opened, and all of them give
+ * access to the same devices.
+ *
+ * It also simulates whether the controller supports plain I<SUP>2</SUP>C transfers, as some only
+ * support SMBus transfers. It is not thread safe.
+ */
+class I2cSimulator: public I2cBackend {
+
+public:
+
+    static const uint32_t STANDARD_MODE_FREQUENCY = 100000;
+    static const uint32_t FAST_MODE_FREQUENCY = 400000;
+
+    I2cSimulator(uint32_t bus_frequency = FAST_MODE_FREQUENCY, bool real_time = false, bool plain_i2c = true):
+        bit_time(chrono::nanoseconds(1000000000 / bus_frequency)), real_time(real_time), plain_i2c(plain_i2c),
+        next_fd(FIRST_FD), transfers_count(0), bus_time(0)
+    {}
+
+    /**
+     * Connect a device to the bus. It must outlive the simulator.
+     */
+    void add_device(I2cSimulatedDevice &device)
+    {
+        devices.push_back(&device);
+    }
+
+    /**
+     * Return the total time that the transfers would have taken on the bus.
+     */
+    chrono::nanoseconds get_bus_time() const
+    {
+        return bus_time;
+    }
+
+    /**
+     * Return the number of transfers executed, each one ended by a STOP condition.
+     */
+    uint64_t get_transfers_count() const
+    {
+        return transfers_count;
+    }
+
+    virtual int close(int fd) override
+    {
+        const auto it = find_file(fd);
+        if (it == files.end()) {
+            errno = EBADF;
+            return -1;
+        }
+        files.erase(it);
+        return 0;
+    }
+
+    virtual int functionalities(int fd, unsigned long *funcs) override
+    {
+        if (find_file(fd) == files.end()) {
+            errno = EBADF;
+            return -1;
+        }
+        *funcs = I2C_FUNC_SMBUS_EMUL | (plain_i2c ? I2C_FUNC_I2C : 0);
+        return 0;
+    }
+
+    virtual int open(const char * /* device */) override
+    {
+        files.push_back({next_fd, 0});
+        return next_fd++;
+    }
+
+    virtual int32_t read_block_data(int fd, uint8_t reg, uint8_t size, uint8_t *data) override
+    {
+        size = std::min<uint8_t>(size, I2C_SMBUS_BLOCK_MAX);
+        const int32_t result = smbus_transfer(fd, reg, data, size, I2C_M_RD);
+        return (result < 0) ? result : size;
+    }
+
+    virtual int32_t read_byte_data(int fd, uint8_t reg) override
+    {
+        uint8_t value = 0;
+        const int32_t result = smbus_transfer(fd, reg, &value, 1, I2C_M_RD);
+        return (result < 0) ? result : value;
+    }
+
+    virtual int select(int fd, uint16_t address) override
+    {
+        const auto it = find_file(fd);
+        if (it == files.end()) {
+            errno = EBADF;
+            return -1;
+        }
+        it->address = address;
+        return 0;
+    }
+
+    virtual int transfer(int fd, i2c_msg *messages, uint32_t messages_count) override
+    {
+        if (find_file(fd) == files.end()) {
+            errno = EBADF;
+            return -1;
+        }
+        if (!plain_i2c) {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+        return execute(messages, messages_count);
+    }
+
+    virtual ssize_t write(int fd, const uint8_t *data, size_t size) override
+    {
+        const auto it = find_file(fd);
+        if (it == files.end()) {
+            errno = EBADF;
+            return -1;
+        }
+        i2c_msg message{it->address, 0, static_cast<uint16_t>(size), const_cast<uint8_t *>(data)};
+        return (execute(&message, 1) < 0) ? -1 : static_cast<ssize_t>(size);
+    }
+
+    virtual int32_t write_block_data(int fd, uint8_t reg, uint8_t size, const uint8_t *data) override
+    {
+        if (size > I2C_SMBUS_BLOCK_MAX) {
+            errno = EINVAL;
+            return -1;
+        }
+        return smbus_transfer(fd, reg, const_cast<uint8_t *>(data), size, 0);
+    }
+
+    virtual int32_t write_byte(int fd, uint8_t value) override
+    {
+        const auto it = find_file(fd);
+        if (it == files.end()) {
+            errno = EBADF;
+            return -1;
+        }
+        i2c_msg message{it->address, 0, 1, &value};
+        return (execute(&message, 1) < 0) ? -1 : 0;
+    }
+
+    virtual int32_t write_byte_data(int fd, uint8_t reg, uint8_t value) override
+    {
+        return smbus_transfer(fd, reg, &value, 1, 0);
+    }
+
+private:
+
+    static const int FIRST_FD = 1000;
+
+    // Each bit of the messages is a clock period
+    static const uint32_t BITS_PER_BYTE = 9;
+
+    struct File {
+        int fd;
+        uint16_t address;
+    };
+
+    chrono::nanoseconds bit_time;
+    bool real_time;
+    bool plain_i2c;
+    int next_fd;
+    vector<File> files;
+    vector<I2cSimulatedDevice *> devices;
+    vector<I2cSimulatedDevice *> transfer_devices;
+    uint64_t transfers_count;
+    chrono::nanoseconds bus_time;
+
+    vector<File>::iterator find_file(int fd)
+    {
+        return find_if(files.begin(), files.end(), [fd](const File &file) { return file.fd == fd; });
+    }
+
+    int execute(i2c_msg *messages, uint32_t messages_count)
+    {
+        const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+        // A START (or repeated START), the address byte and the data bytes of each message, and a STOP
+        uint64_t bits = 1;
+        transfer_devices.clear();
+        int result = messages_count;
+        for (uint32_t i = 0; i < messages_count && result >= 0; i++) {
+            const i2c_msg &message = messages[i];
+            bits += 1 + BITS_PER_BYTE;
+
+            bool acknowledged = false;
+            for (I2cSimulatedDevice *device: devices) {
+                if (!device->responds_to(message.addr))
+                    continue;
+                acknowledged = true;
+                if (find(transfer_devices.begin(), transfer_devices.end(), device) == transfer_devices.end())
+                    transfer_devices.push_back(device);
+                if (message.flags & I2C_M_RD) {
+                    // Only one device can answer a read
+                    device->read(span<uint8_t>(message.buf, message.len));
+                    break;
+                }
+                device->write(span<const uint8_t>(message.buf, message.len));
+            }
+
+            if (acknowledged) {
+                bits += message.len * BITS_PER_BYTE;
+            } else {
+                errno = EREMOTEIO;
+                result = -1;
+            }
+        }
+
+        for (I2cSimulatedDevice *device: transfer_devices)
+            device->stop();
+        transfers_count++;
+
+        const chrono::nanoseconds duration = bits * bit_time;
+        bus_time += duration;
+        if (real_time) {
+            while (chrono::steady_clock::now() - start < duration)
+                ;
+        }
+        return result;
+    }
+
+    // An SMBus transfer: write the register address, then read or write the data
+    int32_t smbus_transfer(int fd, uint8_t reg, uint8_t *data, uint8_t size, uint16_t flags)
+    {
+        const auto it = find_file(fd);
+        if (it == files.end()) {
+            errno = EBADF;
+            return -1;
+        }
+
+        if (flags & I2C_M_RD) {
+            i2c_msg messages[2] = {{it->address, 0, 1, &reg}, {it->address, I2C_M_RD, size, data}};
+            return (execute(messages, 2) < 0) ? -1 : 0;
+        }
+
+        array<uint8_t, I2C_SMBUS_BLOCK_MAX + 1> buffer;
+        buffer[0] = reg;
+        copy(data, data + size, buffer.begin() + 1);
+        i2c_msg message{it->address, 0, static_cast<uint16_t>(size + 1), buffer.data()};
+        return (execute(&message, 1) < 0) ? -1 : 0;
+    }
+
+};
+
+}
@@ -1,10 +1,20 @@
 
+#pragma once
+
+#include <algorithm>
+#include <array>
 #include <glm/geometric.hpp>
+#include <glm/mat3x3.hpp>
 #include <glm/mat4x4.hpp>
+#include <glm/matrix.hpp>
 #include <glm/vec3.hpp>
 #include <ranges>
+#include <span>
+#include <type_traits>
 #include <vector>
 
+#include "metrics.hpp"
+
 using namespace glm;
 using namespace std;
 
@@ -22,95 +32,306 @@ struct DHParameters {
     float r;
 };
 
-class KinematicChain {
+/**
+ * The algorithms available to solve the inverse kinematics.
+ */
+enum class IKSolver {
+    /**
+     * Cyclic coordinate descent: rotate each joint in turn to point the end effector to the target.
+     */
+    CCD,
+
+    /**
+     * Damped least squares: move all the joints at once following the Jacobian, with a fixed damping.
+     */
+    DLS,
+
+    /**
+     * Damped least squares with a damping that adapts to the progress of the solution.
+     */
+    LevenbergMarquardt
+};
+
+/**
+ * The outcome of solving the inverse kinematics.
+ */
+struct IKResult {
+    /**
+     * Number of iterations executed.
+     */
+    int iterations;
+
+    /**
+     * Distance between the end effector and the target at the end.
+     */
+    float error;
+
+    /**
+     * Whether the error is within the maximum error requested.
+     */
+    bool converged;
+};
+
+/**
+ * A serial chain of revolute joints described by their DH parameters.
+ *
+ * If `N` is `dynamic_extent` (see `KinematicChain`), the number of joints is given at runtime
+ * and the chain is stored in vectors. Otherwise, the chain has exactly `N` joints and everything
+ * is stored in arrays inside the object (see `FixedKinematicChain`), so it never allocates memory
+ * and the compiler can unroll the loops over the joints.
+ */
+template <size_t N = dynamic_extent>
+class BasicKinematicChain {
+
+    template <typename T>
+    using Storage = conditional_t<N == dynamic_extent, vector<T>, array<T, N>>;
 
 public:
 
-    KinematicChain(const vector<DHParameters> &parameters):
-        parameters(parameters), joints(parameters.size())
-    {}
+    using Parameters = Storage<DHParameters>;
+    using Angles = Storage<float>;
 
-    ~KinematicChain()
+    BasicKinematicChain(const Parameters &parameters):
+        parameters(parameters), joints(make_storage<KinematicChainJoint>(parameters.size())),
+        x_transforms(make_storage<mat4>(parameters.size())), transforms(make_storage<mat4>(parameters.size())),
+        first_dirty_joint(0), solver(IKSolver::CCD), damping(DEFAULT_DAMPING),
+        jacobian(make_storage<vec3>(parameters.size())), saved_angles(make_storage<float>(parameters.size()))
+    {
+        // The X transforms only depend on the DH parameters, so they never change
+        for (size_t i = 0; i < parameters.size(); i++) {
+            const DHParameters &params = parameters[i];
+            // BEWARE! in GLM the matrix are specified COLUMN-WISE!
+            x_transforms[i] = mat4{{     1.0,                0.0,               0.0, 0.0},
+                                   {     0.0,  cos(params.alpha), sin(params.alpha), 0.0},
+                                   {     0.0, -sin(params.alpha), cos(params.alpha), 0.0},
+                                   {params.r,                0.0,               0.0, 1.0}};
+        }
+    }
+
+    ~BasicKinematicChain()
     {}
 
+    /**
+     * Compute the position of the end effector, and the position and axis of every joint.
+     *
+     * The transforms of the joints are cached, so only the ones of the joints after the first
+     * joint whose angle changed since the last call are computed again.
+     */
     vec3 forward_kinematics()
     {
-        mat4 T(1.0);
-        vec3 pos{0.0, 0.0, 0.0};
-        vec3 z{0.0, 0.0, 1.0};
+        if (joints.empty())
+            return {0.0, 0.0, 0.0};
+
+        mat4 T = (first_dirty_joint == 0) ? mat4(1.0) : transforms[first_dirty_joint - 1];
 
-        for (tuple<DHParameters&, KinematicChainJoint&> elem: views::zip(parameters, joints)) {
-            DHParameters &params = get<0>(elem);
-            KinematicChainJoint &joint = get<1>(elem);
-            joint.position = pos;
-            joint.z = z;
+        for (size_t i = first_dirty_joint; i < joints.size(); i++) {
+            KinematicChainJoint &joint = joints[i];
+            joint.position = vec3(T[3]);
+            joint.z = vec3(T[2]);
 
             // BEWARE! in GLM the matrix are specified COLUMN-WISE!
-            const mat4 Z{{ cos(joint.angle), sin(joint.angle),      0.0, 0.0},
-                         {-sin(joint.angle), cos(joint.angle),      0.0, 0.0},
-                         {              0.0,              0.0,      1.0, 0.0},
-                         {              0.0,              0.0, params.d, 1.0}};
-            
-            const mat4 X{{     1.0,                0.0,               0.0, 0.0},
-                         {     0.0,  cos(params.alpha), sin(params.alpha), 0.0},
-                         {     0.0, -sin(params.alpha), cos(params.alpha), 0.0},
-                         {params.r,                0.0,               0.0, 1.0}};
-            
-            T *= Z * X;
-            pos = {T[3].x, T[3].y, T[3].z};
-            z = mat3(T) * vec3(0.0, 0.0, 1.0);
+            const mat4 Z{{ cos(joint.angle), sin(joint.angle),             0.0, 0.0},
+                         {-sin(joint.angle), cos(joint.angle),             0.0, 0.0},
+                         {              0.0,              0.0,             1.0, 0.0},
+                         {              0.0,              0.0, parameters[i].d, 1.0}};
+
+            T *= Z * x_transforms[i];
+            transforms[i] = T;
         }
-        return pos;
+        first_dirty_joint = joints.size();
+
+        return vec3(transforms.back()[3]);
     }
 
-    vector<float> get_angles() const {
-        vector<float> angles;
-        for (const KinematicChainJoint &joint: joints) {
-            angles.push_back(joint.angle);
-        }
+    Angles get_angles() const {
+        Angles angles = make_storage<float>(joints.size());
+        get_angles(angles);
         return angles;
     }
 
-    void inverse_kinematics(const vec3 &target, int max_iterations = MAX_ITERATIONS, float max_error = 1.0)
+    /**
+     * Write the angles of the joints into `angles`, without allocating memory.
+     */
+    void get_angles(span<float> angles) const {
+        const size_t count = std::min(joints.size(), angles.size());
+        for (size_t i = 0; i < count; i++) {
+            angles[i] = joints[i].angle;
+        }
+    }
+
+    /**
+     * Move the joints so that the end effector reaches `target`.
+     *
+     * The current angles are the starting point, so when the target moves little between calls
+     * (as in a control loop) few iterations are needed. It stops after `max_iterations` iterations
+     * or when the end effector is nearer than `max_error` to the target. The algorithm used is the
+     * one given with `set_solver()`.
+     */
+    IKResult inverse_kinematics(const vec3 &target, int max_iterations = MAX_ITERATIONS, float max_error = 1.0)
+    {
+        MetricsTimer timer(metrics::ik_seconds);
+        IKResult result;
+        switch (solver) {
+            case IKSolver::DLS: result = inverse_kinematics_dls(target, max_iterations, max_error, false); break;
+            case IKSolver::LevenbergMarquardt: result = inverse_kinematics_dls(target, max_iterations, max_error, true); break;
+            default: result = inverse_kinematics_ccd(target, max_iterations, max_error); break;
+        }
+        metrics::record_ik(result.iterations, result.error, result.converged);
+        return result;
+    }
+
+    /**
+     * Set the damping factor of the damped least squares solvers.
+     *
+     * Bigger values give more stable solutions near singularities but converge slower. It has the same
+     * units as the DH parameters. For the Levenberg-Marquardt solver, it is the initial value.
+     */
+    void set_damping(float damping)
+    {
+        this->damping = damping;
+    }
+
+    /**
+     * Set the algorithm used to solve the inverse kinematics.
+     */
+    void set_solver(IKSolver solver)
+    {
+        this->solver = solver;
+    }
+
+    void set_angles(span<const float> angles)
+    {
+        const size_t count = std::min(joints.size(), angles.size());
+        for (size_t i = 0; i < count; i++) {
+            if (joints[i].angle != angles[i]) {
+                joints[i].angle = angles[i];
+                first_dirty_joint = std::min(first_dirty_joint, i);
+            }
+        }
+    }
+
+private:
+
+    template <typename T>
+    static Storage<T> make_storage(size_t size)
+    {
+        if constexpr (N == dynamic_extent)
+            return Storage<T>(size);
+        else
+            return Storage<T>{};
+    }
+
+    IKResult inverse_kinematics_ccd(const vec3 &target, int max_iterations, float max_error)
     {
         vec3 ee_pos = forward_kinematics();
         int iteration = 0;
         
         while (iteration < max_iterations && distance(ee_pos, target) > max_error) {
-            for (auto joint = joints.rbegin(); joint != joints.rend(); joint++) {
-                joint->angle += compute_signed_angle(ee_pos, target, *joint);
+            // Changing a joint only invalidates its transform and the ones after it
+            for (size_t i = joints.size(); i-- > 0;) {
+                joints[i].angle += compute_signed_angle(ee_pos, target, joints[i]);
+                first_dirty_joint = std::min(first_dirty_joint, i);
                 ee_pos = forward_kinematics();
             }
             iteration++;
         }
+
+        const float error = distance(ee_pos, target);
+        return {iteration, error, error <= max_error};
     }
 
-    void set_angles(const vector<float> &angles)
+    IKResult inverse_kinematics_dls(const vec3 &target, int max_iterations, float max_error, bool adaptive)
     {
-        for (tuple<KinematicChainJoint&, float> elem: views::zip(joints, angles)) {
-            KinematicChainJoint &joint = get<0>(elem);
-            float angle = get<1>(elem);
-            joint.angle = angle;
+        vec3 ee_pos = forward_kinematics();
+        float error = distance(ee_pos, target);
+        float lambda = damping;
+        int iteration = 0;
+
+        while (iteration < max_iterations && error > max_error) {
+            // Position Jacobian of revolute joints: each column is z_i x (p_ee - p_i)
+            mat3 JJt(0.0);
+            for (size_t i = 0; i < joints.size(); i++) {
+                jacobian[i] = cross(joints[i].z, ee_pos - joints[i].position);
+                JJt += outerProduct(jacobian[i], jacobian[i]);
+            }
+
+            // dtheta = J^T (J J^T + lambda^2 I)^-1 e
+            const vec3 f = inverse(JJt + mat3(lambda * lambda)) * (target - ee_pos);
+            for (size_t i = 0; i < joints.size(); i++) {
+                saved_angles[i] = joints[i].angle;
+                joints[i].angle += dot(jacobian[i], f);
+            }
+            first_dirty_joint = 0;
+            const vec3 new_ee_pos = forward_kinematics();
+            const float new_error = distance(new_ee_pos, target);
+            iteration++;
+
+            if (!adaptive || new_error < error) {
+                ee_pos = new_ee_pos;
+                error = new_error;
+                if (adaptive)
+                    lambda = std::max(lambda * LM_DAMPING_DECREASE, LM_MIN_DAMPING);
+            } else {
+                // Undo the step and try again with more damping
+                for (size_t i = 0; i < joints.size(); i++)
+                    joints[i].angle = saved_angles[i];
+                first_dirty_joint = 0;
+                forward_kinematics();
+                lambda *= LM_DAMPING_INCREASE;
+            }
         }
-    }
 
-private:
+        return {iteration, error, error <= max_error};
+    }
 
     float compute_signed_angle(const vec3 &ee_pos, const vec3 &target, const KinematicChainJoint &joint)
     {
         const vec3 n1 = normalize(cross(joint.z, ee_pos - joint.position));
         const vec3 n2 = normalize(cross(joint.z, target - joint.position));
-        const float angle = acos(dot(n1, n2));
+        // Rounding errors can take the dot product slightly out of the domain of acos
+        const float angle = acos(std::clamp(dot(n1, n2), -1.0f, 1.0f));
         const vec3 z_2 = cross(n1, n2);
 
         return (dot(joint.z, z_2) > 0) ? angle : -angle;
     }
 
     static constexpr int MAX_ITERATIONS = 128;
+    static constexpr float DEFAULT_DAMPING = 10.0;
+    static constexpr float LM_MIN_DAMPING = 0.01;
+    static constexpr float LM_DAMPING_DECREASE = 0.5;
+    static constexpr float LM_DAMPING_INCREASE = 4.0;
+
+    Storage<DHParameters> parameters;
+    Storage<KinematicChainJoint> joints;
+
+    // Constant X transform of each joint, and product of the transforms up to each joint
+    Storage<mat4> x_transforms;
+    Storage<mat4> transforms;
+    size_t first_dirty_joint;
 
-    vector<DHParameters> parameters;
-    vector<KinematicChainJoint> joints;
+    IKSolver solver;
+    float damping;
+
+    // Work buffers of the damped least squares solvers, allocated once
+    Storage<vec3> jacobian;
+    Storage<float> saved_angles;
 
 };
 
+/**
+ * A kinematic chain with a number of joints given at runtime.
+ */
+using KinematicChain = BasicKinematicChain<>;
+
+/**
+ * A kinematic chain with `N` joints, that doesn't allocate memory.
+ *
+ * The DH parameters can be a `constexpr` array, for instance:
+ *
+ *     constexpr array<DHParameters, 3> LEG{{{0.0, M_PI/2.0, 32.2}, {0.0, 0.0, 48.6}, {0.0, 0.0, 113.713}}};
+ *     FixedKinematicChain<3> leg(LEG);
+ */
+template <size_t N>
+using FixedKinematicChain = BasicKinematicChain<N>;
+
 }
\ No newline at end of file
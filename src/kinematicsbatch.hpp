@@ -0,0 +1,294 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <span>
+#include <vector>
+
+#include "kinematics.hpp"
+#include "simd.hpp"
+
+using namespace glm;
+using namespace std;
+
+namespace rfs {
+
+/**
+ * Many kinematic chains with the same geometry, solved together.
+ *
+ * All the chains share the same DH parameters (for instance, the legs of a robot, each one with
+ * the target in its own reference frame, or the candidate footholds of a single leg), but each
+ * one has its own joint angles. The angles are stored in groups of four chains, so that the
+ * forward and inverse kinematics of four chains are computed at once with `float4`.
+ *
+ * The inverse kinematics uses the damped least squares method (see `IKSolver::DLS`).
+ */
+class KinematicChainBatch {
+
+public:
+
+    KinematicChainBatch(const vector<DHParameters> &parameters, size_t chains_count):
+        chains_count(chains_count),
+        blocks_count((chains_count + LANES - 1) / LANES),
+        joints_count(parameters.size()),
+        cos_alpha(parameters.size()), sin_alpha(parameters.size()), r(parameters.size()), d(parameters.size()),
+        angles(parameters.size() * blocks_count * LANES, 0.0f),
+        positions(parameters.size()), axes(parameters.size()), jacobian(parameters.size()),
+        damping(DEFAULT_DAMPING)
+    {
+        for (size_t j = 0; j < joints_count; j++) {
+            cos_alpha[j] = cos(parameters[j].alpha);
+            sin_alpha[j] = sin(parameters[j].alpha);
+            r[j] = parameters[j].r;
+            d[j] = parameters[j].d;
+        }
+    }
+
+    /**
+     * Write the joint angles of the chain with index `chain` into `chain_angles`.
+     */
+    void get_angles(size_t chain, span<float> chain_angles) const
+    {
+        const size_t count = std::min(joints_count, chain_angles.size());
+        for (size_t j = 0; j < count; j++)
+            chain_angles[j] = angles[angle_index(chain, j)];
+    }
+
+    /**
+     * Compute the position of the end effector of every chain.
+     *
+     * `ee_positions` must have room for all the chains.
+     */
+    void forward_kinematics(span<vec3> ee_positions)
+    {
+        for (size_t block = 0; block < blocks_count; block++) {
+            const vec3x4 ee = forward_block(block);
+            store(ee, block, ee_positions);
+        }
+    }
+
+    /**
+     * Move the joints of every chain so that its end effector reaches its target.
+     *
+     * `targets` has the target of each chain, and the outcome of each chain is written in `results`.
+     * The meaning of `max_iterations` and `max_error` is the same as in
+     * `KinematicChain::inverse_kinematics()`, for each chain. The chains that converge stop moving,
+     * while the others in the same group of four keep iterating.
+     */
+    void inverse_kinematics(span<const vec3> targets, span<IKResult> results,
+        int max_iterations = MAX_ITERATIONS, float max_error = 1.0)
+    {
+        const float4 max_error2(max_error * max_error);
+        const float4 lambda2(damping * damping);
+
+        for (size_t block = 0; block < blocks_count; block++) {
+            const vec3x4 target = load(targets, block);
+            const float4 valid = valid_lanes(block);
+            float4 iterations(0.0f);
+
+            for (int iteration = 0; iteration < max_iterations; iteration++) {
+                const vec3x4 ee = forward_block(block);
+                const vec3x4 e = sub(target, ee);
+                const float4 active = valid & (dot(e, e) > max_error2);
+                if (!any(active))
+                    break;
+                iterations += select(active, float4(1.0f), float4(0.0f));
+
+                // Position Jacobian of revolute joints: each column is z_j x (p_ee - p_j)
+                float4 a00 = lambda2, a01(0.0f), a02(0.0f), a11 = lambda2, a12(0.0f), a22 = lambda2;
+                for (size_t j = 0; j < joints_count; j++) {
+                    const vec3x4 jj = cross(axes[j], sub(ee, positions[j]));
+                    jacobian[j] = jj;
+                    a00 += jj.x * jj.x; a01 += jj.x * jj.y; a02 += jj.x * jj.z;
+                    a11 += jj.y * jj.y; a12 += jj.y * jj.z; a22 += jj.z * jj.z;
+                }
+
+                // f = (J J^T + lambda^2 I)^-1 e, the matrix is symmetric
+                const float4 c00 = a11 * a22 - a12 * a12;
+                const float4 c01 = a02 * a12 - a01 * a22;
+                const float4 c02 = a01 * a12 - a02 * a11;
+                const float4 c11 = a00 * a22 - a02 * a02;
+                const float4 c12 = a01 * a02 - a00 * a12;
+                const float4 c22 = a00 * a11 - a01 * a01;
+                const float4 inv_det = float4(1.0f) / (a00 * c00 + a01 * c01 + a02 * c02);
+                const vec3x4 f{
+                    (c00 * e.x + c01 * e.y + c02 * e.z) * inv_det,
+                    (c01 * e.x + c11 * e.y + c12 * e.z) * inv_det,
+                    (c02 * e.x + c12 * e.y + c22 * e.z) * inv_det};
+
+                // dtheta = J^T f, only for the chains not converged yet
+                for (size_t j = 0; j < joints_count; j++) {
+                    float *angle = &angles[(j * blocks_count + block) * LANES];
+                    const float4 step = select(active, dot(jacobian[j], f), float4(0.0f));
+                    (float4::load(angle) + step).store(angle);
+                }
+            }
+
+            const vec3x4 ee = forward_block(block);
+            const vec3x4 e = sub(target, ee);
+            float errors[LANES];
+            float counts[LANES];
+            sqrt(dot(e, e)).store(errors);
+            iterations.store(counts);
+            for (size_t lane = 0; lane < LANES; lane++) {
+                const size_t chain = block * LANES + lane;
+                if (chain < chains_count && chain < results.size())
+                    results[chain] = {static_cast<int>(counts[lane]), errors[lane], errors[lane] <= max_error};
+            }
+        }
+    }
+
+    /**
+     * Set the joint angles of the chain with index `chain`.
+     */
+    void set_angles(size_t chain, span<const float> chain_angles)
+    {
+        const size_t count = std::min(joints_count, chain_angles.size());
+        for (size_t j = 0; j < count; j++)
+            angles[angle_index(chain, j)] = chain_angles[j];
+    }
+
+    /**
+     * Set the damping factor of the inverse kinematics.
+     *
+     * See `KinematicChain::set_damping()`.
+     */
+    void set_damping(float damping)
+    {
+        this->damping = damping;
+    }
+
+    /**
+     * Return the number of chains.
+     */
+    size_t size() const
+    {
+        return chains_count;
+    }
+
+private:
+
+    struct vec3x4 {
+        float4 x;
+        float4 y;
+        float4 z;
+    };
+
+    static constexpr size_t LANES = 4;
+    static constexpr int MAX_ITERATIONS = 128;
+    static constexpr float DEFAULT_DAMPING = 10.0;
+
+    size_t chains_count;
+    size_t blocks_count;
+    size_t joints_count;
+
+    // DH parameters
+    vector<float> cos_alpha;
+    vector<float> sin_alpha;
+    vector<float> r;
+    vector<float> d;
+
+    // The angles of joint j of the chains in block b are at (j * blocks_count + b) * LANES
+    vector<float> angles;
+
+    // Work buffers: position, axis and Jacobian column of each joint for the block being computed
+    vector<vec3x4> positions;
+    vector<vec3x4> axes;
+    vector<vec3x4> jacobian;
+
+    float damping;
+
+    size_t angle_index(size_t chain, size_t joint) const
+    {
+        return (joint * blocks_count + chain / LANES) * LANES + chain % LANES;
+    }
+
+    static vec3x4 cross(const vec3x4 &a, const vec3x4 &b)
+    {
+        return {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
+    }
+
+    static float4 dot(const vec3x4 &a, const vec3x4 &b)
+    {
+        return a.x * b.x + a.y * b.y + a.z * b.z;
+    }
+
+    static vec3x4 sub(const vec3x4 &a, const vec3x4 &b)
+    {
+        return {a.x - b.x, a.y - b.y, a.z - b.z};
+    }
+
+    // Compute the transforms of the chains in a block, leaving the joint positions and axes in the work buffers
+    vec3x4 forward_block(size_t block)
+    {
+        // Rotation (row-major) and translation of the transform up to the current joint
+        float4 r00(1.0f), r01(0.0f), r02(0.0f);
+        float4 r10(0.0f), r11(1.0f), r12(0.0f);
+        float4 r20(0.0f), r21(0.0f), r22(1.0f);
+        vec3x4 p{float4(0.0f), float4(0.0f), float4(0.0f)};
+
+        for (size_t j = 0; j < joints_count; j++) {
+            positions[j] = p;
+            axes[j] = {r02, r12, r22};
+
+            float4 st, ct;
+            sincos(float4::load(&angles[(j * blocks_count + block) * LANES]), st, ct);
+            const float4 ca(cos_alpha[j]), sa(sin_alpha[j]);
+
+            // DH transform Z(theta, d) * X(alpha, r)
+            const float4 a00 = ct, a01 = -st * ca, a02 = st * sa;
+            const float4 a10 = st, a11 = ct * ca, a12 = -ct * sa;
+            const float4 a21 = sa, a22 = ca;
+            const float4 tx = float4(r[j]) * ct, ty = float4(r[j]) * st, tz(d[j]);
+
+            p = {r00 * tx + r01 * ty + r02 * tz + p.x,
+                 r10 * tx + r11 * ty + r12 * tz + p.y,
+                 r20 * tx + r21 * ty + r22 * tz + p.z};
+
+            const float4 n00 = r00 * a00 + r01 * a10, n01 = r00 * a01 + r01 * a11 + r02 * a21, n02 = r00 * a02 + r01 * a12 + r02 * a22;
+            const float4 n10 = r10 * a00 + r11 * a10, n11 = r10 * a01 + r11 * a11 + r12 * a21, n12 = r10 * a02 + r11 * a12 + r12 * a22;
+            const float4 n20 = r20 * a00 + r21 * a10, n21 = r20 * a01 + r21 * a11 + r22 * a21, n22 = r20 * a02 + r21 * a12 + r22 * a22;
+            r00 = n00; r01 = n01; r02 = n02;
+            r10 = n10; r11 = n11; r12 = n12;
+            r20 = n20; r21 = n21; r22 = n22;
+        }
+        return p;
+    }
+
+    vec3x4 load(span<const vec3> values, size_t block) const
+    {
+        float x[LANES] = {}, y[LANES] = {}, z[LANES] = {};
+        for (size_t lane = 0; lane < LANES; lane++) {
+            const size_t chain = block * LANES + lane;
+            if (chain < chains_count && chain < values.size()) {
+                x[lane] = values[chain].x;
+                y[lane] = values[chain].y;
+                z[lane] = values[chain].z;
+            }
+        }
+        return {float4::load(x), float4::load(y), float4::load(z)};
+    }
+
+    void store(const vec3x4 &value, size_t block, span<vec3> values) const
+    {
+        float x[LANES], y[LANES], z[LANES];
+        value.x.store(x);
+        value.y.store(y);
+        value.z.store(z);
+        for (size_t lane = 0; lane < LANES; lane++) {
+            const size_t chain = block * LANES + lane;
+            if (chain < chains_count && chain < values.size())
+                values[chain] = {x[lane], y[lane], z[lane]};
+        }
+    }
+
+    // Mask of the lanes of a block that hold a chain (the last block may be incomplete)
+    float4 valid_lanes(size_t block) const
+    {
+        const float lane_indices[LANES] = {0.0f, 1.0f, 2.0f, 3.0f};
+        return float4::load(lane_indices) < float4(static_cast<float>(chains_count - block * LANES));
+    }
+
+};
+
+}
@@ -0,0 +1,213 @@
+#pragma once
+
+extern "C"
+{
+    #include <pthread.h>
+    #include <sched.h>
+}
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include "kinematics.hpp"
+
+using namespace glm;
+using namespace std;
+
+namespace rfs {
+
+/**
+ * The inverse kinematics of a chain to be solved by a `KinematicsPool`.
+ */
+template <typename Chain = KinematicChain>
+struct KinematicsJob {
+    /**
+     * The chain to move. Each job in a batch must have a different chain.
+     */
+    Chain *chain;
+
+    /**
+     * The target of the end effector.
+     */
+    vec3 target;
+
+    /**
+     * The outcome, written when the job is done.
+     */
+    IKResult result;
+};
+
+/**
+ * A fixed set of threads that solve the inverse kinematics of independent chains in parallel.
+ *
+ * The threads are created once and wait between batches, so solving a batch doesn't create
+ * threads nor allocate memory. The thread that calls `solve()` works on the batch too. The jobs
+ * are split evenly among the threads, and the ones that finish first steal the pending jobs
+ * of the others.
+ */
+template <typename Chain = KinematicChain>
+class KinematicsPool {
+
+public:
+
+    /**
+     * Create a pool where `threads_count` threads (counting the one that calls `solve()`) solve the jobs.
+     *
+     * If `pin_threads` is `true`, each thread of the pool is bound to its own CPU core, starting
+     * from the second one.
+     */
+    KinematicsPool(size_t threads_count = thread::hardware_concurrency(), bool pin_threads = true):
+        participants_count(std::max<size_t>(1, threads_count)), ranges(make_unique<Range[]>(participants_count)),
+        running(true), generation(0), busy(0), max_iterations(0), max_error(0.0)
+    {
+        const unsigned int cores_count = std::max(1u, thread::hardware_concurrency());
+        for (size_t index = 1; index < participants_count; index++) {
+            workers.emplace_back([this, index, pin_threads, cores_count]() {
+                if (pin_threads)
+                    pin(index % cores_count);
+                run(index);
+            });
+        }
+    }
+
+    ~KinematicsPool()
+    {
+        running.store(false);
+        generation.fetch_add(1, memory_order_release);
+        generation.notify_all();
+        for (thread &worker: workers)
+            worker.join();
+    }
+
+    KinematicsPool(const KinematicsPool &) = delete;
+    KinematicsPool &operator=(const KinematicsPool &) = delete;
+
+    /**
+     * Solve the inverse kinematics of all the `jobs`, and return when they are done.
+     *
+     * The meaning of `max_iterations` and `max_error` is the same as in
+     * `KinematicChain::inverse_kinematics()`. It must be called always from the same thread.
+     */
+    void solve(span<KinematicsJob<Chain>> jobs, int max_iterations = 128, float max_error = 1.0)
+    {
+        if (jobs.empty())
+            return;
+
+        this->jobs = jobs;
+        this->max_iterations = max_iterations;
+        this->max_error = max_error;
+        for (size_t index = 0; index < participants_count; index++) {
+            ranges[index].bounds.store(pack(jobs.size() * index / participants_count,
+                jobs.size() * (index + 1) / participants_count), memory_order_relaxed);
+        }
+
+        busy.store(workers.size(), memory_order_relaxed);
+        generation.fetch_add(1, memory_order_release);
+        generation.notify_all();
+
+        work(0);
+
+        uint32_t still_busy;
+        while ((still_busy = busy.load(memory_order_acquire)) != 0)
+            busy.wait(still_busy, memory_order_acquire);
+    }
+
+    /**
+     * Return the number of threads that solve the jobs, counting the one that calls `solve()`.
+     */
+    size_t size() const
+    {
+        return participants_count;
+    }
+
+private:
+
+    // The jobs not started yet of a thread, packed as begin and end indices so they can be
+    // taken from the front by the owner and from the back by the others with a single CAS
+    struct alignas(64) Range {
+        atomic<uint64_t> bounds{0};
+    };
+
+    size_t participants_count;
+    unique_ptr<Range[]> ranges;
+    vector<thread> workers;
+
+    atomic<bool> running;
+    atomic<uint32_t> generation;
+    atomic<uint32_t> busy;
+
+    // The batch being solved
+    span<KinematicsJob<Chain>> jobs;
+    int max_iterations;
+    float max_error;
+
+    static uint64_t pack(uint64_t begin, uint64_t end)
+    {
+        return (begin << 32) | end;
+    }
+
+    static void pin(unsigned int core)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(core, &cpus);
+        // If it fails, the thread just runs on any core
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    void run(size_t index)
+    {
+        uint32_t seen = 0;
+        while (true) {
+            generation.wait(seen, memory_order_acquire);
+            seen = generation.load(memory_order_acquire);
+            if (!running.load())
+                return;
+
+            work(index);
+            if (busy.fetch_sub(1, memory_order_acq_rel) == 1)
+                busy.notify_one();
+        }
+    }
+
+    bool take(size_t index, bool from_back, size_t &job)
+    {
+        atomic<uint64_t> &bounds = ranges[index].bounds;
+        uint64_t current = bounds.load(memory_order_relaxed);
+        while (true) {
+            const uint64_t begin = current >> 32;
+            const uint64_t end = current & 0xffffffff;
+            if (begin >= end)
+                return false;
+            const uint64_t next = from_back ? pack(begin, end - 1) : pack(begin + 1, end);
+            if (bounds.compare_exchange_weak(current, next, memory_order_relaxed)) {
+                job = from_back ? end - 1 : begin;
+                return true;
+            }
+        }
+    }
+
+    void work(size_t index)
+    {
+        size_t job;
+        while (take(index, false, job))
+            solve_job(jobs[job]);
+
+        for (size_t offset = 1; offset < participants_count; offset++) {
+            while (take((index + offset) % participants_count, true, job))
+                solve_job(jobs[job]);
+        }
+    }
+
+    void solve_job(KinematicsJob<Chain> &job)
+    {
+        job.result = job.chain->inverse_kinematics(job.target, max_iterations, max_error);
+    }
+
+};
+
+}
@@ -0,0 +1,330 @@
+#pragma once
+
+extern "C"
+{
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+}
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <expected>
+#include <limits>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "error.hpp"
+#include "kinematics.hpp"
+
+using namespace glm;
+using namespace std;
+
+namespace rfs {
+
+/**
+ * The range of angles that a joint can take.
+ */
+struct JointRange {
+    float min;
+    float max;
+};
+
+/**
+ * A cache of known solutions of the inverse kinematics of a chain, indexed by the position of
+ * the end effector.
+ *
+ * The workspace (a box given by its two opposite corners) is divided in a grid of cubic cells,
+ * and each cell keeps the joint angles of one solution whose end effector falls inside it. Before
+ * solving the inverse kinematics the chain is seeded with the nearest solution known, so when the
+ * chain goes over and over the same region (as the legs during a gait) only one or two iterations
+ * are needed.
+ *
+ * The cache can be filled in advance by sampling the joint space with `sample()`, lazily with the
+ * solutions found by `inverse_kinematics()`, or loaded from a file written with `save()`.
+ */
+class KinematicWorkspace {
+
+public:
+
+    KinematicWorkspace(size_t joints_count, const vec3 &min_corner, const vec3 &max_corner, float cell_size):
+        joints_count(joints_count), min_corner(min_corner), cell_size(cell_size)
+    {
+        for (int axis = 0; axis < 3; axis++)
+            dimensions[axis] = std::max<uint32_t>(1, ceil((max_corner[axis] - min_corner[axis]) / cell_size));
+        cells.assign(cells_count() * stride(), EMPTY);
+    }
+
+    /**
+     * Move the joints of `chain` so that its end effector reaches `target`, starting from the
+     * nearest solution known.
+     *
+     * If the chain converges, its solution is remembered. The rest of arguments are the ones of
+     * `KinematicChain::inverse_kinematics()`.
+     */
+    template <size_t N>
+    IKResult inverse_kinematics(BasicKinematicChain<N> &chain, const vec3 &target, int max_iterations = 128,
+        float max_error = 1.0)
+    {
+        seed(chain, target);
+        const IKResult result = chain.inverse_kinematics(target, max_iterations, max_error);
+        if (result.converged)
+            remember(chain, chain.forward_kinematics());
+        return result;
+    }
+
+    /**
+     * Load the cache from the file `path`, written previously with `save()`.
+     *
+     * The file is memory-mapped and its solutions replace the current ones. Returns an `EINVAL`
+     * error if the file doesn't match the joints count and the grid of this workspace.
+     */
+    expected<void, rfs::Error> load(const string &path)
+    {
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return unexpected(rfs::Error(errno));
+
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) < 0) {
+            const int error = errno;
+            ::close(fd);
+            return unexpected(rfs::Error(error));
+        }
+
+        const size_t size = file_stat.st_size;
+        const size_t expected_size = sizeof(FileHeader) + cells.size() * sizeof(float);
+        if (size != expected_size) {
+            ::close(fd);
+            return unexpected(rfs::Error(EINVAL, "wrong workspace file size"));
+        }
+
+        void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED)
+            return unexpected(rfs::Error(errno));
+
+        FileHeader header;
+        memcpy(&header, data, sizeof(header));
+        if (header.magic != FILE_MAGIC || header.joints_count != joints_count || header.cell_size != cell_size
+            || !equal(begin(header.min_corner), end(header.min_corner), &min_corner[0])
+            || !equal(begin(header.dimensions), end(header.dimensions), begin(dimensions))) {
+            munmap(data, size);
+            return unexpected(rfs::Error(EINVAL, "workspace file doesn't match"));
+        }
+
+        memcpy(cells.data(), static_cast<const uint8_t *>(data) + sizeof(header), cells.size() * sizeof(float));
+        munmap(data, size);
+        return {};
+    }
+
+    /**
+     * Remember the current angles of `chain` as the solution for `ee_position`, the position of its end effector.
+     *
+     * It replaces the solution known in the same cell if `ee_position` is nearer to the center of the cell.
+     * Positions out of the workspace are ignored.
+     */
+    template <size_t N>
+    void remember(const BasicKinematicChain<N> &chain, const vec3 &ee_position)
+    {
+        int32_t cell[3];
+        if (!cell_of(ee_position, cell))
+            return;
+
+        float *entry = &cells[cell_index(cell) * stride()];
+        if (!isnan(entry[0]) && distance(ee_position, cell_center(cell)) >= distance(entry_position(entry), cell_center(cell)))
+            return;
+
+        entry[0] = ee_position.x;
+        entry[1] = ee_position.y;
+        entry[2] = ee_position.z;
+        chain.get_angles(span<float>(entry + 3, joints_count));
+    }
+
+    /**
+     * Write the cache to the file `path`, so it can be loaded later with `load()`.
+     */
+    expected<void, rfs::Error> save(const string &path) const
+    {
+        const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return unexpected(rfs::Error(errno));
+
+        FileHeader header{FILE_MAGIC, static_cast<uint32_t>(joints_count), {min_corner.x, min_corner.y, min_corner.z},
+            cell_size, {dimensions[0], dimensions[1], dimensions[2]}};
+        if (!write_all(fd, &header, sizeof(header)) || !write_all(fd, cells.data(), cells.size() * sizeof(float))) {
+            const int error = errno;
+            ::close(fd);
+            return unexpected(rfs::Error(error));
+        }
+
+        if (::close(fd) == -1)
+            return unexpected(rfs::Error(errno));
+        return {};
+    }
+
+    /**
+     * Fill the cache by computing the forward kinematics of `chain` over a grid of its joint space.
+     *
+     * `ranges` has the range of each joint, and each range is sampled at `samples_per_joint` angles,
+     * so `samples_per_joint` to the power of the number of joints positions are computed. The
+     * angles of `chain` are restored at the end.
+     */
+    template <size_t N>
+    void sample(BasicKinematicChain<N> &chain, span<const JointRange> ranges, size_t samples_per_joint)
+    {
+        if (ranges.size() < joints_count || samples_per_joint == 0)
+            return;
+
+        vector<float> saved_angles(joints_count);
+        chain.get_angles(saved_angles);
+
+        // Go over the grid like an odometer, with the last joint changing faster, so the forward
+        // kinematics of most samples only computes the transform of the last joint
+        vector<size_t> steps(joints_count, 0);
+        vector<float> angles(joints_count);
+        while (true) {
+            for (size_t i = 0; i < joints_count; i++) {
+                const float t = (samples_per_joint > 1) ? float(steps[i]) / (samples_per_joint - 1) : 0.5f;
+                angles[i] = ranges[i].min + t * (ranges[i].max - ranges[i].min);
+            }
+            chain.set_angles(angles);
+            remember(chain, chain.forward_kinematics());
+
+            size_t joint = joints_count;
+            while (joint > 0 && ++steps[joint - 1] == samples_per_joint)
+                steps[--joint] = 0;
+            if (joint == 0)
+                break;
+        }
+
+        chain.set_angles(saved_angles);
+    }
+
+    /**
+     * Set the angles of `chain` to the known solution whose end effector is nearest to `target`.
+     *
+     * Only the cell of `target` and its neighbours are searched. Returns `false`, without changing
+     * `chain`, if there's no solution known there.
+     */
+    template <size_t N>
+    bool seed(BasicKinematicChain<N> &chain, const vec3 &target) const
+    {
+        int32_t cell[3];
+        if (!cell_of(target, cell))
+            return false;
+
+        const float *nearest = nullptr;
+        float nearest_distance = numeric_limits<float>::max();
+        for (int32_t dx = -1; dx <= 1; dx++) {
+            for (int32_t dy = -1; dy <= 1; dy++) {
+                for (int32_t dz = -1; dz <= 1; dz++) {
+                    const int32_t neighbour[3] = {cell[0] + dx, cell[1] + dy, cell[2] + dz};
+                    if (!inside(neighbour))
+                        continue;
+                    const float *entry = &cells[cell_index(neighbour) * stride()];
+                    if (isnan(entry[0]))
+                        continue;
+                    const float entry_distance = distance(entry_position(entry), target);
+                    if (entry_distance < nearest_distance) {
+                        nearest = entry;
+                        nearest_distance = entry_distance;
+                    }
+                }
+            }
+        }
+
+        if (!nearest)
+            return false;
+        chain.set_angles(span<const float>(nearest + 3, joints_count));
+        return true;
+    }
+
+private:
+
+    struct FileHeader {
+        uint32_t magic;
+        uint32_t joints_count;
+        float min_corner[3];
+        float cell_size;
+        uint32_t dimensions[3];
+    };
+
+    static constexpr uint32_t FILE_MAGIC = 0x4b575331;
+    static constexpr float EMPTY = numeric_limits<float>::quiet_NaN();
+
+    size_t joints_count;
+    vec3 min_corner;
+    float cell_size;
+    uint32_t dimensions[3];
+
+    // For each cell, the end effector position and the joint angles of its solution (a NaN
+    // position if there's none)
+    vector<float> cells;
+
+    size_t cells_count() const
+    {
+        return size_t(dimensions[0]) * dimensions[1] * dimensions[2];
+    }
+
+    vec3 cell_center(const int32_t cell[3]) const
+    {
+        return min_corner + (vec3(cell[0], cell[1], cell[2]) + vec3(0.5, 0.5, 0.5)) * cell_size;
+    }
+
+    size_t cell_index(const int32_t cell[3]) const
+    {
+        return (size_t(cell[2]) * dimensions[1] + cell[1]) * dimensions[0] + cell[0];
+    }
+
+    bool cell_of(const vec3 &position, int32_t cell[3]) const
+    {
+        for (int axis = 0; axis < 3; axis++) {
+            const float index = floor((position[axis] - min_corner[axis]) / cell_size);
+            // Written this way to reject NaN too
+            if (!(index >= 0.0f && index < dimensions[axis]))
+                return false;
+            cell[axis] = index;
+        }
+        return true;
+    }
+
+    static vec3 entry_position(const float *entry)
+    {
+        return {entry[0], entry[1], entry[2]};
+    }
+
+    bool inside(const int32_t cell[3]) const
+    {
+        for (int axis = 0; axis < 3; axis++) {
+            if (cell[axis] < 0 || cell[axis] >= int32_t(dimensions[axis]))
+                return false;
+        }
+        return true;
+    }
+
+    size_t stride() const
+    {
+        return 3 + joints_count;
+    }
+
+    static bool write_all(int fd, const void *data, size_t size)
+    {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        while (size > 0) {
+            const ssize_t written = ::write(fd, bytes, size);
+            if (written < 0)
+                return false;
+            bytes += written;
+            size -= written;
+        }
+        return true;
+    }
+
+};
+
+}
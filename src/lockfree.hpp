@@ -0,0 +1,247 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+using namespace std;
+
+namespace rfs {
+
+/**
+ * A bounded queue that can be written by many threads and read by a single thread without locks.
+ *
+ * `N` is the capacity of the queue, and it must be a power of two. `T` must be default constructible
+ * and move assignable. The elements are stored inside the queue, so pushing and popping them never
+ * allocates memory (apart from what the move assignment of `T` might do).
+ */
+template <typename T, size_t N>
+class MpscQueue {
+
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "the capacity of MpscQueue must be a power of two");
+
+public:
+
+    MpscQueue(): tail(0), head(0)
+    {
+        for (size_t i = 0; i < N; i++)
+            cells[i].sequence.store(i, memory_order_relaxed);
+    }
+
+    /**
+     * Insert an element at the end of the queue.
+     *
+     * Returns `false` if the queue is full, in which case `value` is not modified.
+     * It can be called from any thread.
+     */
+    bool push(T &&value)
+    {
+        size_t position = tail.load(memory_order_relaxed);
+        Cell *cell;
+        while (true) {
+            cell = &cells[position & (N - 1)];
+            const size_t sequence = cell->sequence.load(memory_order_acquire);
+            const intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (difference == 0) {
+                if (tail.compare_exchange_weak(position, position + 1, memory_order_relaxed))
+                    break;
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = tail.load(memory_order_relaxed);
+            }
+        }
+
+        cell->value = std::move(value);
+        cell->sequence.store(position + 1, memory_order_release);
+        return true;
+    }
+
+    /**
+     * Extract the element at the beginning of the queue into `value`.
+     *
+     * Returns `false` if the queue is empty. It must be called always from the same thread.
+     */
+    bool pop(T &value)
+    {
+        Cell &cell = cells[head & (N - 1)];
+        const size_t sequence = cell.sequence.load(memory_order_acquire);
+        if (static_cast<intptr_t>(sequence) - static_cast<intptr_t>(head + 1) < 0)
+            return false;
+
+        value = std::move(cell.value);
+        cell.sequence.store(head + N, memory_order_release);
+        head++;
+        return true;
+    }
+
+private:
+
+    struct Cell {
+        atomic<size_t> sequence;
+        T value;
+    };
+
+    array<Cell, N> cells;
+    alignas(64) atomic<size_t> tail;
+    alignas(64) size_t head;
+
+};
+
+/**
+ * A slot with the latest value written by a thread, read by another thread without locks.
+ *
+ * Unlike a queue, writing a value replaces the previous one if it wasn't read yet, so a slow
+ * reader only gets the newest value and the writer never has to wait. It is a triple buffer: the
+ * writer and the reader each have their own copy of `T`, and they exchange them with a third one,
+ * so neither of them ever waits for the other. `T` must be default constructible and move
+ * assignable.
+ */
+template <typename T>
+class LatestValue {
+
+public:
+
+    LatestValue(): back(0), middle(1), front(2)
+    {}
+
+    /**
+     * Replace the value in the slot.
+     *
+     * It must be called always from the same thread.
+     */
+    void store(T &&value)
+    {
+        buffers[back] = std::move(value);
+        back = middle.exchange(back | FRESH, memory_order_acq_rel) & INDEX_MASK;
+    }
+
+    /**
+     * Move the value in the slot into `value`, if it is newer than the last one loaded.
+     *
+     * Returns `false` if no value was stored since the last call, in which case `value` is not
+     * modified. It must be called always from the same thread.
+     */
+    bool load(T &value)
+    {
+        if (!(middle.load(memory_order_relaxed) & FRESH))
+            return false;
+
+        front = middle.exchange(front, memory_order_acq_rel) & INDEX_MASK;
+        value = std::move(buffers[front]);
+        return true;
+    }
+
+private:
+
+    // The index of the middle buffer, and whether it has a value not loaded yet
+    static const uint8_t INDEX_MASK = 0x03;
+    static const uint8_t FRESH = 0x04;
+
+    array<T, 3> buffers;
+    alignas(64) uint8_t back;
+    alignas(64) atomic<uint8_t> middle;
+    alignas(64) uint8_t front;
+
+};
+
+/**
+ * A value written by a thread and read by any number of threads, without locks.
+ *
+ * It is a sequence lock: the writer never waits, and it increments a sequence number before and
+ * after replacing the value, so a reader that overlaps with a write sees that the sequence changed
+ * and reads again. Unlike `LatestValue`, the value is not consumed by reading it, so all the
+ * readers get the same value. `T` must be trivially copyable, as it is copied word by word, and
+ * small enough to copy it much faster than it is written.
+ */
+template <typename T>
+class SeqLock {
+
+    static_assert(is_trivially_copyable_v<T>, "the value of SeqLock must be trivially copyable");
+
+public:
+
+    SeqLock(): sequence(0)
+    {
+        for (atomic<uint64_t> &word: words)
+            word.store(0, memory_order_relaxed);
+    }
+
+    /**
+     * Return the number of values stored.
+     */
+    uint64_t get_version() const
+    {
+        return sequence.load(memory_order_acquire) / 2;
+    }
+
+    /**
+     * Return the latest value stored, or a value with all its bytes zero if none was stored yet.
+     *
+     * It can be called from any thread. It never blocks the writer, but it tries again while the
+     * writer is replacing the value.
+     */
+    T load() const
+    {
+        T value;
+        load(value);
+        return value;
+    }
+
+    /**
+     * Copy the latest value stored into `value`, and return its version (see `get_version()`).
+     */
+    uint64_t load(T &value) const
+    {
+        array<uint64_t, WORDS_COUNT> buffer;
+        while (true) {
+            const uint64_t start = sequence.load(memory_order_acquire);
+            if (start & 1)
+                continue;
+
+            for (size_t i = 0; i < WORDS_COUNT; i++)
+                buffer[i] = words[i].load(memory_order_relaxed);
+
+            atomic_thread_fence(memory_order_acquire);
+            if (sequence.load(memory_order_relaxed) == start) {
+                memcpy(&value, buffer.data(), sizeof(T));
+                return start / 2;
+            }
+        }
+    }
+
+    /**
+     * Replace the value.
+     *
+     * It must be called always from the same thread.
+     */
+    void store(const T &value)
+    {
+        array<uint64_t, WORDS_COUNT> buffer{};
+        memcpy(buffer.data(), &value, sizeof(T));
+
+        // An odd sequence tells the readers that the value is being written
+        const uint64_t start = sequence.load(memory_order_relaxed);
+        sequence.store(start + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        for (size_t i = 0; i < WORDS_COUNT; i++)
+            words[i].store(buffer[i], memory_order_relaxed);
+
+        sequence.store(start + 2, memory_order_release);
+    }
+
+private:
+
+    static constexpr size_t WORDS_COUNT = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    alignas(64) atomic<uint64_t> sequence;
+    array<atomic<uint64_t>, WORDS_COUNT> words;
+
+};
+
+}
@@ -1,7 +1,13 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <expected>
+#include <span>
+#include <string_view>
+#include <vector>
 #include <zmq.hpp>
 
 #include "error.hpp"
@@ -24,18 +30,29 @@ public:
 
     static expected<ServoCommand, Error> from_zmq_message(const zmq::message_t &message)
     {
-        if (message.size() != sizeof(ServoCommand)) {
+        return from_bytes(span<const uint8_t>(static_cast<const uint8_t *>(message.data()), message.size()));
+    }
+
+    static expected<ServoCommand, Error> from_bytes(span<const uint8_t> data)
+    {
+        if (data.size() != sizeof(ServoCommand)) {
             return unexpected(Error(EBADMSG, "wrong message size"));
         }
 
-        ServoCommand cmd = *(ServoCommand *)message.data();
+        ServoCommand cmd{0, 0.0};
+        memcpy(&cmd, data.data(), sizeof(ServoCommand));
 
-        if (string(cmd.msg_prefix, 5) != prefix()) {
+        if (string_view(cmd.msg_prefix, PREFIX_LENGTH) != "SERVO") {
             return unexpected(Error(EBADMSG, "wrong prefix"));
         }
         return cmd;
     }
 
+    span<const uint8_t> bytes() const
+    {
+        return span<const uint8_t>(reinterpret_cast<const uint8_t *>(this), sizeof(ServoCommand));
+    }
+
     static string prefix()
     {
         return "SERVO";
@@ -59,4 +76,215 @@ public:
 
 };
 
-}
\ No newline at end of file
+/**
+ * The command for a single servo in a `ServoFrame`.
+ */
+struct ServoFrameEntry {
+    int32_t id;
+    float angle;
+};
+
+/**
+ * A message with the commands for several servos at once.
+ *
+ * The message is a header followed by the packed array of entries:
+ *
+ * | Bytes  | Content                                                   |
+ * |--------|-----------------------------------------------------------|
+ * | 0-4    | The prefix `SFRAM`                                        |
+ * | 5      | The version of the format (`ServoFrame::VERSION`)         |
+ * | 6-7    | The number of entries                                     |
+ * | 8-15   | The timestamp of the frame, in nanoseconds                |
+ * | 16-... | The entries, 8 bytes each (see `ServoFrameEntry`)         |
+ *
+ * All the fields are in the native byte order, as the messages don't leave the robot. A
+ * `ServoFrame` is a view of a received message: it doesn't copy it, so the message must outlive
+ * it. Use `ServoFrameBuilder` to build the messages.
+ */
+class ServoFrame {
+
+public:
+
+    static constexpr uint8_t VERSION = 1;
+
+    struct Header {
+        char msg_prefix[5];
+        uint8_t version;
+        uint16_t entries_count;
+        uint64_t timestamp;
+    };
+
+    /**
+     * Return a view of the frame contained in `message`.
+     *
+     * Returns an `EBADMSG` error if the message is not a frame of this version.
+     */
+    static expected<ServoFrame, Error> from_zmq_message(const zmq::message_t &message)
+    {
+        return from_bytes(span<const uint8_t>(static_cast<const uint8_t *>(message.data()), message.size()));
+    }
+
+    /**
+     * Return a view of the frame contained in `data`.
+     *
+     * See `from_zmq_message()`. `data` must be aligned to 8 bytes, as the buffers of the ZeroMQ
+     * messages are.
+     */
+    static expected<ServoFrame, Error> from_bytes(span<const uint8_t> data)
+    {
+        if (data.size() < sizeof(Header)) {
+            return unexpected(Error(EBADMSG, "wrong message size"));
+        }
+
+        const Header *header = reinterpret_cast<const Header *>(data.data());
+        if (string_view(header->msg_prefix, sizeof(header->msg_prefix)) != PREFIX) {
+            return unexpected(Error(EBADMSG, "wrong prefix"));
+        }
+        if (header->version != VERSION) {
+            return unexpected(Error(EBADMSG, "wrong version"));
+        }
+        if (data.size() != sizeof(Header) + header->entries_count * sizeof(ServoFrameEntry)) {
+            return unexpected(Error(EBADMSG, "wrong message size"));
+        }
+
+        const ServoFrameEntry *entries = reinterpret_cast<const ServoFrameEntry *>(data.data() + sizeof(Header));
+        return ServoFrame(header->timestamp, span<const ServoFrameEntry>(entries, header->entries_count));
+    }
+
+    /**
+     * Return the commands of the frame.
+     */
+    span<const ServoFrameEntry> entries() const
+    {
+        return frame_entries;
+    }
+
+    /**
+     * Return the timestamp of the frame, in nanoseconds.
+     */
+    uint64_t timestamp() const
+    {
+        return frame_timestamp;
+    }
+
+private:
+
+    friend class ServoFrameBuilder;
+
+    static constexpr string_view PREFIX = "SFRAM";
+
+    ServoFrame(uint64_t timestamp, span<const ServoFrameEntry> entries):
+        frame_timestamp(timestamp), frame_entries(entries)
+    {}
+
+    uint64_t frame_timestamp;
+    span<const ServoFrameEntry> frame_entries;
+
+};
+
+static_assert(sizeof(ServoFrame::Header) == 16, "the ServoFrame header must be packed");
+static_assert(sizeof(ServoFrameEntry) == 8, "the ServoFrame entries must be packed");
+
+/**
+ * Builds `ServoFrame` messages in a buffer that is reused from one frame to the next.
+ *
+ * The buffer is allocated once for `capacity` entries, so building a frame doesn't allocate memory.
+ */
+class ServoFrameBuilder {
+
+public:
+
+    ServoFrameBuilder(size_t capacity):
+        frame_buffer((sizeof(ServoFrame::Header) + capacity * sizeof(ServoFrameEntry) + sizeof(uint64_t) - 1) / sizeof(uint64_t)),
+        capacity(std::min<size_t>(capacity, UINT16_MAX))
+    {
+        clear(0);
+    }
+
+    /**
+     * Add the command for a servo to the frame.
+     *
+     * Returns `false` if the frame is full.
+     */
+    bool add(int32_t id, float angle)
+    {
+        ServoFrame::Header *frame_header = header();
+        if (frame_header->entries_count >= capacity) {
+            return false;
+        }
+        entries()[frame_header->entries_count++] = {id, angle};
+        return true;
+    }
+
+    /**
+     * Return the frame built, to be sent with `zmq::socket_t::send()`.
+     *
+     * The buffer is not copied, so it is valid until the frame is modified.
+     */
+    zmq::const_buffer buffer() const
+    {
+        return zmq::const_buffer(frame_buffer.data(), size());
+    }
+
+    /**
+     * Return the frame built, to be published in a `ShmChannel`.
+     *
+     * The bytes are not copied, so they are valid until the frame is modified.
+     */
+    span<const uint8_t> bytes() const
+    {
+        return span<const uint8_t>(reinterpret_cast<const uint8_t *>(frame_buffer.data()), size());
+    }
+
+    /**
+     * Remove all the commands, and start a new frame with the given timestamp.
+     */
+    void clear(uint64_t timestamp)
+    {
+        ServoFrame::Header *frame_header = header();
+        memcpy(frame_header->msg_prefix, ServoFrame::PREFIX.data(), sizeof(frame_header->msg_prefix));
+        frame_header->version = ServoFrame::VERSION;
+        frame_header->entries_count = 0;
+        frame_header->timestamp = timestamp;
+    }
+
+    /**
+     * Return the size in bytes of the frame built.
+     */
+    size_t size() const
+    {
+        return sizeof(ServoFrame::Header) + header()->entries_count * sizeof(ServoFrameEntry);
+    }
+
+    /**
+     * Return the frame built as a new message.
+     */
+    zmq::message_t to_zmq_message() const
+    {
+        return zmq::message_t(frame_buffer.data(), size());
+    }
+
+private:
+
+    // Of 64-bit words, so that it is aligned as the header
+    vector<uint64_t> frame_buffer;
+    size_t capacity;
+
+    ServoFrame::Header *header()
+    {
+        return reinterpret_cast<ServoFrame::Header *>(frame_buffer.data());
+    }
+
+    const ServoFrame::Header *header() const
+    {
+        return reinterpret_cast<const ServoFrame::Header *>(frame_buffer.data());
+    }
+
+    ServoFrameEntry *entries()
+    {
+        return reinterpret_cast<ServoFrameEntry *>(reinterpret_cast<uint8_t *>(frame_buffer.data()) + sizeof(ServoFrame::Header));
+    }
+
+};
+
+}
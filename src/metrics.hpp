@@ -0,0 +1,360 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+namespace rfs {
+
+/**
+ * Whether the metrics are collected.
+ *
+ * They are only collected if `RFS_METRICS` is defined when compiling (the CMake option of the
+ * same name). Otherwise the metrics are never updated, and the calls to update them are empty, so
+ * the compiler removes them.
+ */
+#ifdef RFS_METRICS
+constexpr bool METRICS_ENABLED = true;
+#else
+constexpr bool METRICS_ENABLED = false;
+#endif
+
+/**
+ * The number of copies of the values of each metric.
+ *
+ * Each thread updates one of the copies, so that the threads don't contend for the same cache line.
+ */
+constexpr size_t METRICS_SHARDS_COUNT = 8;
+
+/**
+ * A metric, as it is exposed to Prometheus.
+ *
+ * All the metrics are in a global list, to be exported together with `metrics_prometheus()`.
+ * They must live until the end of the program, so they should be global or static variables.
+ */
+class Metric {
+
+public:
+
+    Metric(const char *name, const char *help): name(name), help(help), next(nullptr)
+    {
+        if constexpr (METRICS_ENABLED) {
+            // The metrics are usually created during the static initialization, in any order
+            next = head().load(memory_order_relaxed);
+            while (!head().compare_exchange_weak(next, this, memory_order_release, memory_order_relaxed))
+                ;
+        }
+    }
+
+    Metric(const Metric &) = delete;
+    Metric &operator=(const Metric &) = delete;
+
+    /**
+     * The first metric of the list of all the metrics.
+     */
+    static const Metric *first()
+    {
+        return head().load(memory_order_acquire);
+    }
+
+    /**
+     * The next metric of the list of all the metrics, or `nullptr` if it is the last one.
+     */
+    const Metric *get_next() const
+    {
+        return next;
+    }
+
+    /**
+     * Append the metric to `output` in the Prometheus text format.
+     */
+    virtual void write_prometheus(string &output) const = 0;
+
+protected:
+
+    const char *name;
+    const char *help;
+
+    // The index of the copy of the values that the calling thread updates
+    static size_t shard()
+    {
+        static atomic<size_t> threads_count{0};
+        thread_local const size_t thread_shard = threads_count.fetch_add(1, memory_order_relaxed) % METRICS_SHARDS_COUNT;
+        return thread_shard;
+    }
+
+    void write_header(string &output, const char *type) const
+    {
+        output.append("# HELP ").append(name).append(" ").append(help).append("\n");
+        output.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+    }
+
+    static void write_number(string &output, double value)
+    {
+        char number[32];
+        snprintf(number, sizeof(number), "%.9g", value);
+        output.append(number);
+    }
+
+private:
+
+    const Metric *next;
+
+    static atomic<const Metric *> &head()
+    {
+        static atomic<const Metric *> list_head{nullptr};
+        return list_head;
+    }
+
+};
+
+/**
+ * A value that only increases, as a number of events or of bytes.
+ *
+ * If `scale` is given, the value exported is the sum of the increments multiplied by it, for
+ * instance to count microseconds and export seconds.
+ */
+class MetricsCounter: public Metric {
+
+public:
+
+    MetricsCounter(const char *name, const char *help, double scale = 1.0): Metric(name, help), scale(scale)
+    {}
+
+    void add(uint64_t increment = 1)
+    {
+        if constexpr (METRICS_ENABLED)
+            shards[shard()].value.fetch_add(increment, memory_order_relaxed);
+    }
+
+    uint64_t value() const
+    {
+        uint64_t total = 0;
+        for (const Shard &counter_shard: shards)
+            total += counter_shard.value.load(memory_order_relaxed);
+        return total;
+    }
+
+    virtual void write_prometheus(string &output) const override
+    {
+        write_header(output, "counter");
+        output.append(name).append(" ");
+        write_number(output, value() * scale);
+        output.append("\n");
+    }
+
+private:
+
+    struct alignas(64) Shard {
+        atomic<uint64_t> value{0};
+    };
+
+    double scale;
+    array<Shard, METRICS_SHARDS_COUNT> shards;
+
+};
+
+/**
+ * The distribution of a value, as the latency of an operation.
+ *
+ * The values are integers counted in buckets whose limits are the powers of 2, so that a value and
+ * the upper limit of its bucket differ less than a factor of 2 over the whole range, with a fixed
+ * number of buckets. The values are exported multiplied by `scale`, by default from nanoseconds
+ * to seconds.
+ */
+class MetricsHistogram: public Metric {
+
+public:
+
+    /**
+     * The number of buckets. The last one has all the values equal or bigger than 2<SUP>39</SUP>.
+     */
+    static constexpr size_t BUCKETS_COUNT = 40;
+
+    MetricsHistogram(const char *name, const char *help, double scale = 1e-9): Metric(name, help), scale(scale)
+    {}
+
+    void record(uint64_t value)
+    {
+        if constexpr (METRICS_ENABLED) {
+            Shard &histogram_shard = shards[shard()];
+            const size_t bucket = std::min<size_t>(bit_width(value), BUCKETS_COUNT - 1);
+            histogram_shard.buckets[bucket].fetch_add(1, memory_order_relaxed);
+            histogram_shard.sum.fetch_add(value, memory_order_relaxed);
+        }
+    }
+
+    void record(chrono::steady_clock::duration duration)
+    {
+        record(static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(duration).count()));
+    }
+
+    virtual void write_prometheus(string &output) const override
+    {
+        array<uint64_t, BUCKETS_COUNT> counts{};
+        uint64_t sum = 0;
+        for (const Shard &histogram_shard: shards) {
+            for (size_t i = 0; i < BUCKETS_COUNT; i++)
+                counts[i] += histogram_shard.buckets[i].load(memory_order_relaxed);
+            sum += histogram_shard.sum.load(memory_order_relaxed);
+        }
+
+        // The buckets of Prometheus are cumulative: each one has the values up to its limit
+        write_header(output, "histogram");
+        uint64_t count = 0;
+        for (size_t i = 0; i < BUCKETS_COUNT - 1; i++) {
+            count += counts[i];
+            output.append(name).append("_bucket{le=\"");
+            write_number(output, ((uint64_t(1) << i) - 1) * scale);
+            output.append("\"} ").append(to_string(count)).append("\n");
+        }
+        count += counts[BUCKETS_COUNT - 1];
+        output.append(name).append("_bucket{le=\"+Inf\"} ").append(to_string(count)).append("\n");
+        output.append(name).append("_sum ");
+        write_number(output, sum * scale);
+        output.append("\n");
+        output.append(name).append("_count ").append(to_string(count)).append("\n");
+    }
+
+private:
+
+    struct alignas(64) Shard {
+        array<atomic<uint64_t>, BUCKETS_COUNT> buckets{};
+        atomic<uint64_t> sum{0};
+    };
+
+    double scale;
+    array<Shard, METRICS_SHARDS_COUNT> shards;
+
+};
+
+/**
+ * Records in a histogram the time since its creation until its destruction.
+ *
+ * When the metrics are disabled it doesn't even read the clock.
+ */
+class MetricsTimer {
+
+public:
+
+    MetricsTimer(MetricsHistogram &histogram): histogram(histogram)
+    {
+        if constexpr (METRICS_ENABLED)
+            start = chrono::steady_clock::now();
+    }
+
+    ~MetricsTimer()
+    {
+        if constexpr (METRICS_ENABLED)
+            histogram.record(chrono::steady_clock::now() - start);
+    }
+
+    MetricsTimer(const MetricsTimer &) = delete;
+    MetricsTimer &operator=(const MetricsTimer &) = delete;
+
+private:
+
+    MetricsHistogram &histogram;
+    chrono::steady_clock::time_point start;
+
+};
+
+/**
+ * Return all the metrics in the Prometheus text format.
+ */
+inline string metrics_prometheus()
+{
+    string output;
+    for (const Metric *metric = Metric::first(); metric; metric = metric->get_next())
+        metric->write_prometheus(output);
+    return output;
+}
+
+/**
+ * The metrics of the library.
+ */
+namespace metrics {
+
+inline MetricsCounter i2c_transactions{"rfs_i2c_transactions_total", "I2C transactions executed."};
+inline MetricsCounter i2c_errors{"rfs_i2c_errors_total", "I2C transactions that failed."};
+inline MetricsCounter i2c_bytes{"rfs_i2c_bytes_total", "Data bytes written or read in the I2C transactions."};
+inline MetricsHistogram i2c_seconds{"rfs_i2c_transaction_seconds", "Duration of the I2C transactions."};
+
+inline MetricsCounter ik_solves{"rfs_ik_solves_total", "Inverse kinematics problems solved."};
+inline MetricsCounter ik_not_converged{"rfs_ik_not_converged_total",
+    "Inverse kinematics problems that ended with an error bigger than the maximum."};
+inline MetricsHistogram ik_iterations{"rfs_ik_iterations", "Iterations of each inverse kinematics problem.", 1.0};
+inline MetricsHistogram ik_residuals{"rfs_ik_residual",
+    "Distance from the end effector to the target after solving the inverse kinematics, in thousandths of the units.", 1.0};
+inline MetricsHistogram ik_seconds{"rfs_ik_seconds", "Duration of each inverse kinematics problem."};
+
+inline MetricsHistogram servo_commit_seconds{"rfs_servo_commit_seconds",
+    "Duration of sending the angles of a set of servos to the devices."};
+
+inline MetricsCounter control_cycles{"rfs_control_cycles_total", "Cycles executed by the control loops."};
+inline MetricsCounter control_overruns{"rfs_control_overruns_total",
+    "Cycles of the control loops that ended after the start of the next one."};
+inline MetricsHistogram control_cycle_seconds{"rfs_control_cycle_seconds",
+    "Duration of the stages of each cycle of the control loops."};
+inline MetricsHistogram control_wakeup_seconds{"rfs_control_wakeup_seconds",
+    "Delay between the instant in which a cycle of the control loops should start and the instant in which it starts."};
+
+inline MetricsCounter display_sleep_seconds{"rfs_display_sleep_seconds_total",
+    "Time spent waiting for the display to execute the commands.", 1e-6};
+
+/**
+ * Execute an I<SUP>2</SUP>C transaction of `bytes` data bytes with `transaction`, and record it.
+ *
+ * `transaction` returns the result of the system call, negative if it failed.
+ */
+template <typename F>
+inline auto measure_i2c(size_t bytes, F &&transaction)
+{
+    if constexpr (METRICS_ENABLED) {
+        const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        const auto result = transaction();
+        i2c_seconds.record(chrono::steady_clock::now() - start);
+        i2c_transactions.add();
+        if (result < 0)
+            i2c_errors.add();
+        else
+            i2c_bytes.add(bytes);
+        return result;
+    } else {
+        return transaction();
+    }
+}
+
+/**
+ * Record the result of an inverse kinematics problem.
+ *
+ * An `error` that is not finite, as the one of a solver that diverged, is recorded in the last
+ * bucket of the residuals.
+ */
+inline void record_ik(int iterations, float error, bool converged)
+{
+    if constexpr (METRICS_ENABLED) {
+        // Below 2^64, so that it can always be converted
+        constexpr float MAX_RESIDUAL = 1e18f;
+
+        ik_solves.add();
+        if (!converged)
+            ik_not_converged.add();
+        ik_iterations.record(static_cast<uint64_t>(std::max(iterations, 0)));
+        const float residual = isfinite(error) ? std::clamp(error * 1000.0f, 0.0f, MAX_RESIDUAL) : MAX_RESIDUAL;
+        ik_residuals.record(static_cast<uint64_t>(residual));
+    }
+}
+
+}
+
+}
@@ -5,21 +5,26 @@ extern "C"
 {
     #include <fcntl.h>
     #include <i2c/smbus.h>
+    #include <linux/i2c.h>
     #include <linux/i2c-dev.h>
     #include <sys/ioctl.h>
     #include <unistd.h>
 }
 
 #include <algorithm>
+#include <array>
 #include <chrono>
 #include <cinttypes>
 #include <cmath>
 #include <expected>
 #include <memory>
+#include <span>
 #include <thread>
-#include <vector>
 
+#include "coroutine.hpp"
 #include "error.hpp"
+#include "i2cbackend.hpp"
+#include "metrics.hpp"
 #include "pwm.hpp"
 
 using namespace std;
@@ -77,7 +82,9 @@ enum class Pca9685OutputDisabledMode {
 };
 
 /**
- * Contains the returned On/Off times of a PWM channel.
+ * Contains the On/Off times of a PWM channel.
+ *
+ * It is returned by `Pca9685::on_off_times()` and accepted by `Pca9685::set_on_off_times_bulk()`.
  */
 struct Pca9685OnOffTimes {
 
@@ -104,6 +111,13 @@ struct Pca9685OnOffTimes {
     bool always_off;
 };
 
+/**
+ * The values of the 4 registers of a PWM channel, ready to be sent to the device.
+ *
+ * It is returned by `Pca9685::on_off_registers()` and accepted by `Pca9685::set_on_off_registers_bulk()`.
+ */
+using Pca9685OnOffRegisters = array<uint8_t, 4>;
+
 class Pca9685PwmInterface {
 
 public:
@@ -151,15 +165,62 @@ private:
 
 };
 
+class Pca9685;
+
+/**
+ * A single PWM channel in the **PCA9685** device, without virtual methods.
+ * 
+ * Unlike `Pca9685Pwm`, it calls the `Pca9685` instance directly instead of through a `weak_ptr`
+ * and a virtual method, so it satisfies `PwmDriver` and the calls can be inlined. The `Pca9685`
+ * instance must outlive it. It is obtained with `Pca9685::static_pwm()`.
+ */
+class Pca9685StaticPwm {
+
+public:
+
+    Pca9685StaticPwm(uint32_t channel, Pca9685 &controller):
+        controller(&controller), channel(channel), phase(0.0)
+    {}
+
+    expected<void, rfs::Error> set_duty_cycle(float duty_cycle);
+
+    expected<void, rfs::Error> set_frequency(float frequency) {
+        return {};
+    }
+
+    expected<void, rfs::Error> set_phase(float phase) {
+        this->phase = phase;
+        return {};
+    }
+
+private:
+
+    Pca9685 *controller;
+    uint32_t channel;
+    float phase;
+
+};
+
 /**
  * This class is the main interface with a single **PCA9685** device.
  * 
  * An instance of this class is used to configure the general aspects of the **PCA9685** device.
  * Then, it can be used to instantiate objects of the class `Pca9685Pwm`, which are use
  * to control individual PWM channels.
+ * 
+ * Optionally, the instance can keep a copy of the device's registers (the register cache). In that
+ * case, the registers are read from the device once when calling `open()`, and after that the getters
+ * and the read-modify-write operations use the copy instead of reading the device again. Every write
+ * is still sent to the device. If the device can be modified from outside this instance (for
+ * instance, by another I<SUP>2</SUP>C master), the method `resync()` reloads the copy.
+ * 
+ * The instance can also be put in staged mode (see `set_staged_mode()`), in which the On/Off times
+ * are kept in memory and sent to the device all together when calling `flush()`.
  */
 class Pca9685: public Pca9685PwmInterface {
 
+    friend class Pca9685Array;
+
 public:
 
     static const uint32_t ALL_CHANNELS = 61;
@@ -169,8 +230,16 @@ public:
      * 
      * Before executing any method on this instance, the method `open()` has to be called
      * to open a communication channel with a given real device.
+     * 
+     * If `register_cache` is true, the register cache is used. See the class description.
+     *
+     * `backend` is the access to the I<SUP>2</SUP>C controller, the system's one by default.
+     * It must outlive this instance.
      */
-    Pca9685(): fd(-1), this_shared(this, [](auto){}) {}
+    Pca9685(bool register_cache = false, I2cBackend &backend = I2cBackend::system()):
+        backend(&backend), fd(-1), owns_fd(true), address(0), i2c_supported(false), register_cache(register_cache), cache_valid(false),
+        staged(false), dirty_channels(0), flushed_channels(0), this_shared(this, [](auto){})
+    {}
 
     ~Pca9685() {
         if (fd >= 0)
@@ -203,6 +272,39 @@ public:
         return get_bool(MODE1_REGISTER, MODE1_SLEEP_MASK);
     }
 
+    /**
+     * Restart the **PCA9685** after it was put to sleep, without blocking the executor.
+     *
+     * It works as `restart()`, but the wait for the oscillator is a timer of `executor`, so the
+     * executor's thread runs other coroutines in the meantime.
+     */
+    Task<expected<bool, rfs::Error>> async_restart(Executor &executor) {
+        const expected<bool, rfs::Error> restart_needed = wake_up();
+        if (!restart_needed)
+            co_return restart_needed;
+
+        co_await executor.sleep_for(OSCILLATOR_STARTUP_TIME);
+
+        co_return restart_outputs(*restart_needed);
+    }
+
+    /**
+     * Set the frequency of the PWM signal, without blocking the executor.
+     *
+     * It works as `set_frequency()`, but the restart is done with `async_restart()`.
+     */
+    Task<expected<void, rfs::Error>> async_set_frequency(Executor &executor, float frequency,
+        float clock_frequency = INTERNAL_CLOCK_FREQUENCY) {
+        const expected<void, rfs::Error> prescale_result = write_prescale(frequency, clock_frequency);
+        if (!prescale_result)
+            co_return prescale_result;
+
+        const expected<bool, rfs::Error> restart_result = co_await async_restart(executor);
+        if (!restart_result)
+            co_return unexpected(restart_result.error());
+        co_return expected<void, rfs::Error>{};
+    }
+
     /**
      * Return the clock mode used by the **PCA9685** device.
      */
@@ -221,9 +323,13 @@ public:
         if (!set_off_result)
             return set_off_result;
 
-        if (::close(fd) == -1)
+        if (owns_fd && backend->close(fd) == -1)
             return unexpected(rfs::Error(errno));
         fd = -1;
+        owns_fd = true;
+        cache_valid = false;
+        dirty_channels = 0;
+        flushed_channels = 0;
 
         return {};
     }
@@ -235,6 +341,41 @@ public:
         return get_bool(MODE2_REGISTER, MODE2_OUTDRV_MASK);
     }
 
+    /**
+     * Send to the device the On/Off times set while in staged mode.
+     * 
+     * Only the channels whose registers are different from the ones last sent to the device are
+     * written, and every run of consecutive channels is written in a single transfer (see
+     * `set_on_off_times_bulk()`). If a transfer fails, the channels not yet written keep pending
+     * for the next call.
+     */
+    expected<void, rfs::Error> flush() {
+        uint32_t channel = 0;
+        while (channel < CHANNELS_COUNT) {
+            if (!(dirty_channels & (1 << channel))) {
+                channel++;
+                continue;
+            }
+
+            uint32_t last_channel = channel;
+            while (last_channel + 1 < CHANNELS_COUNT && (dirty_channels & (1 << (last_channel + 1))))
+                last_channel++;
+
+            const uint32_t count = last_channel - channel + 1;
+            const uint8_t reg = channel * NUM_REGISTERS_PER_CHANNEL + CHANNELS_REGISTERS_OFFSET;
+            const expected<void, rfs::Error> write_result = write_long_block(reg, span<const uint8_t>(
+                frame.data() + channel * NUM_REGISTERS_PER_CHANNEL, count * NUM_REGISTERS_PER_CHANNEL));
+            if (!write_result)
+                return write_result;
+
+            const uint16_t run_mask = ((1 << count) - 1) << channel;
+            dirty_channels &= ~run_mask;
+            flushed_channels |= run_mask;
+            channel = last_channel + 1;
+        }
+        return {};
+    }
+
     /**
      * Return the frequency of the PWM signal.
      * 
@@ -256,9 +397,30 @@ public:
      * 
      * The **PCA9685** needs to be restarted after it has been put to sleep without shutting down
      * all whe PWM channels. To restart it, just call the method `restart()`.
+     * 
+     * The RESTART bit is changed by the device itself, so it is always read from the device,
+     * even when using the register cache.
      */
     expected<bool, rfs::Error> needs_restart() const {
-        return get_bool(MODE1_REGISTER, MODE1_RESTART_MASK);
+        const expected<uint8_t, rfs::Error> value = read_device_register(MODE1_REGISTER);
+        if (!value)
+            return unexpected(value.error());
+        return *value & MODE1_RESTART_MASK;
+    }
+
+    /**
+     * Return the values of the registers of a channel for the given On/Off times.
+     * 
+     * The values can be computed once and written many times with `set_on_off_registers_bulk()`,
+     * which saves validating and converting the On/Off times each time. The meaning of `times` is
+     * the same as in `set_on_off_times_bulk()`.
+     */
+    static expected<Pca9685OnOffRegisters, rfs::Error> on_off_registers(const Pca9685OnOffTimes &times) {
+        Pca9685OnOffRegisters registers;
+        const expected<void, rfs::Error> encode_result = encode_on_off_times(times, registers.data());
+        if (!encode_result)
+            return unexpected(encode_result.error());
+        return registers;
     }
 
     /**
@@ -271,17 +433,18 @@ public:
             return unexpected(rfs::Error(EINVAL, "channel"));
 
         const uint8_t reg = channel * NUM_REGISTERS_PER_CHANNEL + CHANNELS_REGISTERS_OFFSET;
-        const expected<vector<uint8_t>, rfs::Error> res = read_block(reg, NUM_REGISTERS_PER_CHANNEL);
+        Pca9685OnOffRegisters data;
+        const expected<void, rfs::Error> res = read_block(reg, data);
         if (!res)
             return unexpected(res.error());
         
-        const uint16_t on_int = (((*res)[1] & 0x0f) << 8) | (*res)[0];
-        const uint16_t off_int = (((*res)[3] & 0x0f) << 8) | (*res)[2];
+        const uint16_t on_int = ((data[1] & 0x0f) << 8) | data[0];
+        const uint16_t off_int = ((data[3] & 0x0f) << 8) | data[2];
         return Pca9685OnOffTimes{
             static_cast<float>(on_int)/COUNTER_TICKS,
             static_cast<float>(off_int)/COUNTER_TICKS,
-            ((*res)[1] & LED_ON_MASK) ? true : false,
-            ((*res)[3] & LED_OFF_MASK) ? true : false
+            (data[1] & LED_ON_MASK) ? true : false,
+            (data[3] & LED_OFF_MASK) ? true : false
         };
     }
 
@@ -299,24 +462,32 @@ public:
      * **PCA9685** documentation about this subject, but by default this address is `0x40`.
      */
     expected<void, rfs::Error> open(string device, uint8_t address) {
-        fd = ::open(device.c_str(), O_RDWR);
+        fd = backend->open(device.c_str());
         if (fd < 0) {
             return unexpected(rfs::Error(errno));
         }
 
-        if (ioctl(fd, I2C_SLAVE, address) < 0) {
-            ::close(fd);
+        if (backend->select(fd, address) < 0) {
+            backend->close(fd);
             fd = -1;
             return unexpected(rfs::Error(errno));
         }
-        
-        // Enable register address auto-increment
-        const expected<void, rfs::Error> result_set_auto_inc = set_auto_increment(true);
-        if (!result_set_auto_inc) {
-            ::close(fd);
-            fd = -1;
-        }
-        return result_set_auto_inc;
+        owns_fd = true;
+        return init(address);
+    }
+
+    /**
+     * Initializes the communication with a real **PCA9685** device through an I<SUP>2</SUP>C
+     * controller already open.
+     * 
+     * It works as the other `open()` method, but `fd` is the file descriptor of the I<SUP>2</SUP>C
+     * controller, which can be shared with other devices (see `Pca9685Array`). The device's address
+     * is selected before every SMBus transfer, and `fd` is not closed by `close()`.
+     */
+    expected<void, rfs::Error> open(int fd, uint8_t address) {
+        this->fd = fd;
+        owns_fd = false;
+        return init(address);
     }
 
     /**
@@ -366,23 +537,39 @@ public:
      * where shut down.
      */
     expected<bool, rfs::Error> restart() {
-        const expected<bool, rfs::Error> restart_needed = needs_restart();
+        const expected<bool, rfs::Error> restart_needed = wake_up();
         if (!restart_needed)
             return restart_needed;
-        
-        const expected<void, rfs::Error> sleep_released = set_bool(MODE1_REGISTER, MODE1_SLEEP_MASK, false);
-        if (!sleep_released)
-            return unexpected(sleep_released.error());
 
-        this_thread::sleep_for(chrono::microseconds(500));
+        this_thread::sleep_for(OSCILLATOR_STARTUP_TIME);
 
-        if (*restart_needed) {
-            const expected<void, rfs::Error> set_bool_result = set_bool(MODE1_REGISTER, MODE1_RESTART_MASK, true);
-            if (!set_bool_result)
-                return unexpected(set_bool_result.error());
-        }
+        return restart_outputs(*restart_needed);
+    }
 
-        return *restart_needed;
+    /**
+     * Reload the register cache from the device.
+     * 
+     * This is needed only when using the register cache and the device's registers may have been
+     * modified from outside this instance. If the register cache is not used, it does nothing.
+     */
+    expected<void, rfs::Error> resync() {
+        if (!register_cache)
+            return {};
+
+        cache_valid = false;
+        const expected<void, rfs::Error> read_result = read_long_block(
+            MODE1_REGISTER, span<uint8_t>(registers.data(), CACHED_REGISTERS_COUNT));
+        if (!read_result)
+            return read_result;
+
+        const expected<uint8_t, rfs::Error> prescale = read_device_register(PRESCALE_REGISTER);
+        if (!prescale)
+            return unexpected(prescale.error());
+        registers[PRESCALE_REGISTER] = *prescale;
+        registers[MODE1_REGISTER] &= ~MODE1_RESTART_MASK;
+
+        cache_valid = true;
+        return {};
     }
 
     /**
@@ -449,23 +636,9 @@ public:
      * given frequency is not valid, an EINVAL error will be returned.
      */
     expected<void, rfs::Error> set_frequency(float frequency, float clock_frequency = INTERNAL_CLOCK_FREQUENCY) {
-        if (frequency <= 0.0)
-            return unexpected(Error(EINVAL, "frequency"));
-        if (clock_frequency < 0.0)
-            return unexpected(Error(EINVAL, "clock_frequency"));
-
-        const uint32_t prescale_32 = roundf(clock_frequency/(COUNTER_TICKS*frequency)) - 1;
-        if (prescale_32 < MIN_PRESCALE || prescale_32 > MAX_PRESCALE)
-            return unexpected(rfs::Error(EINVAL, "prescale value out of range: [" + to_string(MIN_PRESCALE) + ", " + to_string(MAX_PRESCALE)));
-
-        uint8_t prescale = static_cast<uint8_t>(prescale_32);
-        const expected<void, rfs::Error> sleep_result = sleep();
-        if (!sleep_result)
-            return sleep_result;
-        
-        const expected<void, rfs::Error> write_result = write_register(PRESCALE_REGISTER, prescale);
-        if (!write_result)
-            return write_result;
+        const expected<void, rfs::Error> prescale_result = write_prescale(frequency, clock_frequency);
+        if (!prescale_result)
+            return prescale_result;
 
         const expected<bool, rfs::Error> restart_result = restart();
         if (!restart_result)
@@ -473,6 +646,34 @@ public:
         return {};
     }
 
+    /**
+     * Set the registers of a range of consecutive channels at once.
+     * 
+     * It works as `set_on_off_times_bulk()`, but `registers` contains the values of the registers
+     * of each channel, as returned by `on_off_registers()`, so its size must be a multiple of 4.
+     * The values are not validated.
+     */
+    expected<void, rfs::Error> set_on_off_registers_bulk(uint32_t first_channel, span<const uint8_t> registers) {
+        if (first_channel >= CHANNELS_COUNT)
+            return unexpected(rfs::Error(EINVAL, "first_channel"));
+        if (registers.size() % NUM_REGISTERS_PER_CHANNEL != 0)
+            return unexpected(rfs::Error(EINVAL, "registers"));
+        const size_t count = registers.size() / NUM_REGISTERS_PER_CHANNEL;
+        if (count > CHANNELS_COUNT - first_channel)
+            return unexpected(rfs::Error(EINVAL, "too many channels"));
+        if (count == 0)
+            return {};
+
+        if (staged) {
+            for (size_t i = 0; i < count; i++)
+                stage_channel(first_channel + i, registers.data() + i * NUM_REGISTERS_PER_CHANNEL);
+            return {};
+        }
+
+        const uint8_t reg = first_channel * NUM_REGISTERS_PER_CHANNEL + CHANNELS_REGISTERS_OFFSET;
+        return write_long_block(reg, registers);
+    }
+
     /**
      * Set the On/Off times of the given channel.
      * 
@@ -482,31 +683,77 @@ public:
      * `on_time` and `off_time` are the position within the signal period where it is turned on and off, respectively.
      * The valid values are from 0.0 to 1.0, 0.0 meaning at the start of the period and 1.0 at the end.
      * `on_time` and `off_time` cannot hold the same value.
+     * 
+     * In staged mode, the On/Off times are not sent to the device until `flush()` is called.
      */
-    virtual expected<void, rfs::Error> set_on_off_times(uint32_t channel, float on_time, float off_time) override {
+    virtual expected<void, rfs::Error> set_on_off_times(uint32_t channel, float on_time, float off_time) override final {
         if (!channel_exists(channel))
             return unexpected(rfs::Error(EINVAL, "channel"));
-        if (on_time < 0.0 || on_time > 1.0)
-            return unexpected(rfs::Error(EINVAL, "on_time"));
-        if (off_time < 0.0 || off_time > 1.0)
-            return unexpected(rfs::Error(EINVAL, "off_time"));
 
-        const uint16_t on_time_int = min<uint16_t>(static_cast<uint16_t>(on_time * COUNTER_TICKS), COUNTER_TICKS - 1);
-        const uint16_t off_time_int = min<uint16_t>(static_cast<uint16_t>(off_time * COUNTER_TICKS), COUNTER_TICKS - 1);
-
-        if (on_time_int == off_time_int)
-            return unexpected(rfs::Error(EINVAL, "on_time and off_time must have different values"));
+        array<uint8_t, NUM_REGISTERS_PER_CHANNEL> data;
+        const expected<void, rfs::Error> encode_result = encode_on_off_times(
+            Pca9685OnOffTimes{on_time, off_time, false, false}, data.data());
+        if (!encode_result)
+            return encode_result;
+
+        if (staged) {
+            if (channel == ALL_CHANNELS) {
+                for (uint32_t c = 0; c < CHANNELS_COUNT; c++)
+                    stage_channel(c, data.data());
+            } else {
+                stage_channel(channel, data.data());
+            }
+            return {};
+        }
 
-        vector<uint8_t> data{
-            static_cast<uint8_t>(on_time_int & 0xff),
-            static_cast<uint8_t>((on_time_int >> 8) & 0x0f),
-            static_cast<uint8_t>(off_time_int & 0xff),
-            static_cast<uint8_t>((off_time_int >> 8) & 0x0f),
-        };
         const uint8_t reg = channel * NUM_REGISTERS_PER_CHANNEL + CHANNELS_REGISTERS_OFFSET;
         return write_block(reg, data);
     }
 
+    /**
+     * Set the On/Off times of a range of consecutive channels at once.
+     * 
+     * `first_channel` is the first channel of the range, from 0 to 15, and `times` contains the
+     * On/Off times of `first_channel` and the channels that follow it. The range cannot go beyond
+     * the last channel.
+     * 
+     * The `on` and `off` fields of every element have the same meaning and restrictions as in
+     * `set_on_off_times()`, except when `always_on` or `always_off` are set, in which case `on` and
+     * `off` can hold the same value.
+     * 
+     * Thanks to the register *auto increment* mode, the whole range is written in a single
+     * I<SUP>2</SUP>C transfer if the I<SUP>2</SUP>C controller supports plain I<SUP>2</SUP>C
+     * transfers, or in as few SMBus block writes as possible if not. Nothing is written if any
+     * of the elements is not valid.
+     * 
+     * In staged mode, the On/Off times are not sent to the device until `flush()` is called.
+     */
+    expected<void, rfs::Error> set_on_off_times_bulk(uint32_t first_channel, span<const Pca9685OnOffTimes> times) {
+        if (first_channel >= CHANNELS_COUNT)
+            return unexpected(rfs::Error(EINVAL, "first_channel"));
+        if (times.size() > CHANNELS_COUNT - first_channel)
+            return unexpected(rfs::Error(EINVAL, "too many channels"));
+        if (times.empty())
+            return {};
+
+        array<uint8_t, CHANNELS_COUNT * NUM_REGISTERS_PER_CHANNEL> data;
+        for (size_t i = 0; i < times.size(); i++) {
+            const expected<void, rfs::Error> encode_result = encode_on_off_times(
+                times[i], data.data() + i * NUM_REGISTERS_PER_CHANNEL);
+            if (!encode_result)
+                return encode_result;
+        }
+
+        if (staged) {
+            for (size_t i = 0; i < times.size(); i++)
+                stage_channel(first_channel + i, data.data() + i * NUM_REGISTERS_PER_CHANNEL);
+            return {};
+        }
+
+        const uint8_t reg = first_channel * NUM_REGISTERS_PER_CHANNEL + CHANNELS_REGISTERS_OFFSET;
+        return write_long_block(reg, span<const uint8_t>(data.data(), times.size() * NUM_REGISTERS_PER_CHANNEL));
+    }
+
     /**
      * Set the moment at which the **PCA9685** device updates the PWM signals after a configuration change.
      */
@@ -529,6 +776,26 @@ public:
         return set_bool(MODE2_REGISTER, MODE2_INVRT_MASK, inverted);
     }
 
+    /**
+     * Enable or disable the staged mode.
+     * 
+     * In staged mode, `set_on_off_times()`, `set_on_off_times_bulk()` and the `Pca9685Pwm` instances
+     * don't send the On/Off times to the device, but store them in memory. The method `flush()`
+     * then sends the channels that changed. This allows to set all the channels once per control
+     * cycle without writing the ones that keep the same value.
+     * 
+     * When disabling the staged mode, the pending On/Off times are flushed.
+     */
+    expected<void, rfs::Error> set_staged_mode(bool enabled) {
+        if (!enabled && staged) {
+            const expected<void, rfs::Error> flush_result = flush();
+            if (!flush_result)
+                return flush_result;
+        }
+        staged = enabled;
+        return {};
+    }
+
     /**
      * Set the SUBADDRESS_1.
      * 
@@ -599,6 +866,26 @@ public:
         return set_bool(MODE1_REGISTER, MODE1_SLEEP_MASK, true);
     }
 
+    /**
+     * Return whether the staged mode is enabled.
+     * 
+     * See `set_staged_mode()`.
+     */
+    bool staged_mode() const {
+        return staged;
+    }
+
+    /**
+     * Return a PWM channel that calls this instance directly, to be used with `BasicServo`.
+     * 
+     * See `Pca9685StaticPwm`.
+     */
+    expected<Pca9685StaticPwm, rfs::Error> static_pwm(uint32_t channel) {
+        if (!channel_exists(channel))
+            return unexpected(rfs::Error(EINVAL, "channel"));
+        return Pca9685StaticPwm(channel, *this);
+    }
+
     /**
      * Return the SUBADDRESS_1.
      * 
@@ -678,7 +965,7 @@ private:
     static const uint8_t SUB1_REGISTER      = 2;
     static const uint8_t SUB2_REGISTER      = 3;
     static const uint8_t SUB3_REGISTER      = 4;
-    static const uint8_t ALLCALL_REGISTER   = 4;
+    static const uint8_t ALLCALL_REGISTER   = 5;
     static const uint8_t LED0_REGISTER      = 6;
     static const uint8_t ALL_LED_REGISTER   = 250;
     static const uint8_t PRESCALE_REGISTER  = 254;
@@ -690,14 +977,103 @@ private:
     static constexpr float INTERNAL_CLOCK_FREQUENCY = 25e6;
     static const uint8_t MIN_PRESCALE               = 3;
     static const uint8_t MAX_PRESCALE               = 255;
+    static const uint32_t REGISTERS_COUNT           = 256;
+    static const uint32_t CACHED_REGISTERS_COUNT    = LED0_REGISTER + CHANNELS_COUNT * NUM_REGISTERS_PER_CHANNEL;
 
+    // The time that the oscillator needs to start after leaving the sleep mode
+    static constexpr chrono::microseconds OSCILLATOR_STARTUP_TIME{500};
+
+    I2cBackend *backend;
     int fd;
+    bool owns_fd;
+    uint8_t address;
+    bool i2c_supported;
+    bool register_cache;
+    bool cache_valid;
+    array<uint8_t, REGISTERS_COUNT> registers;
+    bool staged;
+    array<uint8_t, CHANNELS_COUNT * NUM_REGISTERS_PER_CHANNEL> frame;
+    uint16_t dirty_channels;
+    uint16_t flushed_channels;
     shared_ptr<Pca9685PwmInterface> this_shared;
 
+    // Prepare a device just opened, closing it if it fails
+    expected<void, rfs::Error> init(uint8_t address) {
+        this->address = address;
+
+        // Check whether plain I2C transfers are available, to write the LED registers in a single transfer
+        unsigned long funcs = 0;
+        i2c_supported = (backend->functionalities(fd, &funcs) >= 0) && (funcs & I2C_FUNC_I2C);
+
+        // Enable register address auto-increment
+        cache_valid = false;
+        dirty_channels = 0;
+        flushed_channels = 0;
+        expected<void, rfs::Error> result = set_auto_increment(true);
+
+        // Load the register cache, now that auto-increment allows to read it in blocks
+        if (result)
+            result = resync();
+
+        if (!result) {
+            if (owns_fd)
+                backend->close(fd);
+            fd = -1;
+            owns_fd = true;
+        }
+        return result;
+    }
+
+    // When sharing the I2C controller, the SMBus transfers go to the last address selected
+    expected<void, rfs::Error> select_device() const {
+        if (!owns_fd && backend->select(fd, address) < 0)
+            return unexpected(rfs::Error(errno));
+        return {};
+    }
+
+    bool cached(uint8_t reg, uint32_t size = 1) const {
+        if (!cache_valid)
+            return false;
+        return reg + size <= CACHED_REGISTERS_COUNT || (reg == PRESCALE_REGISTER && size == 1);
+    }
+
     bool channel_exists(uint32_t channel) const {
         return channel < CHANNELS_COUNT || channel == ALL_CHANNELS;
     }
 
+    void stage_channel(uint32_t channel, const uint8_t *data) {
+        uint8_t *staged_data = frame.data() + channel * NUM_REGISTERS_PER_CHANNEL;
+        copy(data, data + NUM_REGISTERS_PER_CHANNEL, staged_data);
+
+        // The registers known to be in the device are the ones in the cache or the ones flushed
+        const uint16_t channel_mask = 1 << channel;
+        const uint8_t reg = channel * NUM_REGISTERS_PER_CHANNEL + CHANNELS_REGISTERS_OFFSET;
+        const bool known = cache_valid || (flushed_channels & channel_mask);
+        if (known && equal(data, data + NUM_REGISTERS_PER_CHANNEL, registers.begin() + reg))
+            dirty_channels &= ~channel_mask;
+        else
+            dirty_channels |= channel_mask;
+    }
+
+    static expected<void, rfs::Error> encode_on_off_times(const Pca9685OnOffTimes &times, uint8_t *data) {
+        if (times.on < 0.0 || times.on > 1.0)
+            return unexpected(rfs::Error(EINVAL, "on_time"));
+        if (times.off < 0.0 || times.off > 1.0)
+            return unexpected(rfs::Error(EINVAL, "off_time"));
+
+        const uint16_t on_time_int = min<uint16_t>(static_cast<uint16_t>(times.on * COUNTER_TICKS), COUNTER_TICKS - 1);
+        const uint16_t off_time_int = min<uint16_t>(static_cast<uint16_t>(times.off * COUNTER_TICKS), COUNTER_TICKS - 1);
+
+        if (on_time_int == off_time_int && !times.always_on && !times.always_off)
+            return unexpected(rfs::Error(EINVAL, "on_time and off_time must have different values"));
+
+        data[0] = static_cast<uint8_t>(on_time_int & 0xff);
+        data[1] = static_cast<uint8_t>((on_time_int >> 8) & 0x0f) | (times.always_on ? LED_ON_MASK : 0);
+        data[2] = static_cast<uint8_t>(off_time_int & 0xff);
+        data[3] = static_cast<uint8_t>((off_time_int >> 8) & 0x0f) | (times.always_off ? LED_OFF_MASK : 0);
+        return {};
+    }
+
     expected<bool, rfs::Error> get_bool(uint8_t reg, uint8_t mask) const {
         const expected<uint8_t, rfs::Error> value = read_register(reg);
         if (!value)
@@ -705,17 +1081,59 @@ private:
         return *value & mask;
     }
 
-    expected<vector<uint8_t>, rfs::Error> read_block(uint8_t reg, uint8_t size) const {
-        vector<uint8_t> data(size);
+    expected<void, rfs::Error> read_block(uint8_t reg, span<uint8_t> data) const {
+        if (cached(reg, data.size())) {
+            copy(registers.begin() + reg, registers.begin() + reg + data.size(), data.begin());
+            return {};
+        }
 
-        const int32_t read_result = i2c_smbus_read_i2c_block_data(fd, reg, size, data.data());
+        const expected<void, rfs::Error> select_result = select_device();
+        if (!select_result)
+            return unexpected(select_result.error());
+        const int32_t read_result = metrics::measure_i2c(data.size(),
+            [&]() { return backend->read_block_data(fd, reg, data.size(), data.data()); });
         if (read_result < 0)
             return unexpected(rfs::Error(errno));
-        return data;
+        return {};
+    }
+
+    expected<void, rfs::Error> read_long_block(uint8_t reg, span<uint8_t> data) const {
+        if (i2c_supported) {
+            // A single transfer: write the register address, then read all the data
+            i2c_msg messages[2] = {
+                {address, 0, 1, &reg},
+                {address, I2C_M_RD, static_cast<uint16_t>(data.size()), data.data()}
+            };
+            if (metrics::measure_i2c(data.size(), [&]() { return backend->transfer(fd, messages, 2); }) < 0)
+                return unexpected(rfs::Error(errno));
+            return {};
+        }
+
+        const expected<void, rfs::Error> select_result = select_device();
+        if (!select_result)
+            return unexpected(select_result.error());
+        // SMBus block reads are limited to I2C_SMBUS_BLOCK_MAX bytes each
+        for (size_t offset = 0; offset < data.size(); offset += I2C_SMBUS_BLOCK_MAX) {
+            const size_t size = min<size_t>(data.size() - offset, I2C_SMBUS_BLOCK_MAX);
+            const int32_t read_result = metrics::measure_i2c(size,
+                [&]() { return backend->read_block_data(fd, reg + offset, size, data.data() + offset); });
+            if (read_result < 0)
+                return unexpected(rfs::Error(errno));
+        }
+        return {};
     }
 
     expected<uint8_t, rfs::Error> read_register(uint8_t reg) const {
-        const int32_t read_result = i2c_smbus_read_byte_data(fd, reg);
+        if (cached(reg))
+            return registers[reg];
+        return read_device_register(reg);
+    }
+
+    expected<uint8_t, rfs::Error> read_device_register(uint8_t reg) const {
+        const expected<void, rfs::Error> select_result = select_device();
+        if (!select_result)
+            return unexpected(select_result.error());
+        const int32_t read_result = metrics::measure_i2c(1, [&]() { return backend->read_byte_data(fd, reg); });
         if (read_result < 0)
             return unexpected(rfs::Error(errno));
         return read_result & 0x00ff;
@@ -725,11 +1143,22 @@ private:
         return set_bool(MODE1_REGISTER, MODE1_AI_MASK, enabled);
     }
 
+    // The second part of the restart, once the oscillator is running
+    expected<bool, rfs::Error> restart_outputs(bool restart_needed) {
+        if (restart_needed) {
+            const expected<void, rfs::Error> set_bool_result = set_bool(MODE1_REGISTER, MODE1_RESTART_MASK, true);
+            if (!set_bool_result)
+                return unexpected(set_bool_result.error());
+        }
+
+        return restart_needed;
+    }
+
     expected<void, rfs::Error> set_bits(uint8_t reg, uint8_t mask, uint8_t value) {
         const expected<uint8_t, rfs::Error> result_read = read_register(reg);
         if (!result_read)
             return unexpected(result_read.error());
-        return write_register(reg, value);
+        return write_register(reg, (*result_read & ~mask) | (value & mask));
     }
 
     expected<void, rfs::Error> set_bool(uint8_t reg, uint8_t mask, bool value) {
@@ -741,20 +1170,112 @@ private:
         return write_register(reg, register_value);
     }
 
-    expected<void, rfs::Error> write_register(uint8_t reg, uint8_t value) const {
-        const int32_t write_result = i2c_smbus_write_byte_data(fd, reg, value);
+    void update_cache(uint8_t reg, span<const uint8_t> data) {
+        for (size_t i = 0; i < data.size(); i++) {
+            const uint32_t current_reg = reg + i;
+            if (current_reg >= ALL_LED_REGISTER && current_reg < ALL_LED_REGISTER + NUM_REGISTERS_PER_CHANNEL) {
+                // The ALL_LED registers are written into every channel's registers
+                for (uint32_t channel = 0; channel < CHANNELS_COUNT; channel++)
+                    registers[LED0_REGISTER + channel * NUM_REGISTERS_PER_CHANNEL + current_reg - ALL_LED_REGISTER] = data[i];
+                flushed_channels = 0;
+            } else if (current_reg < REGISTERS_COUNT) {
+                registers[current_reg] = data[i];
+                if (current_reg >= LED0_REGISTER && current_reg < CACHED_REGISTERS_COUNT)
+                    flushed_channels &= ~(1 << ((current_reg - LED0_REGISTER) / NUM_REGISTERS_PER_CHANNEL));
+            }
+        }
+        // The device clears the RESTART bit when it is written
+        if (reg == MODE1_REGISTER)
+            registers[MODE1_REGISTER] &= ~MODE1_RESTART_MASK;
+    }
+
+    // The first part of the restart: leave the sleep mode, and return whether the outputs need a restart
+    expected<bool, rfs::Error> wake_up() {
+        const expected<bool, rfs::Error> restart_needed = needs_restart();
+        if (!restart_needed)
+            return restart_needed;
+
+        const expected<void, rfs::Error> sleep_released = set_bool(MODE1_REGISTER, MODE1_SLEEP_MASK, false);
+        if (!sleep_released)
+            return unexpected(sleep_released.error());
+        return *restart_needed;
+    }
+
+    // Put the device to sleep and write the prescale for the given frequency
+    expected<void, rfs::Error> write_prescale(float frequency, float clock_frequency) {
+        if (frequency <= 0.0)
+            return unexpected(Error(EINVAL, "frequency"));
+        if (clock_frequency < 0.0)
+            return unexpected(Error(EINVAL, "clock_frequency"));
+
+        const uint32_t prescale_32 = roundf(clock_frequency/(COUNTER_TICKS*frequency)) - 1;
+        if (prescale_32 < MIN_PRESCALE || prescale_32 > MAX_PRESCALE)
+            return unexpected(rfs::Error(EINVAL, "prescale value out of range: [" + to_string(MIN_PRESCALE) + ", " + to_string(MAX_PRESCALE)));
+
+        uint8_t prescale = static_cast<uint8_t>(prescale_32);
+        const expected<void, rfs::Error> sleep_result = sleep();
+        if (!sleep_result)
+            return sleep_result;
+
+        return write_register(PRESCALE_REGISTER, prescale);
+    }
+
+    expected<void, rfs::Error> write_register(uint8_t reg, uint8_t value) {
+        const expected<void, rfs::Error> select_result = select_device();
+        if (!select_result)
+            return unexpected(select_result.error());
+        const int32_t write_result = metrics::measure_i2c(1, [&]() { return backend->write_byte_data(fd, reg, value); });
         if (write_result < 0)
             return unexpected(rfs::Error(errno));
+        update_cache(reg, span<const uint8_t>(&value, 1));
         return {};
     }
 
-    expected<void, rfs::Error> write_block(uint8_t reg, vector<uint8_t> data) {
-        const int32_t write_result = i2c_smbus_write_i2c_block_data(fd, reg, data.size(), data.data());
+    expected<void, rfs::Error> write_block(uint8_t reg, span<const uint8_t> data) {
+        const expected<void, rfs::Error> select_result = select_device();
+        if (!select_result)
+            return unexpected(select_result.error());
+        const int32_t write_result = metrics::measure_i2c(data.size(),
+            [&]() { return backend->write_block_data(fd, reg, data.size(), data.data()); });
         if (write_result < 0)
             return unexpected(rfs::Error(errno));
+        update_cache(reg, data);
+        return {};
+    }
+
+    expected<void, rfs::Error> write_long_block(uint8_t reg, span<const uint8_t> data) {
+        if (i2c_supported) {
+            // A single transfer: the register address followed by all the data
+            array<uint8_t, CHANNELS_COUNT * NUM_REGISTERS_PER_CHANNEL + 1> buffer;
+            buffer[0] = reg;
+            copy(data.begin(), data.end(), buffer.begin() + 1);
+
+            i2c_msg message{address, 0, static_cast<uint16_t>(data.size() + 1), buffer.data()};
+            if (metrics::measure_i2c(data.size(), [&]() { return backend->transfer(fd, &message, 1); }) < 0)
+                return unexpected(rfs::Error(errno));
+            update_cache(reg, data);
+            return {};
+        }
+
+        const expected<void, rfs::Error> select_result = select_device();
+        if (!select_result)
+            return unexpected(select_result.error());
+        // SMBus block writes are limited to I2C_SMBUS_BLOCK_MAX bytes each
+        for (size_t offset = 0; offset < data.size(); offset += I2C_SMBUS_BLOCK_MAX) {
+            const size_t size = min<size_t>(data.size() - offset, I2C_SMBUS_BLOCK_MAX);
+            const int32_t write_result = metrics::measure_i2c(size,
+                [&]() { return backend->write_block_data(fd, reg + offset, size, data.data() + offset); });
+            if (write_result < 0)
+                return unexpected(rfs::Error(errno));
+            update_cache(reg + offset, data.subspan(offset, size));
+        }
         return {};
     }
 
 };
 
+inline expected<void, rfs::Error> Pca9685StaticPwm::set_duty_cycle(float duty_cycle) {
+    return controller->set_on_off_times(channel, phase, phase + duty_cycle);
+}
+
 }
\ No newline at end of file
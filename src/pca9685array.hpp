@@ -0,0 +1,328 @@
+#pragma once
+
+extern "C"
+{
+    #include <fcntl.h>
+    #include <i2c/smbus.h>
+    #include <linux/i2c.h>
+    #include <linux/i2c-dev.h>
+    #include <sys/ioctl.h>
+    #include <unistd.h>
+}
+
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <expected>
+#include <memory>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "error.hpp"
+#include "i2cbackend.hpp"
+#include "metrics.hpp"
+#include "pca9685.hpp"
+
+using namespace std;
+
+namespace rfs {
+
+/**
+ * Several **PCA9685** devices on the same I<SUP>2</SUP>C bus, used as a single device with more channels.
+ *
+ * All the devices share the file descriptor of the I<SUP>2</SUP>C controller. The channels are
+ * numbered consecutively: the channels 0 to 15 are the ones of the first device, 16 to 31 the ones
+ * of the second device, and so on.
+ *
+ * The operations that are the same for all the devices (changing the frequency, sleeping,
+ * restarting and turning all the channels off) are sent once to the ALL_CALL address, to which
+ * all the devices respond, instead of once to each device. For this to work, all the devices
+ * must have the same configuration in the MODE1 register, which is the case if they are only
+ * configured through this class.
+ *
+ * Each device is still accessible with `controller()` for the rest of operations.
+ */
+class Pca9685Array {
+
+public:
+
+    /**
+     * The ALL_CALL address of the **PCA9685** devices at power-up, as a 7-bit address.
+     */
+    static const uint8_t DEFAULT_ALL_CALL_ADDRESS = 0x70;
+
+    /**
+     * If `register_cache` is true, every device uses the register cache (see `Pca9685`). `backend`
+     * is the access to the I<SUP>2</SUP>C controller, the system's one by default.
+     */
+    Pca9685Array(bool register_cache = true, I2cBackend &backend = I2cBackend::system()):
+        backend(&backend), fd(-1), register_cache(register_cache), all_call_address(DEFAULT_ALL_CALL_ADDRESS),
+        i2c_supported(false)
+    {}
+
+    ~Pca9685Array() {
+        if (fd >= 0)
+            close();
+    }
+
+    Pca9685Array(const Pca9685Array &) = delete;
+    Pca9685Array &operator=(const Pca9685Array &) = delete;
+
+    /**
+     * Return the total number of channels of all the devices.
+     */
+    uint32_t channels_count() const {
+        return controllers.size() * Pca9685::CHANNELS_COUNT;
+    }
+
+    /**
+     * Close the communication with all the devices.
+     *
+     * See `Pca9685::close()`.
+     */
+    expected<void, rfs::Error> close() {
+        expected<void, rfs::Error> result;
+        for (unique_ptr<Pca9685> &controller: controllers) {
+            const expected<void, rfs::Error> close_result = controller->close();
+            if (!close_result && result)
+                result = close_result;
+        }
+        controllers.clear();
+
+        if (backend->close(fd) == -1 && result)
+            result = unexpected(rfs::Error(errno));
+        fd = -1;
+        return result;
+    }
+
+    /**
+     * Return the device with the given index, in the order given to `open()`.
+     */
+    Pca9685 &controller(size_t index) {
+        return *controllers[index];
+    }
+
+    /**
+     * Send to all the devices the On/Off times set while in staged mode.
+     *
+     * See `Pca9685::flush()`.
+     */
+    expected<void, rfs::Error> flush() {
+        for (unique_ptr<Pca9685> &controller: controllers) {
+            const expected<void, rfs::Error> flush_result = controller->flush();
+            if (!flush_result)
+                return flush_result;
+        }
+        return {};
+    }
+
+    /**
+     * Initializes the communication with several **PCA9685** devices.
+     *
+     * `device` is the path of the I<SUP>2</SUP>C controller, and `addresses` has the 7-bit address
+     * of each device. Every device is opened as in `Pca9685::open()`, and it is configured to
+     * respond to `all_call_address`, a 7-bit address not used by any device in the bus.
+     */
+    expected<void, rfs::Error> open(const string &device, span<const uint8_t> addresses,
+        uint8_t all_call_address = DEFAULT_ALL_CALL_ADDRESS)
+    {
+        fd = backend->open(device.c_str());
+        if (fd < 0)
+            return unexpected(rfs::Error(errno));
+
+        unsigned long funcs = 0;
+        i2c_supported = (backend->functionalities(fd, &funcs) >= 0) && (funcs & I2C_FUNC_I2C);
+        this->all_call_address = all_call_address;
+
+        for (const uint8_t address: addresses) {
+            unique_ptr<Pca9685> controller = make_unique<Pca9685>(register_cache, *backend);
+            expected<void, rfs::Error> result = controller->open(fd, address);
+            if (result)
+                result = controller->set_all_call_address(all_call_address << 1);
+            if (result)
+                result = controller->set_all_call_address_enabled(true);
+            if (!result) {
+                close();
+                return result;
+            }
+            controllers.push_back(std::move(controller));
+        }
+        return {};
+    }
+
+    /**
+     * Restart all the devices after they were put to sleep.
+     *
+     * Unlike `Pca9685::restart()`, it always executes the restart sequence, which has no effect
+     * on the devices that don't need it.
+     */
+    expected<void, rfs::Error> restart() {
+        const expected<uint8_t, rfs::Error> mode1 = common_mode1();
+        if (!mode1)
+            return unexpected(mode1.error());
+
+        const uint8_t awake = *mode1 & ~Pca9685::MODE1_SLEEP_MASK;
+        const expected<void, rfs::Error> wake_result = broadcast_register(Pca9685::MODE1_REGISTER, awake);
+        if (!wake_result)
+            return wake_result;
+
+        this_thread::sleep_for(chrono::microseconds(500));
+
+        return broadcast_register(Pca9685::MODE1_REGISTER, awake | Pca9685::MODE1_RESTART_MASK);
+    }
+
+    /**
+     * Set the PWM signal of every channel of every device to always LOW, in a single transfer.
+     */
+    expected<void, rfs::Error> set_all_off() {
+        const array<uint8_t, Pca9685::NUM_REGISTERS_PER_CHANNEL> data{0, 0, 0, Pca9685::LED_OFF_MASK};
+        return broadcast(Pca9685::ALL_LED_REGISTER, data);
+    }
+
+    /**
+     * Set the frequency of the PWM signal of all the devices.
+     *
+     * It works as `Pca9685::set_frequency()`, but each step is sent once to all the devices.
+     */
+    expected<void, rfs::Error> set_frequency(float frequency, float clock_frequency = Pca9685::INTERNAL_CLOCK_FREQUENCY) {
+        if (frequency <= 0.0)
+            return unexpected(Error(EINVAL, "frequency"));
+        if (clock_frequency < 0.0)
+            return unexpected(Error(EINVAL, "clock_frequency"));
+
+        const uint32_t prescale = roundf(clock_frequency/(Pca9685::COUNTER_TICKS*frequency)) - 1;
+        if (prescale < Pca9685::MIN_PRESCALE || prescale > Pca9685::MAX_PRESCALE)
+            return unexpected(rfs::Error(EINVAL, "prescale value out of range"));
+
+        const expected<void, rfs::Error> sleep_result = sleep();
+        if (!sleep_result)
+            return sleep_result;
+
+        const expected<void, rfs::Error> write_result = broadcast_register(
+            Pca9685::PRESCALE_REGISTER, static_cast<uint8_t>(prescale));
+        if (!write_result)
+            return write_result;
+
+        return restart();
+    }
+
+    /**
+     * Set the On/Off times of a channel, numbered as explained in the class description.
+     *
+     * See `Pca9685::set_on_off_times()`.
+     */
+    expected<void, rfs::Error> set_on_off_times(uint32_t channel, float on_time, float off_time) {
+        if (channel >= channels_count())
+            return unexpected(rfs::Error(EINVAL, "channel"));
+        return controllers[channel / Pca9685::CHANNELS_COUNT]->set_on_off_times(
+            channel % Pca9685::CHANNELS_COUNT, on_time, off_time);
+    }
+
+    /**
+     * Set the On/Off times of a range of consecutive channels, that can span several devices.
+     *
+     * The channels of each device are written in a single transfer. See `Pca9685::set_on_off_times_bulk()`.
+     */
+    expected<void, rfs::Error> set_on_off_times_bulk(uint32_t first_channel, span<const Pca9685OnOffTimes> times) {
+        if (first_channel >= channels_count() || times.size() > channels_count() - first_channel)
+            return unexpected(rfs::Error(EINVAL, "channels"));
+
+        while (!times.empty()) {
+            const uint32_t channel = first_channel % Pca9685::CHANNELS_COUNT;
+            const size_t count = min<size_t>(times.size(), Pca9685::CHANNELS_COUNT - channel);
+            const expected<void, rfs::Error> write_result =
+                controllers[first_channel / Pca9685::CHANNELS_COUNT]->set_on_off_times_bulk(channel, times.first(count));
+            if (!write_result)
+                return write_result;
+            first_channel += count;
+            times = times.subspan(count);
+        }
+        return {};
+    }
+
+    /**
+     * Enable or disable the staged mode of all the devices.
+     *
+     * In staged mode, the channels of all the devices form a single frame, that is sent with `flush()`.
+     * See `Pca9685::set_staged_mode()`.
+     */
+    expected<void, rfs::Error> set_staged_mode(bool enabled) {
+        for (unique_ptr<Pca9685> &controller: controllers) {
+            const expected<void, rfs::Error> staged_result = controller->set_staged_mode(enabled);
+            if (!staged_result)
+                return staged_result;
+        }
+        return {};
+    }
+
+    /**
+     * Return the number of devices.
+     */
+    size_t size() const {
+        return controllers.size();
+    }
+
+    /**
+     * Put all the devices in sleep mode.
+     */
+    expected<void, rfs::Error> sleep() {
+        const expected<uint8_t, rfs::Error> mode1 = common_mode1();
+        if (!mode1)
+            return unexpected(mode1.error());
+        return broadcast_register(Pca9685::MODE1_REGISTER, *mode1 | Pca9685::MODE1_SLEEP_MASK);
+    }
+
+private:
+
+    I2cBackend *backend;
+    int fd;
+    bool register_cache;
+    uint8_t all_call_address;
+    bool i2c_supported;
+    vector<unique_ptr<Pca9685>> controllers;
+
+    // Write to all the devices at once, and update the copies of their registers
+    expected<void, rfs::Error> broadcast(uint8_t reg, span<const uint8_t> data) {
+        if (controllers.empty())
+            return unexpected(rfs::Error(ENOTCONN));
+
+        if (i2c_supported) {
+            array<uint8_t, Pca9685::NUM_REGISTERS_PER_CHANNEL + 1> buffer;
+            buffer[0] = reg;
+            copy(data.begin(), data.end(), buffer.begin() + 1);
+
+            i2c_msg message{all_call_address, 0, static_cast<uint16_t>(data.size() + 1), buffer.data()};
+            if (metrics::measure_i2c(data.size(), [&]() { return backend->transfer(fd, &message, 1); }) < 0)
+                return unexpected(rfs::Error(errno));
+        } else {
+            if (backend->select(fd, all_call_address) < 0)
+                return unexpected(rfs::Error(errno));
+            if (metrics::measure_i2c(data.size(),
+                [&]() { return backend->write_block_data(fd, reg, data.size(), data.data()); }) < 0)
+                return unexpected(rfs::Error(errno));
+        }
+
+        for (unique_ptr<Pca9685> &controller: controllers)
+            controller->update_cache(reg, data);
+        return {};
+    }
+
+    expected<void, rfs::Error> broadcast_register(uint8_t reg, uint8_t value) {
+        return broadcast(reg, span<const uint8_t>(&value, 1));
+    }
+
+    // The MODE1 register, that must be the same in all the devices, without the RESTART bit
+    expected<uint8_t, rfs::Error> common_mode1() const {
+        if (controllers.empty())
+            return unexpected(rfs::Error(ENOTCONN));
+        const expected<uint8_t, rfs::Error> mode1 = controllers.front()->read_register(Pca9685::MODE1_REGISTER);
+        if (!mode1)
+            return mode1;
+        return *mode1 & ~Pca9685::MODE1_RESTART_MASK;
+    }
+
+};
+
+}
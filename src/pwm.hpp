@@ -2,6 +2,7 @@
 #pragma once
 
 #include <chrono>
+#include <concepts>
 #include <expected>
 
 #include "error.hpp"
@@ -11,6 +12,18 @@ using namespace chrono;
 
 namespace rfs {
 
+/**
+ * The requirements of a PWM driver that is called directly instead of through `Pwm`.
+ *
+ * Any class with the same methods as `Pwm` satisfies it, without having to derive from `Pwm`.
+ * See `BasicServo`.
+ */
+template <typename T>
+concept PwmDriver = requires(T &driver, float value) {
+    { driver.set_frequency(value) } -> same_as<expected<void, rfs::Error>>;
+    { driver.set_duty_cycle(value) } -> same_as<expected<void, rfs::Error>>;
+};
+
 class Pwm {
 
 public:
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+#include "lockfree.hpp"
+#include "pca9685.hpp"
+
+using namespace std;
+
+namespace rfs {
+
+/**
+ * The state of the robot at an instant, as published by the control loop in a `RobotState`.
+ *
+ * `JOINTS` is the number of joints of the kinematic chains, and `SERVOS` the number of servos.
+ */
+template <size_t JOINTS, size_t SERVOS>
+struct RobotStateSnapshot {
+    /**
+     * The number of the publication, starting at 1. It is 0 if nothing was published yet.
+     */
+    uint64_t tick;
+
+    /**
+     * The instant of the state, in nanoseconds of `steady_clock`.
+     */
+    uint64_t timestamp;
+
+    /**
+     * The angles of the joints, as given by `KinematicChain::get_angles()`.
+     */
+    array<float, JOINTS> joint_angles;
+
+    /**
+     * The angles sent to the servos.
+     */
+    array<float, SERVOS> servo_angles;
+
+    /**
+     * The PWM signals of the servos, as sent to their **PCA9685** devices.
+     */
+    array<Pca9685OnOffTimes, SERVOS> servo_times;
+};
+
+/**
+ * The current state of the robot, written by the control loop and read by any thread.
+ *
+ * The control loop keeps its own `Snapshot`, updates it in each cycle and publishes it with
+ * `publish()`. The rest of threads (the web server, the telemetry, the planner...) get a
+ * consistent copy of the last one published with `load()`, without reading the devices again
+ * and without locks: the writer never waits for the readers, and the readers never allocate
+ * memory. See `SeqLock`.
+ */
+template <size_t JOINTS, size_t SERVOS>
+class RobotState {
+
+public:
+
+    using Snapshot = RobotStateSnapshot<JOINTS, SERVOS>;
+
+    /**
+     * Return the number of snapshots published.
+     */
+    uint64_t get_tick() const
+    {
+        return state.get_version();
+    }
+
+    /**
+     * Return the last snapshot published.
+     *
+     * Its `tick` is 0 if none was published yet. It can be called from any thread.
+     */
+    Snapshot load() const
+    {
+        return state.load();
+    }
+
+    /**
+     * Copy the last snapshot published into `snapshot`.
+     *
+     * It can be called from any thread.
+     */
+    void load(Snapshot &snapshot) const
+    {
+        state.load(snapshot);
+    }
+
+    /**
+     * Publish `snapshot` as the current state, taken at the instant `now`.
+     *
+     * Its `tick` and `timestamp` are set here. It must be called always from the same thread.
+     */
+    void publish(Snapshot &snapshot, chrono::steady_clock::time_point now = chrono::steady_clock::now())
+    {
+        snapshot.tick = state.get_version() + 1;
+        snapshot.timestamp = chrono::duration_cast<chrono::nanoseconds>(now.time_since_epoch()).count();
+        state.store(snapshot);
+    }
+
+private:
+
+    SeqLock<Snapshot> state;
+
+};
+
+}
@@ -18,6 +18,9 @@ public:
 
     static constexpr float SERVO_MIN_ANGLE = -90.0;
     static constexpr float SERVO_MAX_ANGLE = 90.0;
+    static constexpr float SERVO_FREQUENCY = 50.0;
+    static constexpr float SERVO_HALF_ANGLE_DUTY_CYCLE_DEFAULT = 0.025;
+    static constexpr float SERVO_OFFSET_DEFAULT = 0.075;
 
     Servo(unique_ptr<Pwm> &driver, float half_angle_duty_cycle = SERVO_HALF_ANGLE_DUTY_CYCLE_DEFAULT, float offset = SERVO_OFFSET_DEFAULT):
         driver(move(driver)), half_angle_duty_cycle(half_angle_duty_cycle), offset(offset)
@@ -38,14 +41,46 @@ public:
 
 private:
 
-    static constexpr float SERVO_FREQUENCY = 50.0;
-    static constexpr float SERVO_HALF_ANGLE_DUTY_CYCLE_DEFAULT = 0.025;
-    static constexpr float SERVO_OFFSET_DEFAULT = 0.075;
-
     unique_ptr<Pwm> driver;
     float half_angle_duty_cycle;
     float offset;
 
 };
 
+/**
+ * A servo that calls its PWM driver directly instead of through the virtual methods of `Pwm`.
+ *
+ * It works as `Servo`, but the driver (for instance, a `Pca9685StaticPwm`) is stored by value
+ * and its type is known at compile time, so the whole path from the angle to the device can be
+ * inlined.
+ */
+template <PwmDriver Driver>
+class BasicServo {
+
+public:
+
+    BasicServo(Driver driver, float half_angle_duty_cycle = Servo::SERVO_HALF_ANGLE_DUTY_CYCLE_DEFAULT,
+        float offset = Servo::SERVO_OFFSET_DEFAULT):
+        driver(std::move(driver)), half_angle_duty_cycle(half_angle_duty_cycle), offset(offset)
+    {}
+
+    expected<void, Error> init() {
+        return driver.set_frequency(Servo::SERVO_FREQUENCY);
+    }
+
+    expected<void, Error> set_angle(float angle) {
+        if (angle < Servo::SERVO_MIN_ANGLE || angle > Servo::SERVO_MAX_ANGLE) {
+            return unexpected(EINVAL);
+        }
+        return driver.set_duty_cycle(angle / Servo::SERVO_MAX_ANGLE * half_angle_duty_cycle + offset);
+    }
+
+private:
+
+    Driver driver;
+    float half_angle_duty_cycle;
+    float offset;
+
+};
+
 }
\ No newline at end of file
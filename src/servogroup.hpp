@@ -0,0 +1,217 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <expected>
+#include <span>
+#include <vector>
+
+#include "error.hpp"
+#include "metrics.hpp"
+#include "pca9685.hpp"
+#include "servo.hpp"
+#include "servotable.hpp"
+
+using namespace std;
+
+namespace rfs {
+
+/**
+ * A set of servos connected to one or more **PCA9685** devices, moved all at once.
+ *
+ * Instead of going through a `Servo` and a `Pca9685Pwm` for each servo, the angles of all the
+ * servos are converted to On/Off times in a single loop, and then the channels of each device are
+ * written in a single I<SUP>2</SUP>C transfer (see `Pca9685::set_on_off_times_bulk()`). As the
+ * devices update the outputs at the STOP condition (see `Pca9685OutputChange::OnStop`), all the
+ * servos of a device start moving at the same time.
+ *
+ * The transfer of each device goes from its lowest to its highest channel in the group. The
+ * channels in between that are not in the group are written again with the On/Off times that
+ * they had when calling `init()`, so they shouldn't be used for anything else.
+ *
+ * Optionally, the registers of every angle of each servo can be precomputed (see `ServoTable`),
+ * so that setting the angles is just copying the registers of each servo to the transfer.
+ */
+class ServoGroup {
+
+public:
+
+    /**
+     * If `lookup_tables` is `true`, the registers of each servo are precomputed in `init()`, and
+     * the angles are rounded to the nearest tenth of a degree.
+     */
+    ServoGroup(bool lookup_tables = false): lookup_tables(lookup_tables)
+    {}
+
+    /**
+     * Add the servo connected to the channel `channel` of `controller`, and return its index.
+     *
+     * The index is the position of its angle in the argument of `set_angles()`. The meaning of
+     * `half_angle_duty_cycle` and `offset` is the same as in `Servo`. Returns an `EINVAL` error
+     * if the channel is not valid or it is already in the group.
+     */
+    expected<size_t, rfs::Error> add_servo(Pca9685 &controller, uint32_t channel,
+        float half_angle_duty_cycle = Servo::SERVO_HALF_ANGLE_DUTY_CYCLE_DEFAULT,
+        float offset = Servo::SERVO_OFFSET_DEFAULT)
+    {
+        if (channel >= CHANNELS_COUNT)
+            return unexpected(rfs::Error(EINVAL, "channel"));
+
+        auto controller_it = find_if(controllers.begin(), controllers.end(),
+            [&controller](const ControllerFrame &frame) { return frame.controller == &controller; });
+        if (controller_it == controllers.end()) {
+            controllers.push_back({&controller, channel, channel, {}});
+            controller_it = controllers.end() - 1;
+        } else {
+            const size_t controller_index = controller_it - controllers.begin();
+            for (size_t i = 0; i < servo_controllers.size(); i++) {
+                if (servo_controllers[i] == controller_index && servo_channels[i] == channel)
+                    return unexpected(rfs::Error(EINVAL, "channel already in the group"));
+            }
+            controller_it->first_channel = std::min(controller_it->first_channel, channel);
+            controller_it->last_channel = std::max(controller_it->last_channel, channel);
+        }
+
+        servo_controllers.push_back(controller_it - controllers.begin());
+        servo_channels.push_back(channel);
+        scales.push_back(half_angle_duty_cycle / Servo::SERVO_MAX_ANGLE);
+        offsets.push_back(offset);
+        duty_cycles.push_back(offset);
+        tables.emplace_back(half_angle_duty_cycle, offset);
+        return servo_channels.size() - 1;
+    }
+
+    /**
+     * Configure the devices to move the servos.
+     *
+     * It sets the frequency of the PWM signals for servos and makes the outputs change at the
+     * STOP condition. It also reads the On/Off times of the channels not in the group that are
+     * written with the servos, and computes the lookup tables if enabled. It must be called after
+     * adding all the servos.
+     */
+    expected<void, rfs::Error> init()
+    {
+        if (lookup_tables) {
+            for (ServoTable &table: tables) {
+                const expected<void, rfs::Error> table_result = table.init();
+                if (!table_result)
+                    return table_result;
+            }
+        }
+
+        for (ControllerFrame &frame: controllers) {
+            const expected<void, rfs::Error> frequency_result = frame.controller->set_frequency(Servo::SERVO_FREQUENCY);
+            if (!frequency_result)
+                return frequency_result;
+
+            const expected<void, rfs::Error> output_change_result =
+                frame.controller->set_output_change(Pca9685OutputChange::OnStop);
+            if (!output_change_result)
+                return output_change_result;
+
+            for (uint32_t channel = frame.first_channel; channel <= frame.last_channel; channel++) {
+                const expected<Pca9685OnOffTimes, rfs::Error> times = frame.controller->on_off_times(channel);
+                if (!times)
+                    return unexpected(times.error());
+                // A channel never set has the same On and Off times, the output is low anyway
+                Pca9685OnOffTimes current = *times;
+                if (current.on == current.off && !current.always_on)
+                    current.always_off = true;
+                const expected<Pca9685OnOffRegisters, rfs::Error> registers = Pca9685::on_off_registers(current);
+                if (!registers)
+                    return unexpected(registers.error());
+                copy(registers->begin(), registers->end(), frame.registers.begin() + channel * REGISTERS_PER_CHANNEL);
+            }
+        }
+        return {};
+    }
+
+    /**
+     * Set the angles of all the servos, in degrees.
+     *
+     * `angles` has the angle of each servo, in the order they were added. Returns an `EINVAL`
+     * error, without moving any servo, if the number of angles is wrong or any of them is out of
+     * range.
+     */
+    expected<void, rfs::Error> set_angles(span<const float> angles)
+    {
+        MetricsTimer timer(metrics::servo_commit_seconds);
+        if (angles.size() != duty_cycles.size())
+            return unexpected(rfs::Error(EINVAL, "wrong number of angles"));
+        if (any_of(angles.begin(), angles.end(),
+            [](float angle) { return angle < Servo::SERVO_MIN_ANGLE || angle > Servo::SERVO_MAX_ANGLE; }))
+            return unexpected(rfs::Error(EINVAL, "angle"));
+
+        const size_t count = angles.size();
+        if (lookup_tables) {
+            for (size_t i = 0; i < count; i++) {
+                const Pca9685OnOffRegisters &registers = tables[i].registers(angles[i]);
+                copy(registers.begin(), registers.end(), channel_registers(i));
+            }
+        } else {
+            // Without branches nor indirections, so the compiler can vectorize it
+            const float *scale = scales.data();
+            const float *offset = offsets.data();
+            float *duty_cycle = duty_cycles.data();
+            for (size_t i = 0; i < count; i++)
+                duty_cycle[i] = angles[i] * scale[i] + offset[i];
+
+            for (size_t i = 0; i < count; i++) {
+                const expected<Pca9685OnOffRegisters, rfs::Error> registers = Pca9685::on_off_registers(
+                    Pca9685OnOffTimes{0.0, duty_cycle[i], false, false});
+                if (!registers)
+                    return unexpected(registers.error());
+                copy(registers->begin(), registers->end(), channel_registers(i));
+            }
+        }
+
+        for (const ControllerFrame &frame: controllers) {
+            const expected<void, rfs::Error> write_result = frame.controller->set_on_off_registers_bulk(
+                frame.first_channel, span<const uint8_t>(frame.registers.data() + frame.first_channel * REGISTERS_PER_CHANNEL,
+                    (frame.last_channel - frame.first_channel + 1) * REGISTERS_PER_CHANNEL));
+            if (!write_result)
+                return write_result;
+        }
+        return {};
+    }
+
+    /**
+     * Return the number of servos.
+     */
+    size_t size() const
+    {
+        return servo_channels.size();
+    }
+
+private:
+
+    static const uint32_t CHANNELS_COUNT = 16;
+    static const uint32_t REGISTERS_PER_CHANNEL = 4;
+
+    // The registers to write in the channels of a device
+    struct ControllerFrame {
+        Pca9685 *controller;
+        uint32_t first_channel;
+        uint32_t last_channel;
+        array<uint8_t, CHANNELS_COUNT * REGISTERS_PER_CHANNEL> registers;
+    };
+
+    bool lookup_tables;
+    vector<ControllerFrame> controllers;
+
+    // For each servo, its device and channel, and the coefficients to convert its angle to duty cycle
+    vector<size_t> servo_controllers;
+    vector<uint32_t> servo_channels;
+    vector<float> scales;
+    vector<float> offsets;
+    vector<float> duty_cycles;
+    vector<ServoTable> tables;
+
+    uint8_t *channel_registers(size_t servo)
+    {
+        return controllers[servo_controllers[servo]].registers.data() + servo_channels[servo] * REGISTERS_PER_CHANNEL;
+    }
+
+};
+
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <expected>
+#include <vector>
+
+#include "error.hpp"
+#include "pca9685.hpp"
+#include "servo.hpp"
+
+using namespace std;
+
+namespace rfs {
+
+/**
+ * The registers of a **PCA9685** channel for every angle of a servo, precomputed.
+ *
+ * The table has an entry every tenth of a degree, from `Servo::SERVO_MIN_ANGLE` to
+ * `Servo::SERVO_MAX_ANGLE`, with the values of the 4 registers of the channel (see
+ * `Pca9685::on_off_registers()`). Converting an angle to the values to send is then just a
+ * lookup, instead of computing the duty cycle and the On/Off counts each time.
+ */
+class ServoTable {
+
+public:
+
+    /**
+     * The number of entries per degree.
+     */
+    static constexpr int32_t STEPS_PER_DEGREE = 10;
+
+    /**
+     * `half_angle_duty_cycle` and `offset` have the same meaning as in `Servo`, and `phase` is the
+     * On time of the PWM signal, as in `Pca9685Pwm::set_phase()`.
+     */
+    ServoTable(float half_angle_duty_cycle = Servo::SERVO_HALF_ANGLE_DUTY_CYCLE_DEFAULT,
+        float offset = Servo::SERVO_OFFSET_DEFAULT, float phase = 0.0):
+        half_angle_duty_cycle(half_angle_duty_cycle), offset(offset), phase(phase)
+    {}
+
+    /**
+     * Compute the table.
+     *
+     * Returns an `EINVAL` error if the On/Off times of any angle are not valid.
+     */
+    expected<void, rfs::Error> init() {
+        table.resize(ENTRIES_COUNT);
+        for (int32_t i = 0; i < ENTRIES_COUNT; i++) {
+            const float angle = Servo::SERVO_MIN_ANGLE + static_cast<float>(i) / STEPS_PER_DEGREE;
+            const float duty_cycle = angle / Servo::SERVO_MAX_ANGLE * half_angle_duty_cycle + offset;
+            const expected<Pca9685OnOffRegisters, rfs::Error> registers = Pca9685::on_off_registers(
+                Pca9685OnOffTimes{phase, phase + duty_cycle, false, false});
+            if (!registers) {
+                table.clear();
+                return unexpected(registers.error());
+            }
+            table[i] = *registers;
+        }
+        return {};
+    }
+
+    /**
+     * Return the registers for the given angle, in degrees.
+     *
+     * The angle is rounded to the nearest tenth of a degree, and limited to the range of the servos.
+     * `init()` must have been called before.
+     */
+    const Pca9685OnOffRegisters &registers(float angle) const {
+        return registers_by_steps(lroundf(angle * STEPS_PER_DEGREE));
+    }
+
+    /**
+     * Return the registers for the given angle, in tenths of a degree.
+     *
+     * See `registers()`.
+     */
+    const Pca9685OnOffRegisters &registers_by_steps(int32_t steps) const {
+        return table[std::clamp(steps - MIN_STEPS, 0, ENTRIES_COUNT - 1)];
+    }
+
+private:
+
+    static constexpr int32_t MIN_STEPS = static_cast<int32_t>(Servo::SERVO_MIN_ANGLE) * STEPS_PER_DEGREE;
+    static constexpr int32_t ENTRIES_COUNT =
+        static_cast<int32_t>(Servo::SERVO_MAX_ANGLE - Servo::SERVO_MIN_ANGLE) * STEPS_PER_DEGREE + 1;
+
+    float half_angle_duty_cycle;
+    float offset;
+    float phase;
+    vector<Pca9685OnOffRegisters> table;
+
+};
+
+}
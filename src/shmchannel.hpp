@@ -0,0 +1,282 @@
+#pragma once
+
+extern "C"
+{
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+}
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <expected>
+#include <span>
+#include <string>
+
+#include "error.hpp"
+
+using namespace std;
+
+namespace rfs {
+
+/**
+ * A channel in shared memory that holds the latest message published by a process.
+ *
+ * It is an alternative to ZeroMQ for processes in the same machine, for instance to send
+ * `ServoFrame` messages from the planner to the actuators. The channel is a file in `/dev/shm`
+ * with room for a single message: publishing a message replaces the previous one, so a slow
+ * reader never accumulates old messages, it just gets the newest one.
+ *
+ * There must be a single publisher, which never waits for the readers. The readers never block
+ * the publisher either: the message is protected with a sequence lock, so a reader that reads
+ * while the message is being replaced just tries again.
+ */
+class ShmChannel {
+
+public:
+
+    /**
+     * The default maximum size of the messages, in bytes.
+     */
+    static constexpr size_t DEFAULT_CAPACITY = 1024;
+
+    /**
+     * The maximum number of times that `read()` tries to read a message that is being written.
+     */
+    static constexpr uint32_t MAX_READ_ATTEMPTS = 100000;
+
+    ShmChannel(): shared(nullptr), mapped_size(0), owner(false), last_sequence(0)
+    {}
+
+    ~ShmChannel()
+    {
+        if (shared)
+            close();
+    }
+
+    ShmChannel(const ShmChannel &) = delete;
+    ShmChannel &operator=(const ShmChannel &) = delete;
+
+    /**
+     * Return the maximum size of the messages.
+     */
+    size_t capacity() const
+    {
+        return shared ? shared->capacity : 0;
+    }
+
+    /**
+     * Unmap the channel, and remove it from `/dev/shm` if it was created by this instance.
+     */
+    expected<void, rfs::Error> close()
+    {
+        if (!shared)
+            return unexpected(rfs::Error(EBADF));
+
+        munmap(shared, mapped_size);
+        shared = nullptr;
+        if (owner && shm_unlink(name.c_str()) < 0)
+            return unexpected(rfs::Error(errno));
+        return {};
+    }
+
+    /**
+     * Create the channel `name`, to publish messages of up to `capacity` bytes.
+     *
+     * `name` must start with a slash, as in `/rfs_servos`. If the channel already exists, it is
+     * replaced.
+     */
+    expected<void, rfs::Error> create(const string &name, size_t capacity = DEFAULT_CAPACITY)
+    {
+        const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0)
+            return unexpected(rfs::Error(errno));
+
+        const size_t size = mapping_size(capacity);
+        if (ftruncate(fd, size) < 0) {
+            const int error = errno;
+            ::close(fd);
+            shm_unlink(name.c_str());
+            return unexpected(rfs::Error(error));
+        }
+
+        const expected<void, rfs::Error> map_result = map(fd, size);
+        if (!map_result) {
+            shm_unlink(name.c_str());
+            return map_result;
+        }
+
+        // The file is filled with zeros, so the sequence is 0 and there's no message yet
+        shared->capacity = capacity;
+        shared->magic.store(MAGIC, memory_order_release);
+        this->name = name;
+        owner = true;
+        return {};
+    }
+
+    /**
+     * Open the channel `name`, created by another process, to read its messages.
+     */
+    expected<void, rfs::Error> open(const string &name)
+    {
+        const int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd < 0)
+            return unexpected(rfs::Error(errno));
+
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) < 0 || static_cast<size_t>(file_stat.st_size) < sizeof(Shared)) {
+            ::close(fd);
+            return unexpected(rfs::Error(EBADMSG, "not a channel"));
+        }
+
+        const expected<void, rfs::Error> map_result = map(fd, file_stat.st_size);
+        if (!map_result)
+            return map_result;
+
+        if (shared->magic.load(memory_order_acquire) != MAGIC
+            || mapping_size(shared->capacity) > mapped_size) {
+            close();
+            return unexpected(rfs::Error(EBADMSG, "not a channel"));
+        }
+
+        this->name = name;
+        owner = false;
+        last_sequence = 0;
+        return {};
+    }
+
+    /**
+     * Replace the message in the channel with `message`.
+     *
+     * Returns an `EMSGSIZE` error if the message is bigger than the capacity of the channel.
+     */
+    expected<void, rfs::Error> publish(span<const uint8_t> message)
+    {
+        if (!shared)
+            return unexpected(rfs::Error(EBADF));
+        if (message.size() > shared->capacity)
+            return unexpected(rfs::Error(EMSGSIZE));
+
+        // An odd sequence tells the readers that the message is being written
+        const uint32_t sequence = shared->sequence.load(memory_order_relaxed);
+        shared->sequence.store(sequence + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        shared->size.store(message.size(), memory_order_relaxed);
+        atomic<uint32_t> *words = get_words();
+        for (size_t word = 0; word < words_count(message.size()); word++) {
+            uint32_t value = 0;
+            memcpy(&value, message.data() + word * sizeof(uint32_t),
+                std::min(sizeof(uint32_t), message.size() - word * sizeof(uint32_t)));
+            words[word].store(value, memory_order_relaxed);
+        }
+
+        shared->sequence.store(sequence + 2, memory_order_release);
+        return {};
+    }
+
+    /**
+     * Copy the latest message published into `buffer`, and return its size.
+     *
+     * It never blocks. Returns an `EAGAIN` error if no message was published yet, or if the message
+     * was being written in each of `MAX_READ_ATTEMPTS` attempts, for instance because the publisher
+     * died while writing it. Returns an `EMSGSIZE` error if `buffer` is too small for the message.
+     */
+    expected<size_t, rfs::Error> read(span<uint8_t> buffer)
+    {
+        if (!shared)
+            return unexpected(rfs::Error(EBADF));
+
+        for (uint32_t attempt = 0; attempt < MAX_READ_ATTEMPTS; attempt++) {
+            const uint32_t sequence = shared->sequence.load(memory_order_acquire);
+            if (sequence == 0)
+                return unexpected(rfs::Error(EAGAIN));
+            if (sequence & 1)
+                continue;
+
+            const size_t size = std::min<size_t>(shared->size.load(memory_order_relaxed), shared->capacity);
+            const bool fits = size <= buffer.size();
+            if (fits) {
+                const atomic<uint32_t> *words = get_words();
+                for (size_t word = 0; word < words_count(size); word++) {
+                    const uint32_t value = words[word].load(memory_order_relaxed);
+                    memcpy(buffer.data() + word * sizeof(uint32_t), &value,
+                        std::min(sizeof(uint32_t), size - word * sizeof(uint32_t)));
+                }
+            }
+
+            atomic_thread_fence(memory_order_acquire);
+            if (shared->sequence.load(memory_order_relaxed) != sequence)
+                continue;
+
+            if (!fits)
+                return unexpected(rfs::Error(EMSGSIZE));
+            last_sequence = sequence;
+            return size;
+        }
+        return unexpected(rfs::Error(EAGAIN, "message being written"));
+    }
+
+    /**
+     * Return whether a message was published after the last one read by this instance.
+     */
+    bool updated() const
+    {
+        if (!shared)
+            return false;
+        const uint32_t sequence = shared->sequence.load(memory_order_acquire);
+        return sequence != 0 && sequence != last_sequence;
+    }
+
+private:
+
+    static constexpr uint32_t MAGIC = 0x52465343;
+
+    // The header of the shared memory, followed by the words of the message
+    struct Shared {
+        atomic<uint32_t> magic;
+        uint32_t capacity;
+        atomic<uint32_t> sequence;
+        atomic<uint32_t> size;
+    };
+
+    static_assert(atomic<uint32_t>::is_always_lock_free, "ShmChannel needs lock-free atomics");
+    static_assert(sizeof(Shared) % alignof(atomic<uint32_t>) == 0, "the words must be aligned after the header");
+
+    Shared *shared;
+    size_t mapped_size;
+    string name;
+    bool owner;
+    uint32_t last_sequence;
+
+    atomic<uint32_t> *get_words() const
+    {
+        return reinterpret_cast<atomic<uint32_t> *>(shared + 1);
+    }
+
+    static size_t mapping_size(size_t capacity)
+    {
+        return sizeof(Shared) + words_count(capacity) * sizeof(atomic<uint32_t>);
+    }
+
+    static size_t words_count(size_t size)
+    {
+        return (size + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+    }
+
+    expected<void, rfs::Error> map(int fd, size_t size)
+    {
+        void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED)
+            return unexpected(rfs::Error(errno));
+        shared = static_cast<Shared *>(data);
+        mapped_size = size;
+        return {};
+    }
+
+};
+
+}
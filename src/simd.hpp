@@ -0,0 +1,158 @@
+#pragma once
+
+#include <bit>
+#include <cmath>
+#include <cstdint>
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
+namespace rfs {
+
+/**
+ * Four floats processed at once, using SSE2 or NEON when available.
+ *
+ * It has only the operations needed by the batched kinematics. The comparisons return masks
+ * (all the bits of a lane set or cleared), to be used with `select()` and `any()`.
+ */
+struct float4 {
+
+#if defined(__SSE2__)
+    __m128 v;
+
+    float4() {}
+    float4(__m128 v): v(v) {}
+    float4(float value): v(_mm_set1_ps(value)) {}
+
+    static float4 load(const float *data) { return _mm_loadu_ps(data); }
+    void store(float *data) const { _mm_storeu_ps(data, v); }
+
+    friend float4 operator+(float4 a, float4 b) { return _mm_add_ps(a.v, b.v); }
+    friend float4 operator-(float4 a, float4 b) { return _mm_sub_ps(a.v, b.v); }
+    friend float4 operator*(float4 a, float4 b) { return _mm_mul_ps(a.v, b.v); }
+    friend float4 operator/(float4 a, float4 b) { return _mm_div_ps(a.v, b.v); }
+    friend float4 operator<(float4 a, float4 b) { return _mm_cmplt_ps(a.v, b.v); }
+    friend float4 operator>(float4 a, float4 b) { return _mm_cmpgt_ps(a.v, b.v); }
+    friend float4 operator&(float4 a, float4 b) { return _mm_and_ps(a.v, b.v); }
+
+    friend float4 select(float4 mask, float4 a, float4 b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+    friend float4 sqrt(float4 a) { return _mm_sqrt_ps(a.v); }
+    friend float4 trunc(float4 a) { return _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v)); }
+    friend bool any(float4 mask) { return _mm_movemask_ps(mask.v) != 0; }
+
+#elif defined(__ARM_NEON)
+    float32x4_t v;
+
+    float4() {}
+    float4(float32x4_t v): v(v) {}
+    float4(float value): v(vdupq_n_f32(value)) {}
+
+    static float4 load(const float *data) { return vld1q_f32(data); }
+    void store(float *data) const { vst1q_f32(data, v); }
+
+    friend float4 operator+(float4 a, float4 b) { return vaddq_f32(a.v, b.v); }
+    friend float4 operator-(float4 a, float4 b) { return vsubq_f32(a.v, b.v); }
+    friend float4 operator*(float4 a, float4 b) { return vmulq_f32(a.v, b.v); }
+    friend float4 operator<(float4 a, float4 b) { return vreinterpretq_f32_u32(vcltq_f32(a.v, b.v)); }
+    friend float4 operator>(float4 a, float4 b) { return vreinterpretq_f32_u32(vcgtq_f32(a.v, b.v)); }
+    friend float4 operator&(float4 a, float4 b) {
+        return vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(a.v), vreinterpretq_u32_f32(b.v)));
+    }
+
+    friend float4 select(float4 mask, float4 a, float4 b) { return vbslq_f32(vreinterpretq_u32_f32(mask.v), a.v, b.v); }
+    friend float4 trunc(float4 a) { return vcvtq_f32_s32(vcvtq_s32_f32(a.v)); }
+    friend bool any(float4 mask) {
+        const uint32x4_t m = vreinterpretq_u32_f32(mask.v);
+        const uint32x2_t r = vorr_u32(vget_low_u32(m), vget_high_u32(m));
+        return (vget_lane_u32(r, 0) | vget_lane_u32(r, 1)) != 0;
+    }
+
+#if defined(__aarch64__)
+    friend float4 operator/(float4 a, float4 b) { return vdivq_f32(a.v, b.v); }
+    friend float4 sqrt(float4 a) { return vsqrtq_f32(a.v); }
+#else
+    // ARMv7 NEON has no division nor square root, refine their estimates instead
+    friend float4 operator/(float4 a, float4 b) {
+        float32x4_t r = vrecpeq_f32(b.v);
+        r = vmulq_f32(vrecpsq_f32(b.v, r), r);
+        r = vmulq_f32(vrecpsq_f32(b.v, r), r);
+        return vmulq_f32(a.v, r);
+    }
+    friend float4 sqrt(float4 a) {
+        float32x4_t r = vrsqrteq_f32(a.v);
+        r = vmulq_f32(vrsqrtsq_f32(vmulq_f32(a.v, r), r), r);
+        r = vmulq_f32(vrsqrtsq_f32(vmulq_f32(a.v, r), r), r);
+        return select(a > float4(0.0f), float4(vmulq_f32(a.v, r)), float4(0.0f));
+    }
+#endif
+
+#else
+    float v[4];
+
+    float4() {}
+    float4(float value): v{value, value, value, value} {}
+
+    static float4 load(const float *data) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = data[i]; return r; }
+    void store(float *data) const { for (int i = 0; i < 4; i++) data[i] = v[i]; }
+
+    template <typename F>
+    static float4 map(float4 a, float4 b, F f) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = f(a.v[i], b.v[i]); return r; }
+    static float mask(bool value) { return std::bit_cast<float>(value ? 0xffffffffu : 0u); }
+    static bool is_set(float value) { return std::bit_cast<uint32_t>(value) != 0; }
+
+    friend float4 operator+(float4 a, float4 b) { return map(a, b, [](float x, float y) { return x + y; }); }
+    friend float4 operator-(float4 a, float4 b) { return map(a, b, [](float x, float y) { return x - y; }); }
+    friend float4 operator*(float4 a, float4 b) { return map(a, b, [](float x, float y) { return x * y; }); }
+    friend float4 operator/(float4 a, float4 b) { return map(a, b, [](float x, float y) { return x / y; }); }
+    friend float4 operator<(float4 a, float4 b) { return map(a, b, [](float x, float y) { return mask(x < y); }); }
+    friend float4 operator>(float4 a, float4 b) { return map(a, b, [](float x, float y) { return mask(x > y); }); }
+    friend float4 operator&(float4 a, float4 b) {
+        return map(a, b, [](float x, float y) { return std::bit_cast<float>(std::bit_cast<uint32_t>(x) & std::bit_cast<uint32_t>(y)); });
+    }
+
+    friend float4 select(float4 mask, float4 a, float4 b) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = is_set(mask.v[i]) ? a.v[i] : b.v[i]; return r; }
+    friend float4 sqrt(float4 a) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = std::sqrt(a.v[i]); return r; }
+    friend float4 trunc(float4 a) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = std::trunc(a.v[i]); return r; }
+    friend bool any(float4 mask) { for (int i = 0; i < 4; i++) if (is_set(mask.v[i])) return true; return false; }
+#endif
+
+    friend float4 operator-(float4 a) { return float4(0.0f) - a; }
+    float4 &operator+=(float4 b) { return *this = *this + b; }
+    float4 &operator-=(float4 b) { return *this = *this - b; }
+
+};
+
+/**
+ * Compute the sine and cosine of the four values at once.
+ *
+ * The angles are reduced to [-pi/2, pi/2] and a polynomial is evaluated there. The absolute
+ * error is below 1e-6 for angles of a few turns.
+ */
+inline void sincos(float4 x, float4 &s, float4 &c)
+{
+    constexpr float PI = 3.14159265358979f;
+    constexpr float HALF_PI = PI / 2.0f;
+    constexpr float INV_TWO_PI = 1.0f / (2.0f * PI);
+
+    // Reduce to [-pi, pi]
+    const float4 turns = x * float4(INV_TWO_PI);
+    const float4 rounded = trunc(turns + select(turns < float4(0.0f), float4(-0.5f), float4(0.5f)));
+    x = x - rounded * float4(2.0f * PI);
+
+    // sin(x) = sin(pi - x) and cos(x) = -cos(pi - x), to reduce to [-pi/2, pi/2]
+    const float4 above = x > float4(HALF_PI);
+    const float4 below = x < float4(-HALF_PI);
+    x = select(above, float4(PI) - x, select(below, float4(-PI) - x, x));
+    const float4 cos_sign = select(above, float4(-1.0f), select(below, float4(-1.0f), float4(1.0f)));
+
+    const float4 x2 = x * x;
+    s = x * (float4(1.0f) + x2 * (float4(-1.0f / 6.0f) + x2 * (float4(1.0f / 120.0f) + x2 * (float4(-1.0f / 5040.0f)
+        + x2 * (float4(1.0f / 362880.0f) + x2 * float4(-1.0f / 39916800.0f))))));
+    c = cos_sign * (float4(1.0f) + x2 * (float4(-0.5f) + x2 * (float4(1.0f / 24.0f) + x2 * (float4(-1.0f / 720.0f)
+        + x2 * (float4(1.0f / 40320.0f) + x2 * (float4(-1.0f / 3628800.0f) + x2 * float4(1.0f / 479001600.0f)))))));
+}
+
+}
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <expected>
+#include <vector>
+
+#include "error.hpp"
+#include "metrics.hpp"
+#include "pca9685.hpp"
+#include "servo.hpp"
+
+using namespace std;
+using namespace chrono;
+
+namespace rfs {
+
+/**
+ * A position that a servo has to reach, and the limits of the motion to reach it.
+ */
+struct ServoWaypoint {
+    /**
+     * The angle to reach, in degrees.
+     */
+    float angle;
+
+    /**
+     * The maximum velocity, in degrees per second.
+     */
+    float max_velocity;
+
+    /**
+     * The maximum acceleration (and deceleration), in degrees per second squared.
+     */
+    float max_acceleration;
+};
+
+/**
+ * The motion of a servo through a sequence of waypoints.
+ *
+ * The servo goes from each waypoint to the next one with a trapezoidal velocity profile: it
+ * accelerates up to the maximum velocity, keeps it and decelerates to stop at the waypoint. If the
+ * waypoints are too near to reach the maximum velocity, it starts decelerating at half the way.
+ */
+class ServoTrajectory {
+
+public:
+
+    ServoTrajectory(float angle = 0.0): final_angle(angle)
+    {}
+
+    /**
+     * Add a waypoint at the end of the trajectory.
+     *
+     * The motion to the waypoint starts when the previous one ends, or at `now` if the trajectory
+     * has already ended. Returns an `EINVAL` error if the angle is out of the range of the servos
+     * or if the limits are not positive.
+     */
+    expected<void, rfs::Error> add_waypoint(const ServoWaypoint &waypoint, steady_clock::time_point now = steady_clock::now())
+    {
+        if (waypoint.angle < Servo::SERVO_MIN_ANGLE || waypoint.angle > Servo::SERVO_MAX_ANGLE)
+            return unexpected(rfs::Error(EINVAL, "angle"));
+        if (waypoint.max_velocity <= 0.0)
+            return unexpected(rfs::Error(EINVAL, "max_velocity"));
+        if (waypoint.max_acceleration <= 0.0)
+            return unexpected(rfs::Error(EINVAL, "max_acceleration"));
+
+        Segment segment;
+        segment.start = segments.empty() ? now : std::max(now, segments.back().end());
+        segment.from = final_angle;
+        segment.distance = fabs(waypoint.angle - final_angle);
+        segment.direction = (waypoint.angle >= final_angle) ? 1.0 : -1.0;
+        segment.acceleration = waypoint.max_acceleration;
+
+        // Triangular profile if the maximum velocity can't be reached in half the distance
+        const float peak_velocity = std::min(waypoint.max_velocity, sqrt(segment.distance * waypoint.max_acceleration));
+        segment.peak_velocity = peak_velocity;
+        segment.acceleration_time = peak_velocity / waypoint.max_acceleration;
+        segment.duration = (peak_velocity > 0.0)
+            ? segment.acceleration_time + segment.distance / peak_velocity : 0.0;
+
+        segments.push_back(segment);
+        final_angle = waypoint.angle;
+        return {};
+    }
+
+    /**
+     * Return the angle of the servo at the instant `t`.
+     *
+     * The instants must not go backwards between calls, as the parts of the trajectory already
+     * traversed are discarded.
+     */
+    float angle(steady_clock::time_point t)
+    {
+        while (!segments.empty() && t >= segments.front().end())
+            segments.erase(segments.begin());
+        if (segments.empty())
+            return final_angle;
+
+        const Segment &segment = segments.front();
+        const float elapsed = std::max(0.0f, chrono::duration<float>(t - segment.start).count());
+        const float deceleration_start = segment.duration - segment.acceleration_time;
+        float traversed;
+        if (elapsed < segment.acceleration_time) {
+            traversed = 0.5 * segment.acceleration * elapsed * elapsed;
+        } else if (elapsed < deceleration_start) {
+            traversed = 0.5 * segment.peak_velocity * segment.acceleration_time
+                + segment.peak_velocity * (elapsed - segment.acceleration_time);
+        } else {
+            const float remaining = segment.duration - elapsed;
+            traversed = segment.distance - 0.5 * segment.acceleration * remaining * remaining;
+        }
+        return segment.from + segment.direction * std::clamp(traversed, 0.0f, segment.distance);
+    }
+
+    /**
+     * Stop the trajectory at the angle that the servo has at the instant `t`.
+     */
+    void clear(steady_clock::time_point t)
+    {
+        final_angle = angle(t);
+        segments.clear();
+    }
+
+    /**
+     * Return whether the servo has reached the last waypoint at the instant `t`.
+     */
+    bool finished(steady_clock::time_point t) const
+    {
+        return segments.empty() || t >= segments.back().end();
+    }
+
+private:
+
+    struct Segment {
+        steady_clock::time_point start;
+        float from;
+        float distance;
+        float direction;
+        float acceleration;
+        float peak_velocity;
+        float acceleration_time;
+        float duration;
+
+        steady_clock::time_point end() const {
+            return start + duration_cast<steady_clock::duration>(chrono::duration<float>(duration));
+        }
+    };
+
+    vector<Segment> segments;
+    float final_angle;
+
+};
+
+/**
+ * Moves a set of servos of a **PCA9685** device along their trajectories.
+ *
+ * The servos must be connected to channels of the given `Pca9685`, which is put in staged mode, so
+ * that in each update the angles of all the servos are sent together with `Pca9685::flush()`, and
+ * only the channels that changed are written. The servos are updated at most at the given rate,
+ * which by default is the frequency of the servos' PWM signal, as updating them faster has no
+ * effect.
+ */
+class MotionPlanner {
+
+public:
+
+    MotionPlanner(Pca9685 &controller, float rate = Servo::SERVO_FREQUENCY):
+        controller(controller), period(duration_cast<steady_clock::duration>(chrono::duration<float>(1.0 / rate))),
+        last_update(steady_clock::time_point::min())
+    {}
+
+    /**
+     * Add a servo, whose current angle is `angle`, and return its index.
+     */
+    size_t add_servo(Servo &servo, float angle = 0.0)
+    {
+        servos.push_back({&servo, ServoTrajectory(angle)});
+        return servos.size() - 1;
+    }
+
+    /**
+     * Return whether all the servos have reached their last waypoint at the instant `now`.
+     */
+    bool finished(steady_clock::time_point now = steady_clock::now()) const
+    {
+        return all_of(servos.begin(), servos.end(),
+            [now](const PlannedServo &servo) { return servo.trajectory.finished(now); });
+    }
+
+    /**
+     * Return the trajectory of the servo with the given index, to add waypoints to it.
+     */
+    ServoTrajectory &trajectory(size_t index)
+    {
+        return servos[index].trajectory;
+    }
+
+    /**
+     * Send the angles of the servos at the instant `now` to the device.
+     *
+     * It must be called periodically, at least at the rate given in the constructor. Returns
+     * `false` if the device was not updated because the previous update was too recent.
+     */
+    expected<bool, rfs::Error> update(steady_clock::time_point now = steady_clock::now())
+    {
+        if (last_update != steady_clock::time_point::min() && now - last_update < period)
+            return false;
+
+        MetricsTimer timer(metrics::servo_commit_seconds);
+        if (!controller.staged_mode()) {
+            const expected<void, rfs::Error> staged_result = controller.set_staged_mode(true);
+            if (!staged_result)
+                return unexpected(staged_result.error());
+        }
+
+        for (PlannedServo &servo: servos) {
+            const expected<void, rfs::Error> set_result = servo.servo->set_angle(servo.trajectory.angle(now));
+            if (!set_result)
+                return unexpected(set_result.error());
+        }
+
+        const expected<void, rfs::Error> flush_result = controller.flush();
+        if (!flush_result)
+            return unexpected(flush_result.error());
+        last_update = now;
+        return true;
+    }
+
+private:
+
+    struct PlannedServo {
+        Servo *servo;
+        ServoTrajectory trajectory;
+    };
+
+    Pca9685 &controller;
+    steady_clock::duration period;
+    steady_clock::time_point last_update;
+    vector<PlannedServo> servos;
+
+};
+
+}
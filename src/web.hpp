@@ -6,13 +6,31 @@ extern "C"
     #include "mongoose.h"
 }
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
 #include <expected>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
 #include <list>
 #include <memory>
 #include <nlohmann/json.hpp>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "error.hpp"
+#include "lockfree.hpp"
+#include "metrics.hpp"
 
 using namespace std;
 
@@ -35,11 +53,20 @@ public:
     {}
 
 
-    string body() const
+    string_view body() const
     {
         return {http_message->body.ptr, http_message->body.len};
     }
 
+    /**
+     * Return the value of the header `name`, or an empty view if the request doesn't have it.
+     */
+    string_view header(const char *name) const
+    {
+        const mg_str *value = mg_http_get_header(http_message, name);
+        return value ? string_view(value->ptr, value->len) : string_view();
+    }
+
     bool is_get() const
     {
         return mg_vcmp(&http_message->method, "GET") == 0;
@@ -52,20 +79,21 @@ public:
 
     expected<nlohmann::json, nlohmann::json::parse_error> json() const
     {
-        const string string_body = body();
+        // Parsed directly from the buffer of the request, without copying it
+        const string_view string_body = body();
         try {
-            return nlohmann::json::parse(string_body);
+            return nlohmann::json::parse(string_body.data(), string_body.data() + string_body.size());
         } catch (const nlohmann::json::parse_error &error) {
             return unexpected(error);
         }
     }
 
-    string method() const
+    string_view method() const
     {
         return {http_message->method.ptr, http_message->method.len};
     }
 
-    string uri() const
+    string_view uri() const
     {
         return {http_message->uri.ptr, http_message->uri.len};
     }
@@ -104,26 +132,312 @@ public:
 
 };
 
+/**
+ * A handler that serves a file.
+ *
+ * The file is read once, when the handler is created, and then it is served from memory, so the
+ * requests don't read the disk. If the file is also compressed with gzip or brotli, with the
+ * extensions `.gz` and `.br` (as made by `gzip -k` and `brotli -k`), the compressed files are read
+ * too and sent to the clients that accept them. Every response has a weak ETag computed from the
+ * contents, so the clients that already have the file get a `304 Not Modified` without them.
+ *
+ * If `cache` is `false`, or the file can't be read, the file is read in each request with
+ * `mg_http_serve_file()`, which allows changing it while the server runs.
+ */
 class HTTPFileHandler: public HTTPEventHandler {
 
 public:
 
-    HTTPFileHandler(const string &path):
-        path(path), serve_file_opts{.mime_types = "html=text/html"}
-    {}
+    HTTPFileHandler(const string &path, bool cache = true):
+        path(path), serve_file_opts{.mime_types = "html=text/html"}, cached(false)
+    {
+        if (cache)
+            load();
+    }
 
     virtual ~HTTPFileHandler()
     {}
 
     inline virtual void get(HTTPRequest &request) override
     {
-        mg_http_serve_file(request.connection, request.http_message, path.c_str(), &serve_file_opts);
+        if (!cached) {
+            mg_http_serve_file(request.connection, request.http_message, path.c_str(), &serve_file_opts);
+            return;
+        }
+
+        if (request.header("If-None-Match") == etag) {
+            mg_printf(request.connection, "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nContent-Length: 0\r\n\r\n",
+                etag.c_str());
+            return;
+        }
+
+        const string_view accept_encoding = request.header("Accept-Encoding");
+        const FileVariant *variant = &variants[0];
+        for (size_t i = 1; i < variants.size(); i++) {
+            if (!variants[i].contents.empty() && accepts_encoding(accept_encoding, variants[i].encoding)) {
+                variant = &variants[i];
+                break;
+            }
+        }
+
+        mg_printf(request.connection,
+            "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %lu\r\nETag: %s\r\n"
+            "Cache-Control: no-cache\r\nVary: Accept-Encoding\r\n%s%s%s\r\n",
+            content_type.c_str(), static_cast<unsigned long>(variant->contents.size()), etag.c_str(),
+            variant->encoding.empty() ? "" : "Content-Encoding: ", variant->encoding.c_str(),
+            variant->encoding.empty() ? "" : "\r\n");
+        mg_send(request.connection, variant->contents.data(), variant->contents.size());
     }
 
 private:
 
+    // The file as it is and in each compression, in order of preference
+    struct FileVariant {
+        string encoding;
+        string extension;
+        string contents;
+    };
+
     string path;
     mg_http_serve_opts serve_file_opts;
+    bool cached;
+    array<FileVariant, 3> variants{FileVariant{"", "", ""}, FileVariant{"br", ".br", ""}, FileVariant{"gzip", ".gz", ""}};
+    string content_type;
+    string etag;
+
+    // Whether the Accept-Encoding header allows the encoding, by name or with "*", with a q-value
+    // that is not 0. The server's order of preference is kept for the rest of q-values
+    static bool accepts_encoding(string_view accept_encoding, string_view encoding)
+    {
+        optional<bool> by_name;
+        optional<bool> by_wildcard;
+        while (!accept_encoding.empty()) {
+            const size_t comma = accept_encoding.find(',');
+            const string_view item = accept_encoding.substr(0, comma);
+            accept_encoding = (comma == string_view::npos) ? string_view() : accept_encoding.substr(comma + 1);
+
+            const size_t semicolon = item.find(';');
+            const string_view coding = trim(item.substr(0, semicolon));
+            float quality = 1.0;
+            string_view parameters = (semicolon == string_view::npos) ? string_view() : item.substr(semicolon + 1);
+            while (!parameters.empty()) {
+                const size_t next = parameters.find(';');
+                const string_view parameter = trim(parameters.substr(0, next));
+                parameters = (next == string_view::npos) ? string_view() : parameters.substr(next + 1);
+                if (parameter.size() > 2 && (parameter[0] == 'q' || parameter[0] == 'Q') && parameter[1] == '=') {
+                    // A wrong q-value rejects the coding, as it isn't known what it allows
+                    const from_chars_result result = from_chars(parameter.data() + 2, parameter.data() + parameter.size(), quality);
+                    if (result.ec != errc() || result.ptr != parameter.data() + parameter.size())
+                        quality = 0.0;
+                }
+            }
+
+            if (equal_ignoring_case(coding, encoding))
+                by_name = quality > 0.0;
+            else if (coding == "*")
+                by_wildcard = quality > 0.0;
+        }
+        return by_name.value_or(by_wildcard.value_or(false));
+    }
+
+    static bool equal_ignoring_case(string_view a, string_view b)
+    {
+        return a.size() == b.size() && equal(a.begin(), a.end(), b.begin(),
+            [](char x, char y) { return tolower(static_cast<unsigned char>(x)) == tolower(static_cast<unsigned char>(y)); });
+    }
+
+    static string mime_type(const string &path)
+    {
+        static const array<pair<string_view, string_view>, 9> types{{
+            {".html", "text/html"}, {".css", "text/css"}, {".js", "text/javascript"},
+            {".json", "application/json"}, {".png", "image/png"}, {".jpg", "image/jpeg"},
+            {".svg", "image/svg+xml"}, {".ico", "image/x-icon"}, {".txt", "text/plain"}
+        }};
+        for (const auto &[extension, type]: types) {
+            if (path.ends_with(extension))
+                return string(type);
+        }
+        return "application/octet-stream";
+    }
+
+    static bool read_file(const string &path, string &contents)
+    {
+        ifstream file(path, ios::binary);
+        if (!file)
+            return false;
+        contents.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+        return !file.bad();
+    }
+
+    static string_view trim(string_view text)
+    {
+        const size_t first = text.find_first_not_of(" \t");
+        if (first == string_view::npos)
+            return {};
+        return text.substr(first, text.find_last_not_of(" \t") - first + 1);
+    }
+
+    void load()
+    {
+        if (!read_file(path, variants[0].contents))
+            return;
+        for (size_t i = 1; i < variants.size(); i++) {
+            if (!read_file(path + variants[i].extension, variants[i].contents))
+                variants[i].contents.clear();
+        }
+
+        // FNV-1a hash of the contents
+        uint64_t hash = 0xcbf29ce484222325;
+        for (const char c: variants[0].contents)
+            hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3;
+        char hash_string[19];
+        snprintf(hash_string, sizeof(hash_string), "%016llx", static_cast<unsigned long long>(hash));
+        etag = string("W/\"") + hash_string + "\"";
+
+        content_type = mime_type(path);
+        cached = true;
+    }
+
+};
+
+/**
+ * A handler that replies with the metrics of the library, in the Prometheus text format.
+ *
+ * The metrics are only collected if the library is compiled with `RFS_METRICS` (see
+ * `METRICS_ENABLED`); otherwise the reply is empty.
+ */
+class HTTPMetricsHandler: public HTTPEventHandler {
+
+public:
+
+    virtual ~HTTPMetricsHandler()
+    {}
+
+    virtual void get(HTTPRequest &request) override
+    {
+        const string contents = metrics_prometheus();
+        mg_printf(request.connection,
+            "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\n\r\n",
+            static_cast<unsigned long>(contents.size()));
+        mg_send(request.connection, contents.data(), contents.size());
+    }
+
+};
+
+/**
+ * A handler of WebSocket connections.
+ *
+ * A GET request to the handler's URI upgrades the connection to a WebSocket, and from then on the
+ * events of the connection are notified with `on_open()`, `on_message()` and `on_close()`. The
+ * handler keeps the open connections, its subscribers, to send a message to all of them with
+ * `broadcast()`.
+ *
+ * If a broadcast rate is given, `on_broadcast()` is called at that rate while there are
+ * subscribers, to send them the latest state, for instance the angles of the servos. It is
+ * called from `WebApplication::poll()`, so the timeout of the poll must be shorter than the
+ * period of the broadcasts.
+ */
+class WebSocketHandler: public HTTPEventHandler {
+
+public:
+
+    /**
+     * `broadcast_rate` is the number of calls to `on_broadcast()` per second, or 0 to not call it.
+     */
+    WebSocketHandler(float broadcast_rate = 0.0):
+        broadcast_period_ms(broadcast_rate > 0.0 ? 1000.0 / broadcast_rate : 0), next_broadcast_ms(0)
+    {}
+
+    virtual ~WebSocketHandler()
+    {}
+
+    /**
+     * Send a message to all the subscribers, binary by default.
+     */
+    void broadcast(span<const uint8_t> message, bool binary = true)
+    {
+        for (mg_connection *connection: subscribers)
+            send(connection, message, binary);
+    }
+
+    /**
+     * Send a text message to all the subscribers.
+     */
+    void broadcast_text(const string &message)
+    {
+        broadcast(span<const uint8_t>(reinterpret_cast<const uint8_t *>(message.data()), message.size()), false);
+    }
+
+    virtual void get(HTTPRequest &request) override
+    {
+        WebSocketHandler *handler = this;
+        memcpy(request.connection->data, &handler, sizeof(handler));
+        mg_ws_upgrade(request.connection, request.http_message, nullptr);
+    }
+
+    virtual void on_broadcast()
+    {}
+
+    virtual void on_close(mg_connection * /* connection */)
+    {}
+
+    /**
+     * Called for each message received. `binary` tells whether it is a binary or a text message.
+     */
+    virtual void on_message(mg_connection * /* connection */, span<const uint8_t> /* message */, bool /* binary */)
+    {}
+
+    virtual void on_open(mg_connection * /* connection */)
+    {}
+
+    /**
+     * Send a message to a single connection, binary by default.
+     */
+    static void send(mg_connection *connection, span<const uint8_t> message, bool binary = true)
+    {
+        mg_ws_send(connection, message.data(), message.size(), binary ? WEBSOCKET_OP_BINARY : WEBSOCKET_OP_TEXT);
+    }
+
+    const vector<mg_connection *> &get_subscribers() const
+    {
+        return subscribers;
+    }
+
+private:
+
+    friend class WebApplication;
+
+    uint64_t broadcast_period_ms;
+    uint64_t next_broadcast_ms;
+    vector<mg_connection *> subscribers;
+
+    // The handler of a connection upgraded by get(), or nullptr
+    static WebSocketHandler *from_connection(mg_connection *connection)
+    {
+        WebSocketHandler *handler;
+        memcpy(&handler, connection->data, sizeof(handler));
+        return connection->is_websocket ? handler : nullptr;
+    }
+
+    void open(mg_connection *connection)
+    {
+        subscribers.push_back(connection);
+        on_open(connection);
+    }
+
+    void close(mg_connection *connection)
+    {
+        subscribers.erase(remove(subscribers.begin(), subscribers.end(), connection), subscribers.end());
+        on_close(connection);
+    }
+
+    void tick(uint64_t now_ms)
+    {
+        if (broadcast_period_ms == 0 || subscribers.empty() || now_ms < next_broadcast_ms)
+            return;
+        next_broadcast_ms = now_ms + broadcast_period_ms;
+        on_broadcast();
+    }
 
 };
 
@@ -140,24 +454,164 @@ public:
 
 };
 
+/**
+ * The table that gives the handler of each request.
+ *
+ * The URIs of the handlers are glob patterns, as in `mg_http_match_uri()`, and a request goes to
+ * the first handler added whose pattern matches its URI. The patterns are not tried one by one:
+ * the ones without wildcards are in a hash table, and the ones whose only wildcard is a `*` or a
+ * `#` at the end are in a prefix tree, so the handler is found in a single pass over the URI. Only
+ * the patterns with other wildcards are matched one by one.
+ */
+class HTTPRouter {
+
+public:
+
+    HTTPRouter():
+        trie(1), routes_count(0)
+    {}
+
+    void add(const string &pattern, HTTPEventHandler *handler)
+    {
+        const Route route{routes_count++, handler};
+        const size_t wildcard = pattern.find_first_of("*#?");
+
+        if (wildcard == string::npos) {
+            exact_routes.emplace(pattern, route);
+        } else if (wildcard == pattern.size() - 1 && pattern.back() != '?') {
+            size_t node = 0;
+            for (size_t i = 0; i < wildcard; i++)
+                node = child(node, pattern[i]);
+            Route &node_route = (pattern.back() == '#') ? trie[node].any : trie[node].segment;
+            if (!node_route.handler)
+                node_route = route;
+        } else {
+            glob_routes.push_back({pattern, route});
+        }
+    }
+
+    /**
+     * Return the handler of `uri`, or `nullptr` if no pattern matches it.
+     */
+    HTTPEventHandler *find(string_view uri) const
+    {
+        Route best{SIZE_MAX, nullptr};
+
+        const auto exact_it = exact_routes.find(uri);
+        if (exact_it != exact_routes.end())
+            best = exact_it->second;
+
+        // A `*` doesn't match the slashes, so it only matches if the rest has none
+        const size_t last_slash = uri.rfind('/');
+        size_t node = 0;
+        for (size_t i = 0; ; i++) {
+            const TrieNode &trie_node = trie[node];
+            if (trie_node.any.handler && trie_node.any.index < best.index)
+                best = trie_node.any;
+            if (trie_node.segment.handler && trie_node.segment.index < best.index
+                && (last_slash == string_view::npos || last_slash < i))
+                best = trie_node.segment;
+            if (i == uri.size())
+                break;
+
+            const auto child_it = find_if(trie_node.children.begin(), trie_node.children.end(),
+                [c = uri[i]](const pair<char, size_t> &child) { return child.first == c; });
+            if (child_it == trie_node.children.end())
+                break;
+            node = child_it->second;
+        }
+
+        const struct mg_str uri_str{uri.data(), uri.size()};
+        for (const auto &[pattern, route]: glob_routes) {
+            if (route.index >= best.index)
+                break;
+            if (mg_match(uri_str, mg_str(pattern.c_str()), nullptr)) {
+                best = route;
+                break;
+            }
+        }
+        return best.handler;
+    }
+
+private:
+
+    struct Route {
+        size_t index;
+        HTTPEventHandler *handler;
+    };
+
+    // The routes of the patterns that are this node's prefix followed by `#` and by `*`
+    struct TrieNode {
+        vector<pair<char, size_t>> children;
+        Route any{SIZE_MAX, nullptr};
+        Route segment{SIZE_MAX, nullptr};
+    };
+
+    // To look up the URIs as a string_view, without building a string
+    struct StringHash {
+        using is_transparent = void;
+
+        size_t operator()(string_view value) const
+        {
+            return hash<string_view>{}(value);
+        }
+    };
+
+    unordered_map<string, Route, StringHash, equal_to<>> exact_routes;
+    vector<TrieNode> trie;
+    vector<pair<string, Route>> glob_routes;
+    size_t routes_count;
+
+    size_t child(size_t node, char c)
+    {
+        for (const pair<char, size_t> &child: trie[node].children) {
+            if (child.first == c)
+                return child.second;
+        }
+        trie.emplace_back();
+        trie[node].children.push_back({c, trie.size() - 1});
+        return trie.size() - 1;
+    }
+
+};
+
+/**
+ * A web server, that passes the requests to the handlers added.
+ *
+ * It's either run step by step by calling `poll()` from the main loop of the program, or in its
+ * own thread with `start()`, so that serving the requests doesn't delay the main loop. In that
+ * case, the handlers run in the server's thread: they should hand the commands received to the
+ * main loop without locks, for instance with a `LatestValue`, and the main loop should use `post()`
+ * to reply or to send messages through the handlers.
+ */
 class WebApplication {
 
 public:
 
+    /**
+     * The maximum number of tasks posted and not yet executed.
+     */
+    static constexpr size_t TASKS_CAPACITY = 64;
+
     WebApplication(bool debug = false):
-        connection(nullptr), debug_flag(debug)
+        connection(nullptr), debug_flag(debug), running(false)
     {
         mg_mgr_init(&mgr);
     }
 
     ~WebApplication()
     {
+        stop();
         mg_mgr_free(&mgr);
     }
 
     void add_handler(const string &prefix, std::unique_ptr<HTTPEventHandler> &handler)
     {
+        WebSocketHandler *websocket_handler = dynamic_cast<WebSocketHandler *>(handler.get());
+        if (websocket_handler)
+            websocket_handlers.push_back(websocket_handler);
         handlers.push_back(HTTPHandlerEndpoint{prefix, handler});
+        router.add(prefix, handlers.back().handler.get());
     }
 
     expected<void, Error> listen(const string &url)
@@ -173,6 +627,67 @@ public:
     inline void poll(int timeout_ms)
     {
         mg_mgr_poll(&mgr, timeout_ms);
+
+        function<void()> task;
+        while (tasks.pop(task))
+            task();
+
+        const uint64_t now_ms = mg_millis();
+        for (WebSocketHandler *handler: websocket_handlers)
+            handler->tick(now_ms);
+    }
+
+    /**
+     * Execute `task` in the thread that polls the server, as soon as possible.
+     *
+     * It can be called from any thread. It is the way to use the handlers and the connections
+     * from other threads, for instance to broadcast the state of the robot through a
+     * `WebSocketHandler`. Returns `false` if there are already `TASKS_CAPACITY` tasks waiting.
+     */
+    bool post(function<void()> &&task)
+    {
+        if (!tasks.push(std::move(task)))
+            return false;
+        wakeup();
+        return true;
+    }
+
+    /**
+     * Serve the requests in a new thread, until `stop()` is called.
+     *
+     * `listen()` must be called before, and all the handlers must be added before too. The
+     * thread waits for events at most `timeout_ms` milliseconds, which must be shorter than the
+     * period of the broadcasts of the `WebSocketHandler`s. Returns an `EBUSY` error if it was
+     * already started.
+     */
+    expected<void, Error> start(int timeout_ms = 50)
+    {
+        if (server_thread.joinable())
+            return unexpected(Error(EBUSY));
+        if (connection == nullptr)
+            return unexpected(Error(ENOTCONN));
+        if (mgr.pipe == MG_INVALID_SOCKET && !mg_wakeup_init(&mgr))
+            return unexpected(Error(EIO, "cannot create the wakeup socket"));
+
+        running = true;
+        server_thread = thread([this, timeout_ms]() {
+            while (running.load(memory_order_acquire))
+                poll(timeout_ms);
+        });
+        debug("Server thread started");
+        return {};
+    }
+
+    /**
+     * Stop the thread started with `start()`, and wait for it to end.
+     */
+    void stop()
+    {
+        if (!server_thread.joinable())
+            return;
+        running.store(false, memory_order_release);
+        wakeup();
+        server_thread.join();
     }
 
 private:
@@ -183,17 +698,29 @@ private:
             cerr << message << endl;
     }
 
-    static void execute_method(HTTPHandlerEndpoint &endpoint, HTTPRequest &request)
+    // Make the thread that polls return from the poll, if it is waiting
+    void wakeup()
+    {
+        const char signal = 0;
+        if (connection != nullptr)
+            mg_wakeup(&mgr, connection->id, &signal, sizeof(signal));
+    }
+
+    static void execute_method(HTTPEventHandler &handler, HTTPRequest &request)
     {
         if (request.is_get()) {
-            endpoint.handler->get(request);
+            handler.get(request);
         } else if (request.is_post()) {
-            endpoint.handler->post(request);
+            handler.post(request);
         }
     }
 
     static void on_event(mg_connection *connection, int event, void *event_data)
     {
+        if (event == MG_EV_WS_OPEN || event == MG_EV_WS_MSG || event == MG_EV_CLOSE) {
+            on_websocket_event(connection, event, event_data);
+            return;
+        }
         if (event != MG_EV_HTTP_MSG)
             return;
         
@@ -201,25 +728,45 @@ private:
         mg_http_message *http_message = (mg_http_message *)event_data;
         HTTPRequest request(connection, http_message);
 
-        bool handler_found = false;
-        for (HTTPHandlerEndpoint &handler: app->handlers) {
-            if (mg_http_match_uri(http_message, handler.uri.c_str())) {
-                handler_found = true;
-                app->debug(request.method() + " " + request.uri());
-                execute_method(handler, request);
-            }
+        HTTPEventHandler *handler = app->router.find(request.uri());
+        if (handler) {
+            if (app->debug_flag)
+                app->debug(string(request.method()) + " " + string(request.uri()));
+            execute_method(*handler, request);
+        } else {
+            mg_http_reply(connection, HTTP_ERROR_404_NOT_FOUND, "", "404: Not Found");
+            if (app->debug_flag)
+                app->debug(string(request.uri()) + ": Not Found");
         }
+    }
 
-        if (!handler_found) {
-            mg_http_reply(connection, HTTP_ERROR_404_NOT_FOUND, "", "404: Not Found");
-            app->debug(string(http_message->uri.ptr, http_message->uri.len) + ": Not Found");
+    static void on_websocket_event(mg_connection *connection, int event, void *event_data)
+    {
+        WebSocketHandler *handler = WebSocketHandler::from_connection(connection);
+        if (!handler)
+            return;
+
+        if (event == MG_EV_WS_OPEN) {
+            handler->open(connection);
+        } else if (event == MG_EV_WS_MSG) {
+            mg_ws_message *message = (mg_ws_message *)event_data;
+            const bool binary = (message->flags & 0x0f) == WEBSOCKET_OP_BINARY;
+            handler->on_message(connection,
+                span<const uint8_t>(reinterpret_cast<const uint8_t *>(message->data.ptr), message->data.len), binary);
+        } else {
+            handler->close(connection);
         }
     }
 
     mg_mgr mgr;
     mg_connection *connection;
     std::list<HTTPHandlerEndpoint> handlers;
+    HTTPRouter router;
+    vector<WebSocketHandler *> websocket_handlers;
     bool debug_flag;
+    MpscQueue<function<void()>, TASKS_CAPACITY> tasks;
+    atomic<bool> running;
+    thread server_thread;
 
 };
 
@@ -0,0 +1,139 @@
+#include <cassert>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+#include "../src/config.hpp"
+#include "../src/environment.hpp"
+
+using namespace rfs;
+using namespace std;
+
+#define CONFIG_PATH "/tmp/rfs_test_config.env"
+
+void write_file(const char *contents) {
+    ofstream file(CONFIG_PATH);
+    file << contents;
+}
+
+void test_environment() {
+    // The indexed variables take the default and the range into account
+    setenv("RFS_TEST_CHANNEL_2", "20", 1);
+    assert(read_env_long_indexed("RFS_TEST_CHANNEL", 2) == 20);
+    assert(read_env_long_indexed("RFS_TEST_CHANNEL", 2, 5, 0, 15) == 5);
+    assert(read_env_long_indexed("RFS_TEST_CHANNEL", 3, 7) == 7);
+
+    // A variable that doesn't exist (unhappy path)
+    unsetenv("RFS_TEST_MISSING");
+    assert(read_env_float("RFS_TEST_MISSING", 1.5) == 1.5);
+}
+
+void test_load() {
+    write_file(
+        "# The calibration of the legs\n"
+        "\n"
+        "SERVO_OFFSET_0 = 0.07\n"
+        "SERVO_HALF_ANGLE_DUTY_CYCLE_2=0.03\n"
+        "RFS_TEST_NAME = robot \n"
+        "RFS_TEST_LONG=0x10\n"
+        "RFS_TEST_OVERRIDDEN=1\n");
+    setenv("RFS_TEST_OVERRIDDEN", "2", 1);
+    setenv("RFS_TEST_BOOL", "yes", 1);
+    setenv("RFS_TEST_FLOAT", "2.5", 1);
+
+    auto res_load = Config::load(CONFIG_PATH);
+    assert(res_load);
+    const Config &config = **res_load;
+
+    assert(config.get_string("RFS_TEST_NAME") == "robot");
+    assert(config.get_long("RFS_TEST_LONG") == 16);
+    assert(config.get_long("RFS_TEST_OVERRIDDEN") == 2);
+    assert(config.get_bool("RFS_TEST_BOOL"));
+    assert(config.get_float("RFS_TEST_FLOAT") == 2.5);
+    assert(config.get_long_indexed("RFS_TEST_CHANNEL", 2, 0, 0, 100) == 20);
+    assert(config.has("RFS_TEST_NAME") && !config.has("RFS_TEST_MISSING"));
+
+    // Wrong values or out of range (unhappy path)
+    assert(config.get_long("RFS_TEST_NAME", 3) == 3);
+    assert(config.get_long("RFS_TEST_FLOAT", 3) == 3);
+    assert(config.get_long("RFS_TEST_LONG", 3, 0, 10) == 3);
+    assert(config.get_float("RFS_TEST_NAME", 1.0) == 1.0);
+    assert(!config.get_bool("RFS_TEST_NAME", true));
+    assert(config.get_string("RFS_TEST_MISSING", "none") == "none");
+
+    // The servos up to the highest index, with the defaults where not configured
+    assert(config.get_servo_calibrations().size() == 3);
+    const ServoCalibration servo0 = config.get_servo_calibration(0);
+    assert(servo0.offset == 0.07f && servo0.half_angle_duty_cycle == Servo::SERVO_HALF_ANGLE_DUTY_CYCLE_DEFAULT);
+    const ServoCalibration servo2 = config.get_servo_calibration(2);
+    assert(servo2.offset == Servo::SERVO_OFFSET_DEFAULT && servo2.half_angle_duty_cycle == 0.03f);
+    const ServoCalibration servo5 = config.get_servo_calibration(5);
+    assert(servo5.offset == Servo::SERVO_OFFSET_DEFAULT);
+
+    // A file that doesn't exist and a wrong line (unhappy path)
+    auto res_missing = Config::load("/tmp/rfs_test_missing.env");
+    assert(!res_missing);
+    assert(res_missing.error().name() == "ENOENT");
+    write_file("SERVO_OFFSET_0=0.07\nnot a variable\n");
+    auto res_wrong = Config::load(CONFIG_PATH);
+    assert(!res_wrong);
+    assert(res_wrong.error().name() == "EINVAL");
+    cout << res_wrong.error().detail() << endl;
+
+    // A servo index too big, or that doesn't even fit in 32 bits (unhappy path)
+    write_file("SERVO_OFFSET_4000000000=1\n");
+    auto res_index = Config::load(CONFIG_PATH);
+    assert(!res_index);
+    assert(res_index.error().name() == "EINVAL");
+    write_file("SERVO_HALF_ANGLE_DUTY_CYCLE_99999999999=1\n");
+    res_index = Config::load(CONFIG_PATH);
+    assert(!res_index);
+    assert(res_index.error().name() == "EINVAL");
+
+    // The last index allowed
+    write_file("SERVO_OFFSET_255=0.08\n");
+    res_load = Config::load(CONFIG_PATH);
+    assert(res_load);
+    assert((*res_load)->get_servo_calibrations().size() == Config::MAX_SERVOS);
+}
+
+void test_reload() {
+    write_file("SERVO_OFFSET_1=0.08\n");
+    ConfigStore store(CONFIG_PATH);
+    assert(store.get()->get_servo_calibrations().empty());
+    auto res_first = store.reload();
+    assert(res_first);
+    assert(store.get()->get_servo_calibration(1).offset == 0.08f);
+
+    // The snapshot taken before the reload doesn't change
+    auto res_handle = ConfigStore::handle_sighup();
+    assert(res_handle);
+    shared_ptr<const Config> before = store.get();
+    write_file("SERVO_OFFSET_1=0.09\n");
+    auto res_reload = store.reload_if_requested();
+    assert(res_reload && !*res_reload);
+
+    raise(SIGHUP);
+    res_reload = store.reload_if_requested();
+    assert(res_reload && *res_reload);
+    assert(store.get()->get_servo_calibration(1).offset == 0.09f);
+    assert(before->get_servo_calibration(1).offset == 0.08f);
+    res_reload = store.reload_if_requested();
+    assert(res_reload && !*res_reload);
+
+    // A wrong file keeps the current configuration (unhappy path)
+    write_file("wrong\n");
+    raise(SIGHUP);
+    res_reload = store.reload_if_requested();
+    assert(!res_reload);
+    assert(store.get()->get_servo_calibration(1).offset == 0.09f);
+}
+
+int main() {
+    test_environment();
+    test_load();
+    test_reload();
+    remove(CONFIG_PATH);
+}
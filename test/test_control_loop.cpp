@@ -0,0 +1,214 @@
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "../src/controlloop.hpp"
+
+using namespace rfs;
+using namespace std;
+using namespace std::chrono;
+
+void test_rate() {
+    ControlLoop loop(200.0);
+    assert(loop.get_period() == milliseconds(5));
+
+    vector<steady_clock::time_point> starts;
+    starts.reserve(100);
+    auto res_add = loop.add_stage("read", [&starts]() -> expected<void, rfs::Error> {
+        starts.push_back(steady_clock::now());
+        return {};
+    });
+    assert(res_add);
+    assert(*res_add == 0);
+    res_add = loop.add_stage("compute", []() -> expected<void, rfs::Error> {
+        this_thread::sleep_for(microseconds(500));
+        return {};
+    }, milliseconds(2));
+    assert(res_add);
+    assert(*res_add == 1);
+    assert(loop.get_stages_count() == 2);
+
+    const steady_clock::time_point start = steady_clock::now();
+    auto res_run = loop.run(100);
+    assert(res_run);
+    const steady_clock::duration elapsed = steady_clock::now() - start;
+    assert(loop.get_cycles_count() == 100);
+    assert(!loop.is_running());
+
+    // The cycles start at multiples of the period, so the error doesn't accumulate
+    assert(elapsed >= milliseconds(495));
+    assert(starts.size() == 100);
+    const steady_clock::duration drift = (starts.back() - starts.front()) - 99 * loop.get_period();
+    assert(drift < milliseconds(2) && drift > -milliseconds(2));
+
+    const ControlLoopStageStats stats = loop.get_stage_stats(1);
+    assert(stats.name == "compute");
+    assert(stats.budget == milliseconds(2));
+    assert(stats.average >= microseconds(500));
+    assert(stats.max >= stats.average);
+    cout << "overruns: " << loop.get_overruns_count() << ", max wake-up latency: "
+         << duration_cast<microseconds>(loop.get_max_wakeup_latency()).count() << " us, compute average: "
+         << duration_cast<microseconds>(stats.average).count() << " us" << endl;
+}
+
+void test_overruns() {
+    ControlLoop loop(100.0);
+
+    // Every other cycle lasts two and a half periods
+    int cycle = 0;
+    auto res_add = loop.add_stage("slow", [&cycle]() -> expected<void, rfs::Error> {
+        if (cycle++ % 2)
+            this_thread::sleep_for(milliseconds(25));
+        return {};
+    }, milliseconds(5));
+    assert(res_add);
+
+    const steady_clock::time_point start = steady_clock::now();
+    auto res_run = loop.run(10);
+    assert(res_run);
+    const steady_clock::duration elapsed = steady_clock::now() - start;
+
+    // The missed cycles are skipped: each slow cycle takes 3 periods instead of 1
+    assert(loop.get_overruns_count() == 5);
+    assert(loop.get_stage_stats(0).overruns == 5);
+    assert(elapsed >= milliseconds(190));
+}
+
+void test_stop() {
+    ControlLoop loop(1000.0);
+
+    // Stopped from a stage, it is still running until the cycle ends (unhappy path)
+    bool added_after_stop = true;
+    bool run_after_stop = true;
+    auto res_add = loop.add_stage("stop", [&loop, &added_after_stop, &run_after_stop]() -> expected<void, rfs::Error> {
+        if (loop.get_cycles_count() == 9) {
+            loop.stop();
+            assert(loop.is_running());
+            auto res_late = loop.add_stage("late", []() -> expected<void, rfs::Error> { return {}; });
+            added_after_stop = res_late.has_value();
+            auto res_second = loop.run(1);
+            run_after_stop = res_second.has_value();
+        }
+        return {};
+    });
+    assert(res_add);
+    auto res_run = loop.run();
+    assert(res_run);
+    assert(loop.get_cycles_count() == 10);
+    assert(!added_after_stop && !run_after_stop);
+    assert(loop.get_stages_count() == 1);
+
+    // A stop before running is ignored
+    loop.stop();
+    res_run = loop.run(2);
+    assert(res_run);
+    assert(loop.get_cycles_count() == 12);
+
+    // Stopped from another thread, as it is running no stage can be added (unhappy path)
+    thread runner([&loop]() {
+        auto res_runner = loop.run();
+        assert(res_runner);
+    });
+    while (loop.get_cycles_count() == 12)
+        this_thread::yield();
+    auto res_busy = loop.add_stage("late", []() -> expected<void, rfs::Error> { return {}; });
+    assert(!res_busy);
+    assert(res_busy.error().name() == "EBUSY");
+    res_run = loop.run();
+    assert(!res_run);
+    assert(res_run.error().name() == "EBUSY");
+    loop.stop();
+    runner.join();
+}
+
+void test_errors() {
+    ControlLoop loop(1000.0);
+
+    // The error of a stage stops the loop, and the next stages are not executed
+    bool second_executed = false;
+    auto res_add = loop.add_stage("fail", [&loop]() -> expected<void, rfs::Error> {
+        if (loop.get_cycles_count() == 2)
+            return unexpected(rfs::Error(EIO));
+        return {};
+    });
+    assert(res_add);
+    res_add = loop.add_stage("second", [&loop, &second_executed]() -> expected<void, rfs::Error> {
+        second_executed = loop.get_cycles_count() == 2;
+        return {};
+    });
+    assert(res_add);
+    auto res_run = loop.run();
+    assert(!res_run);
+    assert(res_run.error().name() == "EIO");
+    assert(loop.get_cycles_count() == 3);
+    assert(!second_executed);
+
+    // A priority out of range, with a CPU that would be valid (unhappy path)
+    cpu_set_t cpus_before;
+    int res_affinity = pthread_getaffinity_np(pthread_self(), sizeof(cpus_before), &cpus_before);
+    assert(res_affinity == 0);
+    loop.set_cpu(0);
+    loop.set_priority(100);
+    res_run = loop.run(1);
+    assert(!res_run);
+    assert(res_run.error().name() == "EINVAL");
+    assert(!loop.is_running());
+    cpu_set_t cpus_after;
+    res_affinity = pthread_getaffinity_np(pthread_self(), sizeof(cpus_after), &cpus_after);
+    assert(res_affinity == 0);
+    assert(CPU_EQUAL(&cpus_before, &cpus_after));
+    loop.set_priority(0);
+
+    // A CPU that doesn't exist (unhappy path)
+    loop.set_cpu(CPU_SETSIZE);
+    res_run = loop.run(1);
+    assert(!res_run);
+    assert(res_run.error().name() == "EINVAL");
+}
+
+void test_realtime() {
+    // It needs CAP_SYS_NICE, so the result depends on how the test is run
+    int policy_before;
+    sched_param parameters_before;
+    int res_scheduling = pthread_getschedparam(pthread_self(), &policy_before, &parameters_before);
+    assert(res_scheduling == 0);
+    cpu_set_t cpus_before;
+    int res_affinity = pthread_getaffinity_np(pthread_self(), sizeof(cpus_before), &cpus_before);
+    assert(res_affinity == 0);
+
+    ControlLoop loop(1000.0);
+    auto res_add = loop.add_stage("empty", []() -> expected<void, rfs::Error> { return {}; });
+    assert(res_add);
+    loop.set_priority(50);
+    loop.set_cpu(0);
+    auto res_run = loop.run(1000);
+    if (res_run) {
+        cout << "SCHED_FIFO, max wake-up latency: "
+             << duration_cast<microseconds>(loop.get_max_wakeup_latency()).count() << " us" << endl;
+    } else {
+        assert(res_run.error().name() == "EPERM");
+        cout << "SCHED_FIFO not allowed: " << res_run.error().detail() << endl;
+    }
+
+    // The thread is as before, whether the loop could run or not
+    int policy_after;
+    sched_param parameters_after;
+    res_scheduling = pthread_getschedparam(pthread_self(), &policy_after, &parameters_after);
+    assert(res_scheduling == 0);
+    assert(policy_after == policy_before);
+    assert(parameters_after.sched_priority == parameters_before.sched_priority);
+    cpu_set_t cpus_after;
+    res_affinity = pthread_getaffinity_np(pthread_self(), sizeof(cpus_after), &cpus_after);
+    assert(res_affinity == 0);
+    assert(CPU_EQUAL(&cpus_before, &cpus_after));
+}
+
+int main() {
+    test_rate();
+    test_overruns();
+    test_stop();
+    test_errors();
+    test_realtime();
+}
@@ -0,0 +1,244 @@
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/coroutine.hpp"
+#include "../src/i2c.hpp"
+#include "../src/i2cbus.hpp"
+#include "../src/i2cdisplay.hpp"
+#include "../src/i2csimulator.hpp"
+#include "../src/pca9685.hpp"
+
+using namespace rfs;
+using namespace std;
+using namespace std::chrono;
+
+#define I2C_DEVICE "/dev/i2c-1"
+#define PCA9685_ADDRESS 0x40
+#define DISPLAY_ADDRESS 0x27
+
+// A driver that writes without blocking, completing the writes from another thread, as I2cBusDevice
+class AsyncDriver {
+
+public:
+
+    AsyncDriver(SimulatedPcf8574 &expander): expander(&expander)
+    {}
+
+    expected<void, rfs::Error> write(span<const uint8_t> data, I2cCompletion on_complete) const
+    {
+        // The data must be copied before returning
+        thread([expander = expander, bytes = vector<uint8_t>(data.begin(), data.end()), on_complete]() {
+            this_thread::sleep_for(microseconds(10));
+            expander->write(bytes);
+            on_complete({});
+        }).detach();
+        return {};
+    }
+
+    bool write_byte(uint8_t value) const
+    {
+        expander->write(span<const uint8_t>(&value, 1));
+        return true;
+    }
+
+private:
+
+    SimulatedPcf8574 *expander;
+
+};
+
+Task<int> add_later(Executor &executor, int a, int b) {
+    co_await executor.sleep_for(milliseconds(5));
+    co_return a + b;
+}
+
+Task<> sequence(Executor &executor, vector<string> &events, string name, milliseconds delay) {
+    for (int i = 0; i < 3; i++) {
+        events.push_back(name + to_string(i));
+        co_await executor.sleep_for(delay);
+    }
+    const int sum = co_await add_later(executor, 2, 3);
+    assert(sum == 5);
+    events.push_back(name + "end");
+}
+
+void test_executor() {
+    Executor executor;
+    vector<string> events;
+
+    // The two sequences are interleaved in the same thread
+    const steady_clock::time_point start = steady_clock::now();
+    executor.spawn(sequence(executor, events, "a", milliseconds(10)));
+    executor.spawn(sequence(executor, events, "b", milliseconds(15)));
+    assert(executor.get_tasks_count() == 2);
+    assert(events.empty());
+    executor.run();
+    const steady_clock::duration elapsed = steady_clock::now() - start;
+
+    assert(executor.get_tasks_count() == 0);
+    const vector<string> expected_events{"a0", "b0", "a1", "b1", "a2", "b2", "aend", "bend"};
+    assert(events == expected_events);
+    assert(elapsed >= milliseconds(50));
+
+    // Stopped before finishing, and continued later with poll()
+    events.clear();
+    executor.spawn(sequence(executor, events, "c", milliseconds(1)));
+    executor.stop();
+    executor.run();
+    assert(events.empty());
+    while (executor.get_tasks_count() > 0)
+        executor.poll();
+    assert(events.size() == 4);
+}
+
+Task<> wait_callbacks(Executor &executor, vector<int> &results) {
+    // Completed from another thread
+    expected<int, rfs::Error> completed = co_await executor.await_callback<expected<int, rfs::Error>>(
+        [](auto on_complete) -> expected<void, rfs::Error> {
+            thread([on_complete]() { on_complete(42); }).detach();
+            return {};
+        });
+    assert(completed);
+    results.push_back(*completed);
+
+    // Completed before returning
+    completed = co_await executor.await_callback<expected<int, rfs::Error>>(
+        [](auto on_complete) -> expected<void, rfs::Error> {
+            on_complete(7);
+            return {};
+        });
+    assert(completed);
+    results.push_back(*completed);
+
+    // Failed to start (unhappy path)
+    completed = co_await executor.await_callback<expected<int, rfs::Error>>(
+        [](auto) -> expected<void, rfs::Error> { return unexpected(rfs::Error(EAGAIN)); });
+    assert(!completed);
+    assert(completed.error().name() == "EAGAIN");
+    results.push_back(-1);
+}
+
+void test_callback() {
+    Executor executor;
+    vector<int> results;
+    executor.spawn(wait_callbacks(executor, results));
+    executor.run();
+    const vector<int> expected_results{42, 7, -1};
+    assert(results == expected_results);
+
+    // A bus that is not open (unhappy path)
+    I2cBus bus;
+    I2cBusDevice device(bus, DISPLAY_ADDRESS);
+    bool submitted = true;
+    executor.spawn([](Executor &executor, I2cBusDevice &device, bool &submitted) -> Task<> {
+        const array<uint8_t, 1> data{0};
+        const expected<void, rfs::Error> result = co_await device.async_write(executor, data);
+        submitted = result.has_value();
+        assert(result.error().name() == "ENOTCONN");
+    }(executor, device, submitted));
+    executor.run();
+    assert(!submitted);
+}
+
+void test_pca9685() {
+    SimulatedPca9685 device0(PCA9685_ADDRESS);
+    SimulatedPca9685 device1(PCA9685_ADDRESS + 1);
+    I2cSimulator simulator;
+    simulator.add_device(device0);
+    simulator.add_device(device1);
+
+    Pca9685 p0(false, simulator);
+    Pca9685 p1(false, simulator);
+    auto res_open = p0.open(I2C_DEVICE, PCA9685_ADDRESS);
+    assert(res_open);
+    res_open = p1.open(I2C_DEVICE, PCA9685_ADDRESS + 1);
+    assert(res_open);
+    auto res_always_on = p0.set_always_on(0, true);
+    assert(res_always_on);
+    res_always_on = p1.set_always_on(0, true);
+    assert(res_always_on);
+
+    // Both devices wait for their oscillators at the same time
+    Executor executor;
+    int finished = 0;
+    auto set_frequency = [](Executor &executor, Pca9685 &p, float frequency, int &finished) -> Task<> {
+        const expected<void, rfs::Error> result = co_await p.async_set_frequency(executor, frequency);
+        assert(result);
+        finished++;
+    };
+    executor.spawn(set_frequency(executor, p0, 50.0, finished));
+    executor.spawn(set_frequency(executor, p1, 200.0, finished));
+    executor.run();
+    assert(finished == 2);
+
+    assert(device0.get_register(254) == 121 && device1.get_register(254) == 30);
+    // The outputs were restarted, which clears the RESTART bit
+    assert(!(device0.get_register(0) & 0x80) && !(device1.get_register(0) & 0x80));
+    assert(!*p0.asleep() && !*p1.asleep());
+
+    // A frequency out of range (unhappy path)
+    executor.spawn([](Executor &executor, Pca9685 &p) -> Task<> {
+        const expected<void, rfs::Error> result = co_await p.async_set_frequency(executor, 10000.0);
+        assert(!result);
+        assert(result.error().name() == "EINVAL");
+    }(executor, p0));
+    executor.run();
+}
+
+void test_display() {
+    SimulatedPcf8574 sync_expander(DISPLAY_ADDRESS);
+    SimulatedPcf8574 async_expander(DISPLAY_ADDRESS + 1);
+    I2cSimulator simulator;
+    simulator.add_device(sync_expander);
+    simulator.add_device(async_expander);
+
+    rfs::i2c sync_i2c(simulator);
+    bool opened = sync_i2c.open(I2C_DEVICE, DISPLAY_ADDRESS);
+    assert(opened);
+    rfs::i2cdisplay<rfs::i2c> sync_display(16, 2, sync_i2c);
+    bool done = sync_display.init();
+    assert(done);
+    done = sync_display.print("hello");
+    assert(done);
+
+    // The same bytes are written when the writes are awaited
+    rfs::i2cdisplay<AsyncDriver> async_display(16, 2, AsyncDriver(async_expander));
+    Executor executor;
+    bool result = false;
+    executor.spawn([](Executor &executor, rfs::i2cdisplay<AsyncDriver> &display, bool &result) -> Task<> {
+        result = co_await display.async_init(executor);
+        result &= co_await display.async_print(executor, "hello");
+    }(executor, async_display, result));
+    executor.run();
+    assert(result);
+    assert(async_expander.get_writes_count() == sync_expander.get_writes_count());
+    assert(async_expander.get_port() == sync_expander.get_port());
+
+    // Also with a streaming driver, that doesn't suspend for the transfers
+    rfs::i2c streaming_i2c(simulator);
+    opened = streaming_i2c.open(I2C_DEVICE, DISPLAY_ADDRESS);
+    assert(opened);
+    rfs::i2cdisplay<rfs::i2c> streaming_display(16, 2, streaming_i2c);
+    done = streaming_display.set_streaming_on();
+    assert(done);
+    const uint64_t writes_count = sync_expander.get_writes_count();
+    executor.spawn([](Executor &executor, rfs::i2cdisplay<rfs::i2c> &display, bool &result) -> Task<> {
+        result = co_await display.async_init(executor);
+        result &= co_await display.async_set_cursor_position(executor, 1, 0);
+        result &= co_await display.async_print(executor, "world");
+    }(executor, streaming_display, result));
+    executor.run();
+    assert(result);
+    cout << "bytes written to initialize the display and print: " << sync_expander.get_writes_count() - writes_count << endl;
+}
+
+int main() {
+    test_executor();
+    test_callback();
+    test_pca9685();
+    test_display();
+}
@@ -0,0 +1,117 @@
+#include <cassert>
+#include <iostream>
+
+#include "../src/i2c.hpp"
+#include "../src/i2cdisplay.hpp"
+#include "../src/i2csimulator.hpp"
+#include "../src/pca9685.hpp"
+#include "../src/servogroup.hpp"
+
+using namespace rfs;
+using namespace std;
+
+#define PCA9685_DEVICE "/dev/i2c-1"
+#define PCA9685_ADDRESS 0x40
+#define DISPLAY_ADDRESS 0x27
+
+void test_pca9685() {
+    SimulatedPca9685 device(PCA9685_ADDRESS);
+    I2cSimulator simulator;
+    simulator.add_device(device);
+
+    Pca9685 p(false, simulator);
+    auto res = p.open(PCA9685_DEVICE, PCA9685_ADDRESS);
+    assert(res);
+
+    // The registers of the channel 1 are 10 to 13
+    auto res_set_times = p.set_on_off_times(1, 0.25, 0.5);
+    assert(res_set_times);
+    assert(device.get_register(10) == 0x00 && device.get_register(11) == 0x04);
+    assert(device.get_register(12) == 0x00 && device.get_register(13) == 0x08);
+
+    auto res_times = p.on_off_times(1);
+    assert(res_times);
+    assert(res_times->on == 0.25 && res_times->off == 0.5);
+
+    // A device that doesn't exist (unhappy path)
+    Pca9685 p2(false, simulator);
+    auto res_wrong_address = p2.open(PCA9685_DEVICE, 0x41);
+    assert(!res_wrong_address);
+    assert(res_wrong_address.error().name() == "EREMOTEIO");
+}
+
+void test_bus_time() {
+    SimulatedPca9685 device(PCA9685_ADDRESS);
+    I2cSimulator simulator(I2cSimulator::STANDARD_MODE_FREQUENCY);
+    simulator.add_device(device);
+
+    Pca9685 p(true, simulator);
+    auto res = p.open(PCA9685_DEVICE, PCA9685_ADDRESS);
+    assert(res);
+
+    // A bulk write of 16 channels is a single transfer: START, address, register, 64 bytes and STOP
+    const uint64_t transfers_count = simulator.get_transfers_count();
+    const chrono::nanoseconds bus_time = simulator.get_bus_time();
+    const array<float, 16> duty_cycles{};
+    vector<Pca9685OnOffTimes> times;
+    for (float duty_cycle: duty_cycles)
+        times.push_back({0.0, duty_cycle + 0.1f, false, false});
+    auto res_bulk = p.set_on_off_times_bulk(0, times);
+    assert(res_bulk);
+    assert(simulator.get_transfers_count() == transfers_count + 1);
+    assert(simulator.get_bus_time() - bus_time == chrono::microseconds((1 + 9 * 66 + 1) * 10));
+    cout << "bus time of a transfer of 16 channels at 100 kHz: "
+        << chrono::duration_cast<chrono::microseconds>(simulator.get_bus_time() - bus_time).count() << " us" << endl;
+}
+
+void test_smbus_only() {
+    SimulatedPca9685 device(PCA9685_ADDRESS);
+    I2cSimulator simulator(I2cSimulator::FAST_MODE_FREQUENCY, false, false);
+    simulator.add_device(device);
+
+    // Without plain I2C, the bulk writes are split in SMBus blocks
+    ServoGroup group;
+    Pca9685 p(true, simulator);
+    auto res = p.open(PCA9685_DEVICE, PCA9685_ADDRESS);
+    assert(res);
+    for (uint32_t channel = 0; channel < 16; channel++) {
+        auto res_add = group.add_servo(p, channel);
+        assert(res_add);
+    }
+    auto res_init = group.init();
+    assert(res_init);
+
+    const uint64_t transfers_count = simulator.get_transfers_count();
+    const array<float, 16> angles{};
+    auto res_angles = group.set_angles(angles);
+    assert(res_angles);
+    assert(simulator.get_transfers_count() == transfers_count + 2);
+}
+
+void test_display() {
+    SimulatedPcf8574 expander(DISPLAY_ADDRESS);
+    I2cSimulator simulator;
+    simulator.add_device(expander);
+
+    rfs::i2c i(simulator);
+    const bool result = i.open(PCA9685_DEVICE, DISPLAY_ADDRESS);
+    assert(result);
+
+    rfs::i2cdisplay<rfs::i2c> d(16, 2, i);
+    d.init();
+    d.set_backlight_on();
+    assert(expander.get_writes_count() > 0);
+    cout << "bytes written to initialize the display: " << expander.get_writes_count() << endl;
+
+    // A display without rows has one, so the cursor row stays in range (unhappy path)
+    rfs::i2cdisplay<rfs::i2c> no_rows(0, 16, i);
+    const bool moved = no_rows.set_cursor_position(10, 0);
+    assert(moved);
+}
+
+int main() {
+    test_pca9685();
+    test_bus_time();
+    test_smbus_only();
+    test_display();
+}
@@ -0,0 +1,191 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <future>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/i2cbus.hpp"
+#include "../src/i2csimulator.hpp"
+
+using namespace rfs;
+using namespace std;
+
+#define I2C_DEVICE "/dev/i2c-1"
+#define PCA9685_ADDRESS 0x40
+#define DISPLAY_ADDRESS 0x27
+
+void test_open() {
+    I2cBus bus;
+
+    // Submit before opening (unhappy path)
+    auto res_submit = bus.submit(I2cPriority::Normal, PCA9685_ADDRESS, {}, {}, nullptr);
+    assert(!res_submit);
+    assert(res_submit.error().name() == "ENOTCONN");
+
+    // Open a wrong device (unhappy path)
+    auto res_wrong_device = bus.open("/dev/wrong_device");
+    assert(!res_wrong_device);
+    assert(res_wrong_device.error().name() == "ENOENT");
+
+    auto res = bus.open(I2C_DEVICE);
+    assert(res);
+    auto res_close = bus.close();
+    assert(res_close);
+}
+
+void test_write_read() {
+    I2cBus bus;
+
+    auto res = bus.open(I2C_DEVICE);
+    assert(res);
+
+    // Read the MODE1 and MODE2 registers of the PCA9685
+    const array<uint8_t, 1> reg{0};
+    array<uint8_t, 2> modes;
+    auto res_read = bus.submit(I2cPriority::High, PCA9685_ADDRESS, reg, modes).get();
+    assert(res_read);
+
+    // A device that doesn't exist (unhappy path)
+    auto res_wrong_address = bus.submit(I2cPriority::High, 0x20, reg).get();
+    assert(!res_wrong_address);
+    assert(res_wrong_address.error().name() == "EREMOTEIO");
+}
+
+void test_priorities() {
+    // On the simulator, so the order doesn't depend on the hardware
+    SimulatedPca9685 pca_device(PCA9685_ADDRESS);
+    SimulatedPcf8574 display_device(DISPLAY_ADDRESS);
+    I2cSimulator simulator;
+    simulator.add_device(pca_device);
+    simulator.add_device(display_device);
+    I2cBus bus(simulator);
+
+    auto res = bus.open(I2C_DEVICE);
+    assert(res);
+
+    // Open twice (unhappy path)
+    auto res_reopen = bus.open(I2C_DEVICE);
+    assert(!res_reopen);
+    assert(res_reopen.error().name() == "EBUSY");
+
+    // The bus thread is held in the completion of the first display write, so the rest of
+    // transactions are all pending when it goes on. The completions run in the bus thread, one
+    // after another, so they can record their order without locks
+    vector<string> completions;
+    promise<void> first_started;
+    promise<void> release;
+    shared_future<void> released = release.get_future().share();
+    I2cBusDevice display(bus, DISPLAY_ADDRESS, I2cPriority::Low);
+    const array<uint8_t, 1> data{0x08};
+    auto res_first = display.write(data, [&completions, &first_started, released](expected<void, Error> result) {
+        completions.push_back(result ? "display" : "error");
+        first_started.set_value();
+        released.wait();
+    });
+    assert(res_first);
+    first_started.get_future().wait();
+
+    // The display writes are submitted before the PCA9685 read, but they have a lower priority
+    const size_t display_writes = 32;
+    for (size_t i = 1; i < display_writes - 1; i++) {
+        auto res_write = display.write(data, [&completions](expected<void, Error> result) {
+            completions.push_back(result ? "display" : "error");
+        });
+        assert(res_write);
+    }
+    future<expected<void, Error>> last_write = display.write(data);
+    const array<uint8_t, 1> reg{0};
+    array<uint8_t, 1> mode1;
+    auto res_read = bus.submit(I2cPriority::High, PCA9685_ADDRESS, reg, mode1,
+        [&completions](expected<void, Error> result) {
+            completions.push_back(result ? "pca" : "error");
+        });
+    assert(res_read);
+    release.set_value();
+
+    // The read goes just after the display write that was running, before all the queued ones
+    const expected<void, Error> last_result = last_write.get();
+    assert(last_result);
+    assert(completions.size() == display_writes);
+    assert(completions[0] == "display" && completions[1] == "pca");
+    assert(count(completions.begin(), completions.end(), "display") == display_writes - 1);
+    assert(mode1[0] == pca_device.get_register(0));
+    assert(display_device.get_writes_count() == display_writes);
+    auto res_close = bus.close();
+    assert(res_close);
+}
+
+void test_close_while_submitting() {
+    SimulatedPca9685 device(PCA9685_ADDRESS);
+    I2cSimulator simulator;
+    simulator.add_device(device);
+
+    for (int round = 0; round < 50; round++) {
+        I2cBus bus(simulator);
+        auto res = bus.open(I2C_DEVICE);
+        assert(res);
+
+        // Every transaction accepted is completed, by the bus thread or by close()
+        atomic<uint32_t> accepted(0);
+        atomic<uint32_t> completed(0);
+        atomic<uint32_t> cancelled(0);
+        vector<thread> submitters;
+        for (int i = 0; i < 4; i++) {
+            submitters.emplace_back([&bus, &accepted, &completed, &cancelled]() {
+                const array<uint8_t, 2> data{0xfe, 0x79};
+                while (true) {
+                    auto res_submit = bus.submit(I2cPriority::Normal, PCA9685_ADDRESS, data, {},
+                        [&completed, &cancelled](expected<void, rfs::Error> result) {
+                            if (!result) {
+                                assert(result.error().name() == "ECANCELED");
+                                cancelled.fetch_add(1);
+                            }
+                            completed.fetch_add(1);
+                        });
+                    if (res_submit) {
+                        accepted.fetch_add(1);
+                    } else if (res_submit.error().name() == "ENOTCONN") {
+                        break;
+                    } else {
+                        assert(res_submit.error().name() == "EAGAIN");
+                    }
+                }
+            });
+        }
+
+        this_thread::sleep_for(chrono::microseconds(200 + round * 20));
+        auto res_close = bus.close();
+        assert(res_close);
+        for (thread &submitter: submitters)
+            submitter.join();
+        assert(completed.load() == accepted.load());
+        if (round == 49)
+            cout << "transactions accepted: " << accepted.load() << ", cancelled: " << cancelled.load() << endl;
+    }
+
+    // The futures are not left without value either
+    I2cBus bus(simulator);
+    auto res = bus.open(I2C_DEVICE);
+    assert(res);
+    vector<future<expected<void, Error>>> results;
+    const array<uint8_t, 2> data{0xfe, 0x79};
+    for (size_t i = 0; i < I2cBus::QUEUE_SIZE; i++)
+        results.push_back(bus.submit(I2cPriority::Low, PCA9685_ADDRESS, data));
+    auto res_close = bus.close();
+    assert(res_close);
+    for (future<expected<void, Error>> &result: results) {
+        assert(result.wait_for(chrono::seconds(0)) == future_status::ready);
+        const expected<void, Error> transaction_result = result.get();
+        assert(transaction_result || transaction_result.error().name() == "ECANCELED");
+    }
+}
+
+int main() {
+    test_close_while_submitting();
+    test_open();
+    test_write_read();
+    test_priorities();
+}
@@ -1,15 +1,23 @@
 
+#include <cassert>
+#include <cstdio>
 #include <glm/gtx/string_cast.hpp>
 #include <glm/vec3.hpp>
 #include <iostream>
+#include <tuple>
 #include <vector>
 
 #include "../src/kinematics.hpp"
+#include "../src/kinematicsbatch.hpp"
+#include "../src/kinematicspool.hpp"
+#include "../src/kinematicsworkspace.hpp"
 
 using namespace glm;
 using namespace rfs;
 using namespace std;
 
+constexpr array<DHParameters, 3> LEG{{{0.0, M_PI/2.0, 32.2}, {0.0, 0.0, 48.6}, {0.0, 0.0, 113.713}}};
+
 int main()
 {
     KinematicChain k({{0.0, M_PI/2.0, 32.2}, {0.0, 0.0, 48.6}, {0.0, 0.0, 113.713}});
@@ -44,4 +52,142 @@ int main()
 
     const vec3 ee_pos_after = k.forward_kinematics();
     cout << "end effector position: " << to_string(ee_pos_after) << endl;
-}
\ No newline at end of file
+    cout << endl;
+
+    // Incremental forward kinematics must give the same result as computing all the joints
+    cout << "INCREMENTAL FORWARD KINEMATICS" << endl;
+    cout << "==============================" << endl;
+    vector<float> new_angles = k.get_angles();
+    new_angles[2] += 0.5;
+    k.set_angles(new_angles);
+    const vec3 ee_pos_incremental = k.forward_kinematics();
+
+    KinematicChain k_full({{0.0, M_PI/2.0, 32.2}, {0.0, 0.0, 48.6}, {0.0, 0.0, 113.713}});
+    k_full.set_angles(new_angles);
+    const vec3 ee_pos_full = k_full.forward_kinematics();
+    cout << "incremental: " << to_string(ee_pos_incremental) << endl;
+    cout << "full: " << to_string(ee_pos_full) << endl;
+    assert(distance(ee_pos_incremental, ee_pos_full) < 1e-3);
+    cout << endl;
+
+    // Try the inverse kinematics solvers
+    cout << "INVERSE KINEMATICS SOLVERS" << endl;
+    cout << "==========================" << endl;
+    // CCD converges slowly in this chain, so it is only compared with the others
+    const tuple<IKSolver, string, bool> solvers[] = {
+        {IKSolver::CCD, "CCD", false}, {IKSolver::DLS, "DLS", true},
+        {IKSolver::LevenbergMarquardt, "Levenberg-Marquardt", true}};
+    for (const auto &[solver, name, must_converge]: solvers) {
+        KinematicChain k_solver({{0.0, M_PI/2.0, 32.2}, {0.0, 0.0, 48.6}, {0.0, 0.0, 113.713}});
+        k_solver.set_solver(solver);
+        const IKResult result = k_solver.inverse_kinematics(ee_pos_inv, 128, 0.1);
+        cout << name << ": iterations=" << result.iterations << ", error=" << result.error << endl;
+
+        // Starting from the previous solution, a near target should need fewer iterations
+        const IKResult result_warm = k_solver.inverse_kinematics(ee_pos_inv + vec3(1.0, 1.0, 0.0), 128, 0.1);
+        cout << name << " (warm start): iterations=" << result_warm.iterations << ", error=" << result_warm.error << endl;
+        if (must_converge) {
+            assert(result.converged && result.error < 0.1);
+            assert(result_warm.converged && result_warm.error < 0.1);
+            assert(result_warm.iterations < result.iterations);
+        }
+    }
+    cout << endl;
+
+    // Solve six chains with the same geometry at once
+    cout << "BATCH KINEMATICS" << endl;
+    cout << "================" << endl;
+    KinematicChainBatch batch({{0.0, M_PI/2.0, 32.2}, {0.0, 0.0, 48.6}, {0.0, 0.0, 113.713}}, 6);
+    vector<vec3> targets;
+    for (int i = 0; i < 6; i++) {
+        targets.push_back(ee_pos_inv + vec3(0.0, i * 5.0, 0.0));
+    }
+    vector<IKResult> results(6);
+    batch.inverse_kinematics(targets, results, 128, 0.1);
+
+    vector<vec3> batch_ee(6);
+    batch.forward_kinematics(batch_ee);
+    for (int i = 0; i < 6; i++) {
+        array<float, 3> batch_angles;
+        batch.get_angles(i, batch_angles);
+        KinematicChain k_check({{0.0, M_PI/2.0, 32.2}, {0.0, 0.0, 48.6}, {0.0, 0.0, 113.713}});
+        k_check.set_angles(batch_angles);
+        cout << "chain " << i << ": iterations=" << results[i].iterations << ", error=" << results[i].error
+             << ", end effector position: " << to_string(batch_ee[i]) << endl;
+        assert(results[i].converged);
+        assert(distance(k_check.forward_kinematics(), batch_ee[i]) < 1e-2);
+    }
+    cout << endl;
+
+    // A chain with a fixed number of joints must give the same results as the dynamic one
+    cout << "FIXED KINEMATIC CHAIN" << endl;
+    cout << "=====================" << endl;
+    FixedKinematicChain<3> k_fixed(LEG);
+    k_fixed.set_solver(IKSolver::DLS);
+    KinematicChain k_dynamic({LEG.begin(), LEG.end()});
+    k_dynamic.set_solver(IKSolver::DLS);
+    const IKResult result_fixed = k_fixed.inverse_kinematics(ee_pos_inv, 128, 0.1);
+    const IKResult result_dynamic = k_dynamic.inverse_kinematics(ee_pos_inv, 128, 0.1);
+    const array<float, 3> fixed_angles = k_fixed.get_angles();
+    array<float, 3> dynamic_angles;
+    k_dynamic.get_angles(dynamic_angles);
+    cout << "fixed: iterations=" << result_fixed.iterations << ", error=" << result_fixed.error << endl;
+    cout << "dynamic: iterations=" << result_dynamic.iterations << ", error=" << result_dynamic.error << endl;
+    assert(result_fixed.iterations == result_dynamic.iterations);
+    for (size_t i = 0; i < fixed_angles.size(); i++) {
+        assert(fabs(fixed_angles[i] - dynamic_angles[i]) < 1e-4);
+    }
+    cout << endl;
+
+    // Seed the inverse kinematics with the solutions cached in a workspace
+    cout << "WORKSPACE CACHE" << endl;
+    cout << "===============" << endl;
+    KinematicWorkspace workspace(3, {-200.0, -200.0, -200.0}, {200.0, 200.0, 200.0}, 10.0);
+    const JointRange ranges[] = {{-M_PI/2.0, M_PI/2.0}, {-M_PI/2.0, M_PI/2.0}, {-M_PI, 0.0}};
+    workspace.sample(k_fixed, ranges, 32);
+    k_fixed.set_angles(array<float, 3>{0.0, 0.0, 0.0});
+    const IKResult result_seeded = workspace.inverse_kinematics(k_fixed, ee_pos_inv + vec3(0.0, 20.0, 0.0), 128, 0.1);
+    cout << "seeded: iterations=" << result_seeded.iterations << ", error=" << result_seeded.error << endl;
+    assert(result_seeded.converged);
+
+    // The workspace loaded gives the same seeds as the one saved
+    auto res_save = workspace.save("/tmp/test_kinematic_chain.ws");
+    assert(res_save);
+    KinematicWorkspace workspace_loaded(3, {-200.0, -200.0, -200.0}, {200.0, 200.0, 200.0}, 10.0);
+    auto res_load = workspace_loaded.load("/tmp/test_kinematic_chain.ws");
+    assert(res_load);
+    for (const vec3 &target: {ee_pos_inv + vec3(0.0, 20.0, 0.0), ee_pos_inv, vec3(60.0, -40.0, -80.0)}) {
+        FixedKinematicChain<3> k_original(LEG);
+        const bool seeded_original = workspace.seed(k_original, target);
+        FixedKinematicChain<3> k_loaded(LEG);
+        const bool seeded_loaded = workspace_loaded.seed(k_loaded, target);
+        assert(seeded_original && seeded_loaded);
+        const array<float, 3> original_angles = k_original.get_angles();
+        const array<float, 3> loaded_angles = k_loaded.get_angles();
+        assert(original_angles == loaded_angles);
+    }
+    remove("/tmp/test_kinematic_chain.ws");
+    cout << endl;
+
+    // Solve the legs of a hexapod in parallel
+    cout << "KINEMATICS POOL" << endl;
+    cout << "===============" << endl;
+    KinematicsPool<FixedKinematicChain<3>> pool(4);
+    vector<FixedKinematicChain<3>> legs(6, FixedKinematicChain<3>(LEG));
+    for (FixedKinematicChain<3> &leg: legs) {
+        leg.set_solver(IKSolver::DLS);
+    }
+    array<KinematicsJob<FixedKinematicChain<3>>, 6> jobs;
+    for (int tick = 0; tick < 10; tick++) {
+        for (size_t i = 0; i < jobs.size(); i++) {
+            jobs[i] = {&legs[i], ee_pos_inv + vec3(0.0, i * 5.0, tick * 1.0), {}};
+        }
+        pool.solve(jobs, 128, 0.1);
+        for (const KinematicsJob<FixedKinematicChain<3>> &job: jobs) {
+            assert(job.result.converged);
+        }
+    }
+    for (size_t i = 0; i < jobs.size(); i++) {
+        cout << "leg " << i << ": iterations=" << jobs[i].result.iterations << ", error=" << jobs[i].result.error << endl;
+    }
+}
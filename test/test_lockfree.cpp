@@ -0,0 +1,146 @@
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "../src/lockfree.hpp"
+
+using namespace rfs;
+using namespace std;
+
+#define PRODUCERS_COUNT 4
+
+void test_mpsc_queue() {
+    MpscQueue<int, 4> queue;
+
+    // Empty
+    int value = 0;
+    bool popped = queue.pop(value);
+    assert(!popped);
+
+    // Full (unhappy path)
+    for (int i = 1; i <= 4; i++) {
+        const bool pushed = queue.push(int(i));
+        assert(pushed);
+    }
+    bool pushed = queue.push(5);
+    assert(!pushed);
+
+    // In order, also after wrapping around
+    for (int i = 1; i <= 4; i++) {
+        popped = queue.pop(value);
+        assert(popped);
+        assert(value == i);
+    }
+    pushed = queue.push(6);
+    assert(pushed);
+    popped = queue.pop(value);
+    assert(popped);
+    assert(value == 6);
+    popped = queue.pop(value);
+    assert(!popped);
+}
+
+void test_mpsc_queue_concurrent() {
+    // Each element has its producer in the high bits and its number in the low bits
+    MpscQueue<uint64_t, 64> queue;
+    const uint64_t values_count = 200000;
+
+    vector<thread> producers;
+    for (uint64_t producer = 0; producer < PRODUCERS_COUNT; producer++) {
+        producers.emplace_back([&queue, producer, values_count]() {
+            for (uint64_t i = 1; i <= values_count; i++) {
+                while (!queue.push((producer << 32) | i))
+                    this_thread::yield();
+            }
+        });
+    }
+
+    // Nothing is lost nor duplicated, and each producer's elements keep their order
+    array<uint64_t, PRODUCERS_COUNT> last{};
+    uint64_t popped = 0;
+    uint64_t value;
+    while (popped < PRODUCERS_COUNT * values_count) {
+        if (!queue.pop(value)) {
+            this_thread::yield();
+            continue;
+        }
+        const uint64_t producer = value >> 32;
+        assert(producer < PRODUCERS_COUNT);
+        assert((value & 0xffffffff) == last[producer] + 1);
+        last[producer]++;
+        popped++;
+    }
+    for (thread &producer: producers)
+        producer.join();
+    assert(!queue.pop(value));
+    for (const uint64_t count: last)
+        assert(count == values_count);
+}
+
+// All the words have the same value, so a torn copy would be detected
+using Sample = array<uint64_t, 8>;
+
+void test_latest_value() {
+    LatestValue<Sample> slot;
+
+    // Nothing stored yet
+    Sample value{};
+    bool loaded = slot.load(value);
+    assert(!loaded);
+
+    // Only the newest value is loaded, once
+    slot.store(Sample{1});
+    slot.store(Sample{2});
+    loaded = slot.load(value);
+    assert(loaded);
+    assert(value[0] == 2);
+    loaded = slot.load(value);
+    assert(!loaded);
+    assert(value[0] == 2);
+}
+
+void test_latest_value_concurrent() {
+    LatestValue<Sample> slot;
+    const uint64_t values_count = 1000000;
+
+    thread writer([&slot, values_count]() {
+        for (uint64_t i = 1; i <= values_count; i++) {
+            Sample sample;
+            sample.fill(i);
+            slot.store(std::move(sample));
+            // Let the reader run also with a single CPU
+            if (i % 1000 == 0)
+                this_thread::yield();
+        }
+    });
+
+    // The values never go back, and the last one is always seen
+    uint64_t last = 0;
+    uint64_t loads = 0;
+    Sample value;
+    while (last < values_count) {
+        if (!slot.load(value))
+            continue;
+        for (const uint64_t word: value)
+            assert(word == value[0]);
+        assert(value[0] > last);
+        last = value[0];
+        loads++;
+    }
+    writer.join();
+    assert(last == values_count);
+    const bool loaded = slot.load(value);
+    assert(!loaded);
+    cout << "values loaded: " << loads << " out of " << values_count << endl;
+}
+
+int main() {
+    test_mpsc_queue();
+    test_mpsc_queue_concurrent();
+    test_latest_value();
+    test_latest_value_concurrent();
+}
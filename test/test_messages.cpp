@@ -0,0 +1,112 @@
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+#include "../src/messages.hpp"
+
+using namespace rfs;
+using namespace std;
+
+// A copy of the frame in an aligned buffer, to modify it
+vector<uint64_t> copy_frame(span<const uint8_t> bytes, size_t extra_bytes = 0) {
+    vector<uint64_t> buffer((bytes.size() + extra_bytes + sizeof(uint64_t) - 1) / sizeof(uint64_t), 0);
+    memcpy(buffer.data(), bytes.data(), bytes.size());
+    return buffer;
+}
+
+span<const uint8_t> frame_bytes(const vector<uint64_t> &buffer, size_t size) {
+    return span<const uint8_t>(reinterpret_cast<const uint8_t *>(buffer.data()), size);
+}
+
+void test_round_trip() {
+    ServoFrameBuilder builder(3);
+    builder.clear(123456789);
+    assert(builder.size() == sizeof(ServoFrame::Header));
+    for (int32_t id = 0; id < 3; id++) {
+        const bool added = builder.add(id, id * 10.0f - 45.0f);
+        assert(added);
+    }
+    assert(builder.size() == sizeof(ServoFrame::Header) + 3 * sizeof(ServoFrameEntry));
+
+    auto res_frame = ServoFrame::from_bytes(builder.bytes());
+    assert(res_frame);
+    assert(res_frame->timestamp() == 123456789);
+    assert(res_frame->entries().size() == 3);
+    assert(res_frame->entries()[2].id == 2);
+    assert(res_frame->entries()[2].angle == -25.0f);
+
+    // Through a ZeroMQ message
+    const zmq::message_t message = builder.to_zmq_message();
+    auto res_zmq_frame = ServoFrame::from_zmq_message(message);
+    assert(res_zmq_frame);
+    assert(res_zmq_frame->entries().size() == 3);
+
+    // The buffer is reused for the next frame
+    builder.clear(5);
+    auto res_empty = ServoFrame::from_bytes(builder.bytes());
+    assert(res_empty);
+    assert(res_empty->timestamp() == 5);
+    assert(res_empty->entries().empty());
+}
+
+void test_full_builder() {
+    ServoFrameBuilder builder(2);
+    bool added = builder.add(0, 0.0);
+    assert(added);
+    added = builder.add(1, 0.0);
+    assert(added);
+
+    // Adding to a full frame (unhappy path) leaves it as it was
+    added = builder.add(2, 0.0);
+    assert(!added);
+    auto res_frame = ServoFrame::from_bytes(builder.bytes());
+    assert(res_frame);
+    assert(res_frame->entries().size() == 2);
+}
+
+void test_wrong_frames() {
+    ServoFrameBuilder builder(2);
+    builder.clear(0);
+    builder.add(0, 0.0);
+    builder.add(1, 0.0);
+    const size_t size = builder.size();
+
+    // Wrong prefix (unhappy path)
+    vector<uint64_t> buffer = copy_frame(builder.bytes());
+    reinterpret_cast<uint8_t *>(buffer.data())[0] = 'X';
+    auto res_prefix = ServoFrame::from_bytes(frame_bytes(buffer, size));
+    assert(!res_prefix);
+    assert(res_prefix.error().name() == "EBADMSG");
+    assert(res_prefix.error().detail().ends_with("wrong prefix"));
+
+    // Wrong version (unhappy path)
+    buffer = copy_frame(builder.bytes());
+    reinterpret_cast<ServoFrame::Header *>(buffer.data())->version = ServoFrame::VERSION + 1;
+    auto res_version = ServoFrame::from_bytes(frame_bytes(buffer, size));
+    assert(!res_version);
+    assert(res_version.error().detail().ends_with("wrong version"));
+
+    // The size doesn't match the number of entries (unhappy path)
+    buffer = copy_frame(builder.bytes(), sizeof(ServoFrameEntry));
+    auto res_longer = ServoFrame::from_bytes(frame_bytes(buffer, size + sizeof(ServoFrameEntry)));
+    assert(!res_longer);
+    assert(res_longer.error().detail().ends_with("wrong message size"));
+    auto res_shorter = ServoFrame::from_bytes(frame_bytes(buffer, size - 1));
+    assert(!res_shorter);
+    assert(res_shorter.error().detail().ends_with("wrong message size"));
+    reinterpret_cast<ServoFrame::Header *>(buffer.data())->entries_count = 3;
+    auto res_count = ServoFrame::from_bytes(frame_bytes(buffer, size));
+    assert(!res_count);
+    assert(res_count.error().detail().ends_with("wrong message size"));
+
+    // Shorter than the header (unhappy path)
+    auto res_header = ServoFrame::from_bytes(frame_bytes(buffer, sizeof(ServoFrame::Header) - 1));
+    assert(!res_header);
+    assert(res_header.error().detail().ends_with("wrong message size"));
+}
+
+int main() {
+    test_round_trip();
+    test_full_builder();
+    test_wrong_frames();
+}
@@ -1,9 +1,15 @@
 
 #include <cassert>
+#include <cstdlib>
 #include <iostream>
+#include <new>
 
+#include "../src/i2csimulator.hpp"
 #include "../src/servo.hpp"
 #include "../src/pca9685.hpp"
+#include "../src/pca9685array.hpp"
+#include "../src/servogroup.hpp"
+#include "../src/servotable.hpp"
 
 using namespace rfs;
 using namespace std;
@@ -11,6 +17,24 @@ using namespace std;
 #define PCA9685_DEVICE "/dev/i2c-1"
 #define PCA9685_ADDRESS 0x40
 
+// Count the heap allocations, to check that the PWM path doesn't allocate memory
+static size_t allocations_count = 0;
+
+void *operator new(size_t size) {
+    allocations_count++;
+    if (void *ptr = malloc(size))
+        return ptr;
+    throw bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+
 void test_open() {
     Pca9685 p;
 
@@ -366,6 +390,150 @@ void test_on_off_times() {
     assert(abs(res_get_times->off - 0.85) < 0.001);
 }
 
+void test_on_off_times_bulk() {
+    Pca9685 p;
+
+    auto res = p.open(PCA9685_DEVICE, PCA9685_ADDRESS);
+    assert(res);
+
+    vector<Pca9685OnOffTimes> times(16, Pca9685OnOffTimes{0.25, 0.5, false, false});
+
+    // Wrong first channel
+    auto res_set_times = p.set_on_off_times_bulk(16, span(times).first(1));
+    assert(!res_set_times);
+    assert(res_set_times.error().name() == "EINVAL");
+
+    // Range beyond the last channel
+    res_set_times = p.set_on_off_times_bulk(1, times);
+    assert(!res_set_times);
+    assert(res_set_times.error().name() == "EINVAL");
+
+    // Wrong On/Off times
+    times[3].off = 0.25;
+    res_set_times = p.set_on_off_times_bulk(0, times);
+    assert(!res_set_times);
+    assert(res_set_times.error().name() == "EINVAL");
+
+    // Set all the channels at once, each one with a different off time
+    for (int channel = 0; channel < 16; channel++) {
+        times[channel].off = 0.5 + channel / 64.0;
+    }
+    times[15].always_off = true;
+    res_set_times = p.set_on_off_times_bulk(0, times);
+    assert(res_set_times);
+    this_thread::sleep_for(chrono::milliseconds(40));
+
+    for (int channel = 0; channel < 16; channel++) {
+        auto res_get_times = p.on_off_times(channel);
+        assert(res_get_times);
+        assert(res_get_times->on == 0.25);
+        assert(res_get_times->off == times[channel].off);
+        assert(res_get_times->always_off == (channel == 15));
+    }
+
+    // Set a range in the middle
+    res_set_times = p.set_on_off_times_bulk(4, span(times).subspan(0, 3));
+    assert(res_set_times);
+    this_thread::sleep_for(chrono::milliseconds(40));
+
+    auto res_get_times = p.on_off_times(6);
+    assert(res_get_times);
+    assert(res_get_times->off == times[2].off);
+}
+
+void test_register_cache() {
+    Pca9685 p(true);
+
+    auto res = p.open(PCA9685_DEVICE, PCA9685_ADDRESS);
+    assert(res);
+
+    // The cached values are kept in sync with the writes
+    auto res_set_inverted = p.set_output_inverted(true);
+    assert(res_set_inverted);
+    auto res_get_inverted = p.output_inverted();
+    assert(res_get_inverted);
+    assert(*res_get_inverted);
+
+    auto res_set_times = p.set_on_off_times(Pca9685::ALL_CHANNELS, 0.25, 0.85);
+    assert(res_set_times);
+    auto res_get_times = p.on_off_times(3);
+    assert(res_get_times);
+    assert(abs(res_get_times->on - 0.25) < 0.001);
+    assert(abs(res_get_times->off - 0.85) < 0.001);
+
+    // Modify the device from another instance, the cache doesn't see the change until resync
+    Pca9685 p2;
+    res = p2.open(PCA9685_DEVICE, PCA9685_ADDRESS);
+    assert(res);
+    res_set_inverted = p2.set_output_inverted(false);
+    assert(res_set_inverted);
+
+    res_get_inverted = p.output_inverted();
+    assert(res_get_inverted);
+    assert(*res_get_inverted);
+
+    auto res_resync = p.resync();
+    assert(res_resync);
+    res_get_inverted = p.output_inverted();
+    assert(res_get_inverted);
+    assert(!(*res_get_inverted));
+
+    // The restart flag is always read from the device
+    res_set_times = p.set_on_off_times(0, 0.25, 0.5);
+    assert(res_set_times);
+    auto res_sleep = p.sleep();
+    assert(res_sleep);
+    auto res_needs_restart = p.needs_restart();
+    assert(res_needs_restart);
+    assert(*res_needs_restart);
+    auto res_restart = p.restart();
+    assert(res_restart);
+    assert(*res_restart);
+}
+
+void test_staged_mode() {
+    Pca9685 p;
+
+    auto res = p.open(PCA9685_DEVICE, PCA9685_ADDRESS);
+    assert(res);
+    auto res_set_times = p.set_on_off_times(Pca9685::ALL_CHANNELS, 0.25, 0.5);
+    assert(res_set_times);
+
+    auto res_staged = p.set_staged_mode(true);
+    assert(res_staged);
+    assert(p.staged_mode());
+
+    // The values are not sent until flushed
+    res_set_times = p.set_on_off_times(2, 0.25, 0.75);
+    assert(res_set_times);
+    res_set_times = p.set_on_off_times(3, 0.25, 0.75);
+    assert(res_set_times);
+    auto res_get_times = p.on_off_times(2);
+    assert(res_get_times);
+    assert(res_get_times->off == 0.5);
+
+    auto res_flush = p.flush();
+    assert(res_flush);
+    this_thread::sleep_for(chrono::milliseconds(40));
+    res_get_times = p.on_off_times(2);
+    assert(res_get_times);
+    assert(res_get_times->off == 0.75);
+    res_get_times = p.on_off_times(3);
+    assert(res_get_times);
+    assert(res_get_times->off == 0.75);
+
+    // Disabling the staged mode flushes the pending values
+    res_set_times = p.set_on_off_times(4, 0.25, 0.75);
+    assert(res_set_times);
+    res_staged = p.set_staged_mode(false);
+    assert(res_staged);
+    assert(!p.staged_mode());
+    this_thread::sleep_for(chrono::milliseconds(40));
+    res_get_times = p.on_off_times(4);
+    assert(res_get_times);
+    assert(res_get_times->off == 0.75);
+}
+
 void test_servo() {
     Pca9685 p;
 
@@ -410,7 +578,241 @@ void test_servo() {
     this_thread::sleep_for(chrono::seconds(1));
 }
 
+void test_static_servo() {
+    Pca9685 p;
+
+    auto res = p.open(PCA9685_DEVICE, PCA9685_ADDRESS);
+    assert(res);
+    auto res_frequency = p.set_frequency(50.0);
+    assert(res_frequency);
+
+    static_assert(PwmDriver<Pca9685StaticPwm>);
+    auto res_pwm = p.static_pwm(0);
+    assert(res_pwm);
+    BasicServo<Pca9685StaticPwm> s0(*res_pwm, 0.05);
+    for (const float angle: {-90.0f, 0.0f, 90.0f}) {
+        auto res_set_angle = s0.set_angle(angle);
+        assert(res_set_angle);
+        this_thread::sleep_for(chrono::seconds(1));
+    }
+    auto res_get_times = p.on_off_times(0);
+    assert(res_get_times);
+    assert(fabs(res_get_times->off - 0.125) < 1e-3);
+
+    // Wrong channel and angle (unhappy path)
+    assert(!p.static_pwm(16));
+    assert(!s0.set_angle(100.0));
+    p.close();
+}
+
+void test_no_allocations() {
+    // On the simulator, so it doesn't need the hardware
+    SimulatedPca9685 device(PCA9685_ADDRESS);
+    I2cSimulator simulator;
+    simulator.add_device(device);
+    Pca9685 p(true, simulator);
+
+    auto res = p.open(PCA9685_DEVICE, PCA9685_ADDRESS);
+    assert(res);
+    unique_ptr<Pwm> pwm0 = std::move(*p.pwm(0));
+    Servo s0(pwm0);
+    BasicServo<Pca9685StaticPwm> s1(*p.static_pwm(1));
+    ServoGroup group(true);
+    for (uint32_t channel = 2; channel < 6; channel++) {
+        auto res_add = group.add_servo(p, channel);
+        assert(res_add);
+    }
+    auto res_init = group.init();
+    assert(res_init);
+
+    // Once everything is set up, moving the servos doesn't touch the heap. The results are kept
+    // in variables, so the calls are not removed with NDEBUG
+    const size_t allocations_before = allocations_count;
+    for (int i = 0; i < 100; i++) {
+        const float angle = -90.0f + i * 1.8f;
+        auto res_set_times = p.set_on_off_times(6, 0.0, 0.05 + i * 0.001);
+        assert(res_set_times);
+        auto res_get_times = p.on_off_times(6);
+        assert(res_get_times);
+        auto res_set_angle0 = s0.set_angle(angle);
+        assert(res_set_angle0);
+        auto res_set_angle1 = s1.set_angle(angle);
+        assert(res_set_angle1);
+        const array<float, 4> angles{angle, angle, angle, angle};
+        auto res_set_angles = group.set_angles(angles);
+        assert(res_set_angles);
+    }
+    auto res_staged = p.set_staged_mode(true);
+    assert(res_staged);
+    for (int i = 0; i < 100; i++) {
+        auto res_set_times = p.set_on_off_times(7, 0.0, 0.05 + i * 0.001);
+        assert(res_set_times);
+        auto res_flush = p.flush();
+        assert(res_flush);
+    }
+    res_staged = p.set_staged_mode(false);
+    assert(res_staged);
+    const size_t allocations = allocations_count - allocations_before;
+    assert(allocations == 0);
+
+    // The servos really moved
+    auto res_get_times = p.on_off_times(5);
+    assert(res_get_times);
+    assert(fabs(res_get_times->off - (0.075 + (-90.0 + 99 * 1.8) / 90.0 * 0.025)) < 1e-3);
+    p.close();
+}
+
+void test_servo_table() {
+    ServoTable table(0.05);
+    auto res_init = table.init();
+    assert(res_init);
+
+    // The table gives the same registers as computing them
+    for (const float angle: {-90.0f, -45.3f, 0.0f, 12.7f, 90.0f}) {
+        auto res_registers = Pca9685::on_off_registers({0.0, angle / 90.0f * 0.05f + 0.075f, false, false});
+        assert(res_registers);
+        assert(table.registers(angle) == *res_registers);
+    }
+    assert(table.registers_by_steps(127) == table.registers(12.7));
+
+    // Out of range angles are limited
+    assert(table.registers(100.0) == table.registers(90.0));
+    assert(table.registers(-100.0) == table.registers(-90.0));
+
+    // Wrong calibration (unhappy path)
+    ServoTable wrong_table(0.05, 0.975);
+    assert(!wrong_table.init());
+}
+
+void test_servo_group() {
+    Pca9685 p;
+
+    auto res = p.open(PCA9685_DEVICE, PCA9685_ADDRESS);
+    assert(res);
+
+    // Four servos in the channels 0 to 3, moved together in a single transfer
+    ServoGroup group;
+    for (uint32_t channel = 0; channel < 4; channel++) {
+        auto res_add = group.add_servo(p, channel, 0.05);
+        assert(res_add);
+        assert(*res_add == channel);
+    }
+    assert(group.size() == 4);
+    auto res_add_twice = group.add_servo(p, 0);
+    assert(!res_add_twice);
+    assert(res_add_twice.error().name() == "EINVAL");
+
+    auto res_init = group.init();
+    assert(res_init);
+    auto res_output_change = p.output_change();
+    assert(res_output_change);
+    assert(*res_output_change == Pca9685OutputChange::OnStop);
+
+    for (const float angle: {-90.0f, 0.0f, 90.0f}) {
+        const array<float, 4> angles{angle, angle, angle, angle};
+        auto res_set_angles = group.set_angles(angles);
+        assert(res_set_angles);
+        this_thread::sleep_for(chrono::seconds(1));
+    }
+    auto res_get_times = p.on_off_times(3);
+    assert(res_get_times);
+    assert(fabs(res_get_times->off - 0.125) < 1e-3);
+
+    // The same with lookup tables
+    ServoGroup group_lut(true);
+    for (uint32_t channel = 0; channel < 4; channel++) {
+        auto res_add = group_lut.add_servo(p, channel, 0.05);
+        assert(res_add);
+    }
+    res_init = group_lut.init();
+    assert(res_init);
+    const array<float, 4> angles_lut{-90.0, -45.0, 45.0, 0.0};
+    auto res_set_angles_lut = group_lut.set_angles(angles_lut);
+    assert(res_set_angles_lut);
+    res_get_times = p.on_off_times(3);
+    assert(res_get_times);
+    assert(fabs(res_get_times->off - 0.075) < 1e-3);
+
+    // Wrong angles (unhappy path)
+    const array<float, 4> wrong_angles{0.0, 0.0, 0.0, 100.0};
+    assert(!group.set_angles(wrong_angles));
+    const array<float, 3> too_few_angles{0.0, 0.0, 0.0};
+    assert(!group.set_angles(too_few_angles));
+    p.close();
+}
+
+void test_array() {
+    // On the simulator, with two devices that respond to the same ALL_CALL address
+    SimulatedPca9685 device0(PCA9685_ADDRESS);
+    SimulatedPca9685 device1(PCA9685_ADDRESS + 1);
+    I2cSimulator simulator;
+    simulator.add_device(device0);
+    simulator.add_device(device1);
+    Pca9685Array a(true, simulator);
+
+    // Two devices, 32 channels
+    const array<uint8_t, 2> addresses{PCA9685_ADDRESS, PCA9685_ADDRESS + 1};
+    auto res = a.open(PCA9685_DEVICE, addresses);
+    assert(res);
+    assert(a.size() == 2);
+    assert(a.channels_count() == 32);
+
+    // The frequency is set in both devices at once: a single transfer for each step (sleep,
+    // prescale, wake up and restart), and a single one writes the PRESCALE register of both
+    const uint64_t transfers_before = simulator.get_transfers_count();
+    auto res_set_freq = a.set_frequency(50.0);
+    assert(res_set_freq);
+    assert(simulator.get_transfers_count() - transfers_before == 4);
+    assert(device0.get_register(254) == 121 && device1.get_register(254) == 121);
+    assert(!(device0.get_register(0) & 0x10) && !(device1.get_register(0) & 0x10));
+    for (size_t i = 0; i < a.size(); i++) {
+        auto res_freq = a.controller(i).frequency();
+        assert(res_freq);
+        assert(fabs(*res_freq - 50.0) < 1.0);
+    }
+
+    // A range of channels that spans both devices, in a transfer for each device
+    vector<Pca9685OnOffTimes> times(8, Pca9685OnOffTimes{0.0, 0.075, false, false});
+    const uint64_t transfers_before_bulk = simulator.get_transfers_count();
+    auto res_set_times = a.set_on_off_times_bulk(12, times);
+    assert(res_set_times);
+    assert(simulator.get_transfers_count() - transfers_before_bulk == 2);
+    const uint16_t off_ticks = roundf(0.075f * 4096);
+    assert(device0.get_register(6 + 11 * 4 + 2) == 0 && device0.get_register(6 + 11 * 4 + 3) == 0x10);
+    assert(device0.get_register(6 + 12 * 4 + 2) == (off_ticks & 0xff));
+    assert(device0.get_register(6 + 15 * 4 + 3) == (off_ticks >> 8));
+    assert(device1.get_register(6 + 3 * 4 + 2) == (off_ticks & 0xff));
+    assert(device1.get_register(6 + 3 * 4 + 3) == (off_ticks >> 8));
+    assert(device1.get_register(6 + 4 * 4 + 3) == 0x10);
+    auto res_get_times = a.controller(1).on_off_times(3);
+    assert(res_get_times);
+    assert(fabs(res_get_times->off - 0.075) < 1e-3);
+
+    // All the channels off at once, also in the copies of the registers
+    const uint64_t transfers_before_off = simulator.get_transfers_count();
+    auto res_all_off = a.set_all_off();
+    assert(res_all_off);
+    assert(simulator.get_transfers_count() - transfers_before_off == 1);
+    assert(device0.get_register(6 + 12 * 4 + 3) == 0x10 && device1.get_register(6 + 3 * 4 + 3) == 0x10);
+    res_get_times = a.controller(0).on_off_times(12);
+    assert(res_get_times);
+    assert(res_get_times->always_off);
+    res_get_times = a.controller(1).on_off_times(3);
+    assert(res_get_times);
+    assert(res_get_times->always_off);
+
+    // Wrong channels (unhappy path)
+    auto res_wrong = a.set_on_off_times(32, 0.0, 0.5);
+    assert(!res_wrong);
+    res_wrong = a.set_on_off_times_bulk(30, times);
+    assert(!res_wrong);
+    a.close();
+}
+
 int main() {
+    test_no_allocations();
+    test_servo_table();
+
     /*test_open();
     test_close_not_opened();
     test_sleep();
@@ -423,7 +825,13 @@ int main() {
     test_external_driver();
     test_output_disabled_mode();
     test_frequency();
-    test_on_off_times();*/
+    test_on_off_times();
+    test_on_off_times_bulk();
+    test_register_cache();
+    test_staged_mode();*/
 
     test_servo();
+    test_array();
+    //test_static_servo();
+    //test_servo_group();
 }
\ No newline at end of file
@@ -0,0 +1,101 @@
+#include <atomic>
+#include <cassert>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "../src/robotstate.hpp"
+
+using namespace rfs;
+using namespace std;
+
+#define JOINTS_COUNT 18
+#define SERVOS_COUNT 18
+#define READERS_COUNT 3
+
+using State = RobotState<JOINTS_COUNT, SERVOS_COUNT>;
+
+// All the fields of the snapshot have the same value, to check that no write is seen halfway
+void fill(State::Snapshot &snapshot, float value) {
+    snapshot.joint_angles.fill(value);
+    snapshot.servo_angles.fill(value);
+    snapshot.servo_times.fill(Pca9685OnOffTimes{0.0, value, false, false});
+}
+
+bool consistent(const State::Snapshot &snapshot) {
+    const float value = snapshot.joint_angles[0];
+    for (size_t i = 0; i < JOINTS_COUNT; i++) {
+        if (snapshot.joint_angles[i] != value)
+            return false;
+    }
+    for (size_t i = 0; i < SERVOS_COUNT; i++) {
+        if (snapshot.servo_angles[i] != value || snapshot.servo_times[i].off != value)
+            return false;
+    }
+    return true;
+}
+
+void test_publish() {
+    State state;
+
+    // Nothing published yet
+    assert(state.get_tick() == 0);
+    State::Snapshot snapshot = state.load();
+    assert(snapshot.tick == 0);
+    assert(snapshot.joint_angles[0] == 0.0);
+
+    State::Snapshot published;
+    fill(published, 1.0);
+    const chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    state.publish(published, now);
+    fill(published, 2.0);
+    state.publish(published, now + chrono::milliseconds(5));
+    assert(state.get_tick() == 2);
+
+    state.load(snapshot);
+    assert(snapshot.tick == 2);
+    assert(snapshot.timestamp - chrono::duration_cast<chrono::nanoseconds>(now.time_since_epoch()).count() == 5000000);
+    assert(consistent(snapshot));
+    assert(snapshot.servo_times[3].off == 2.0);
+}
+
+void test_concurrent() {
+    State state;
+    atomic<bool> done(false);
+    atomic<uint64_t> loads(0);
+
+    // The readers always see a whole snapshot, and the ticks never go back
+    vector<thread> readers;
+    for (int i = 0; i < READERS_COUNT; i++) {
+        readers.emplace_back([&state, &done, &loads]() {
+            State::Snapshot snapshot;
+            uint64_t last_tick = 0;
+            while (!done.load()) {
+                state.load(snapshot);
+                assert(consistent(snapshot));
+                assert(snapshot.tick >= last_tick);
+                assert(snapshot.joint_angles[0] == static_cast<float>(snapshot.tick));
+                last_tick = snapshot.tick;
+                loads.fetch_add(1, memory_order_relaxed);
+            }
+        });
+    }
+
+    State::Snapshot published;
+    for (uint64_t tick = 1; tick <= 100000; tick++) {
+        fill(published, static_cast<float>(tick));
+        state.publish(published);
+    }
+    done.store(true);
+    for (thread &reader: readers)
+        reader.join();
+
+    assert(state.get_tick() == 100000);
+    assert(state.load().joint_angles[0] == 100000.0);
+    cout << "snapshots loaded while publishing: " << loads.load() << endl;
+}
+
+int main() {
+    test_publish();
+    test_concurrent();
+}
@@ -0,0 +1,118 @@
+#include <cassert>
+#include <cmath>
+#include <iostream>
+
+#include "../src/i2csimulator.hpp"
+#include "../src/pca9685.hpp"
+#include "../src/servo.hpp"
+#include "../src/trajectory.hpp"
+
+using namespace rfs;
+using namespace std;
+using namespace chrono;
+
+#define PCA9685_DEVICE "/dev/i2c-1"
+#define PCA9685_ADDRESS 0x40
+
+void test_trapezoidal_profile() {
+    const steady_clock::time_point start = steady_clock::now();
+    ServoTrajectory trajectory(0.0);
+
+    // Accelerates for 0.5 s up to 90 deg/s, keeps the velocity for 0.5 s and decelerates for 0.5 s
+    auto res_add = trajectory.add_waypoint({90.0, 90.0, 180.0}, start);
+    assert(res_add);
+    assert(fabs(trajectory.angle(start) - 0.0) < 1e-3);
+    assert(fabs(trajectory.angle(start + milliseconds(500)) - 22.5) < 1e-2);
+    assert(fabs(trajectory.angle(start + milliseconds(750)) - 45.0) < 1e-2);
+    assert(fabs(trajectory.angle(start + milliseconds(1000)) - 67.5) < 1e-2);
+    assert(!trajectory.finished(start + milliseconds(1400)));
+    assert(fabs(trajectory.angle(start + milliseconds(1500)) - 90.0) < 1e-2);
+    assert(trajectory.finished(start + milliseconds(1500)));
+
+    // Too near to reach the maximum velocity: decelerates from the middle
+    res_add = trajectory.add_waypoint({80.0, 90.0, 180.0}, start + milliseconds(2000));
+    assert(res_add);
+    assert(fabs(trajectory.angle(start + milliseconds(2000)) - 90.0) < 1e-3);
+    const float middle = trajectory.angle(start + milliseconds(2000) + microseconds(235702));
+    assert(fabs(middle - 85.0) < 1e-2);
+    assert(fabs(trajectory.angle(start + milliseconds(3000)) - 80.0) < 1e-3);
+
+    // Wrong waypoints (unhappy path)
+    auto res_wrong_angle = trajectory.add_waypoint({100.0, 90.0, 180.0}, start);
+    assert(!res_wrong_angle);
+    auto res_wrong_velocity = trajectory.add_waypoint({0.0, 0.0, 180.0}, start);
+    assert(!res_wrong_velocity);
+    auto res_wrong_acceleration = trajectory.add_waypoint({0.0, 90.0, -1.0}, start);
+    assert(!res_wrong_acceleration);
+}
+
+void test_motion_planner() {
+    // On the simulator, with the time given to each update, so that the result is deterministic
+    SimulatedPca9685 device(PCA9685_ADDRESS);
+    I2cSimulator simulator;
+    simulator.add_device(device);
+    Pca9685 p(false, simulator);
+
+    auto res = p.open(PCA9685_DEVICE, PCA9685_ADDRESS);
+    assert(res);
+    unique_ptr<Pwm> pwm0 = std::move(*p.pwm(0));
+    unique_ptr<Pwm> pwm1 = std::move(*p.pwm(1));
+    Servo servo0(pwm0);
+    Servo servo1(pwm1);
+    auto res_init = servo0.init();
+    assert(res_init);
+    res_init = servo1.init();
+    assert(res_init);
+
+    // Two servos moved together, for 2.5 s the first one and 1.5 s the second one
+    const steady_clock::time_point start = steady_clock::now();
+    MotionPlanner planner(p);
+    const size_t index0 = planner.add_servo(servo0);
+    const size_t index1 = planner.add_servo(servo1);
+    auto res_add = planner.trajectory(index0).add_waypoint({45.0, 90.0, 180.0}, start);
+    assert(res_add);
+    res_add = planner.trajectory(index0).add_waypoint({-45.0, 90.0, 180.0}, start);
+    assert(res_add);
+    res_add = planner.trajectory(index1).add_waypoint({-45.0, 45.0, 90.0}, start);
+    assert(res_add);
+
+    // Called each millisecond, the servos are only updated at 50 Hz, and the channels that changed
+    // are written in a single transfer
+    int updates = 0;
+    int updates_written = 0;
+    steady_clock::time_point now = start;
+    for (; !planner.finished(now); now += milliseconds(1)) {
+        const uint64_t transfers_before = simulator.get_transfers_count();
+        auto res_update = planner.update(now);
+        assert(res_update);
+        if (*res_update) {
+            updates++;
+            const uint64_t transfers = simulator.get_transfers_count() - transfers_before;
+            assert(transfers <= 1);
+            updates_written += transfers;
+        } else {
+            assert(simulator.get_transfers_count() == transfers_before);
+        }
+    }
+    assert(now - start >= milliseconds(2500) && now - start <= milliseconds(2501));
+    assert(updates >= 125 && updates <= 126);
+    assert(updates_written >= 100);
+
+    // The last update, once finished, leaves the servos at their last waypoints
+    now += milliseconds(20);
+    auto res_update = planner.update(now);
+    assert(res_update && *res_update);
+    auto res_times0 = p.on_off_times(0);
+    assert(res_times0);
+    assert(fabs(res_times0->off - (Servo::SERVO_OFFSET_DEFAULT - Servo::SERVO_HALF_ANGLE_DUTY_CYCLE_DEFAULT / 2.0)) < 1e-3);
+    auto res_times1 = p.on_off_times(1);
+    assert(res_times1);
+    assert(fabs(res_times1->off - res_times0->off) < 1e-3);
+    cout << "updates sent: " << updates << ", written: " << updates_written << endl;
+    p.close();
+}
+
+int main() {
+    test_trapezoidal_profile();
+    test_motion_planner();
+}
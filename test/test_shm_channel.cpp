@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <iostream>
+#include <thread>
+
+#include "../src/shmchannel.hpp"
+
+using namespace rfs;
+using namespace std;
+
+#define CHANNEL_NAME "/rfs_test_channel"
+
+void test_open() {
+    ShmChannel reader;
+
+    // Open a channel that doesn't exist (unhappy path)
+    auto res_missing = reader.open(CHANNEL_NAME);
+    assert(!res_missing);
+    assert(res_missing.error().name() == "ENOENT");
+
+    ShmChannel writer;
+    auto res_create = writer.create(CHANNEL_NAME, 64);
+    assert(res_create);
+    assert(writer.capacity() == 64);
+
+    auto res_open = reader.open(CHANNEL_NAME);
+    assert(res_open);
+    assert(reader.capacity() == 64);
+
+    // Nothing published yet
+    array<uint8_t, 64> buffer;
+    auto res_read = reader.read(buffer);
+    assert(!res_read);
+    assert(res_read.error().name() == "EAGAIN");
+    assert(!reader.updated());
+
+    auto res_close = reader.close();
+    assert(res_close);
+    res_close = writer.close();
+    assert(res_close);
+}
+
+void test_latest_value() {
+    ShmChannel writer;
+    auto res_create = writer.create(CHANNEL_NAME, 64);
+    assert(res_create);
+    ShmChannel reader;
+    auto res_open = reader.open(CHANNEL_NAME);
+    assert(res_open);
+
+    // A message too big for the channel (unhappy path)
+    array<uint8_t, 65> too_big{};
+    auto res_too_big = writer.publish(too_big);
+    assert(!res_too_big);
+    assert(res_too_big.error().name() == "EMSGSIZE");
+
+    // Only the last message is read
+    const array<uint8_t, 3> first{1, 2, 3};
+    const array<uint8_t, 5> second{4, 5, 6, 7, 8};
+    auto res_publish = writer.publish(first);
+    assert(res_publish);
+    res_publish = writer.publish(second);
+    assert(res_publish);
+    assert(reader.updated());
+
+    array<uint8_t, 64> buffer;
+    auto res_read = reader.read(buffer);
+    assert(res_read);
+    assert(*res_read == second.size());
+    assert(equal(second.begin(), second.end(), buffer.begin()));
+    assert(!reader.updated());
+
+    // A buffer too small for the message (unhappy path)
+    array<uint8_t, 4> small;
+    auto res_small = reader.read(small);
+    assert(!res_small);
+    assert(res_small.error().name() == "EMSGSIZE");
+}
+
+void test_concurrent() {
+    ShmChannel writer;
+    auto res_create = writer.create(CHANNEL_NAME, 64);
+    assert(res_create);
+    ShmChannel reader;
+    auto res_open = reader.open(CHANNEL_NAME);
+    assert(res_open);
+
+    // Every message has all its bytes equal, so a torn read would be detected. The writer waits
+    // for a read every few messages, so that it doesn't starve the reader, but the rest of
+    // messages are published while reading
+    const uint32_t messages_count = 50000;
+    const uint32_t messages_per_read = 100;
+    atomic<bool> done{false};
+    atomic<uint32_t> reads_count{0};
+    thread producer([&writer, &done, &reads_count, messages_count, messages_per_read]() {
+        array<uint8_t, 64> message;
+        for (uint32_t i = 1; i <= messages_count; i++) {
+            message.fill(i & 0xff);
+            auto res_publish = writer.publish(message);
+            assert(res_publish);
+            while (reads_count.load() < i / messages_per_read)
+                this_thread::yield();
+        }
+        done = true;
+    });
+
+    array<uint8_t, 64> buffer;
+    while (!done) {
+        if (!reader.updated())
+            continue;
+        auto res_read = reader.read(buffer);
+        if (!res_read)
+            continue;
+        assert(all_of(buffer.begin(), buffer.end(), [&buffer](uint8_t byte) { return byte == buffer[0]; }));
+        reads_count++;
+    }
+    producer.join();
+    assert(reads_count.load() >= messages_count / messages_per_read);
+
+    // The last message is always there
+    auto res_read = reader.read(buffer);
+    assert(res_read);
+    assert(buffer[0] == (messages_count & 0xff));
+    cout << "messages read: " << reads_count.load() << " out of " << messages_count << endl;
+}
+
+void test_dead_publisher() {
+    ShmChannel writer;
+    auto res_create = writer.create(CHANNEL_NAME, 64);
+    assert(res_create);
+    const array<uint8_t, 3> message{1, 2, 3};
+    auto res_publish = writer.publish(message);
+    assert(res_publish);
+    ShmChannel reader;
+    auto res_open = reader.open(CHANNEL_NAME);
+    assert(res_open);
+
+    // A publisher that died while writing leaves the sequence odd, the sequence being the third word
+    const int fd = shm_open(CHANNEL_NAME, O_RDWR, 0);
+    assert(fd >= 0);
+    void *data = mmap(nullptr, 4 * sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    assert(data != MAP_FAILED);
+    atomic_ref<uint32_t>(static_cast<uint32_t *>(data)[2]).fetch_add(1);
+
+    // The reader gives up instead of hanging (unhappy path)
+    array<uint8_t, 64> buffer;
+    auto res_read = reader.read(buffer);
+    assert(!res_read);
+    assert(res_read.error().name() == "EAGAIN");
+
+    // And reads again once a message is published
+    atomic_ref<uint32_t>(static_cast<uint32_t *>(data)[2]).fetch_add(1);
+    munmap(data, 4 * sizeof(uint32_t));
+    res_publish = writer.publish(message);
+    assert(res_publish);
+    res_read = reader.read(buffer);
+    assert(res_read);
+    assert(*res_read == message.size());
+}
+
+int main() {
+    test_open();
+    test_latest_value();
+    test_concurrent();
+    test_dead_publisher();
+}
@@ -1,17 +1,23 @@
-
+#include <array>
+#include <chrono>
+#include <cstring>
 #include <iostream>
 #include <nlohmann/json.hpp>
 
+#include "../src/controlloop.hpp"
 #include "../src/web.hpp"
 
 using namespace rfs;
 using namespace std;
 
+// The angles received by the handlers, in the server's thread, for the main loop
+LatestValue<array<float, 2>> received_angles;
+
 class AnglesHandler: public HTTPEventHandler {
 
 public:
 
-    virtual void post(HTTPRequest &request) const override
+    virtual void post(HTTPRequest &request) override
     {
         expected<nlohmann::json, nlohmann::json::parse_error> result_json = request.json();
         if (!result_json) {
@@ -20,21 +26,86 @@ public:
             return;
         }
         cout << request.body() << endl;
+        received_angles.store(array<float, 2>{
+            result_json->value("horizontal", 50.0f), result_json->value("vertical", 50.0f)});
         ok(request);
     }
 
 };
 
+// Receives the angles as two 32-bit floats, and sends them back to all the clients 10 times per second
+class AnglesSocketHandler: public WebSocketHandler {
+
+public:
+
+    AnglesSocketHandler(): WebSocketHandler(10.0), angles{50.0, 50.0}
+    {}
+
+    virtual void on_broadcast() override
+    {
+        broadcast(span<const uint8_t>(reinterpret_cast<const uint8_t *>(angles.data()), sizeof(angles)));
+    }
+
+    virtual void on_close(mg_connection *connection) override
+    {
+        cout << "WebSocket closed, " << get_subscribers().size() << " subscribers" << endl;
+    }
+
+    virtual void on_message(mg_connection *connection, span<const uint8_t> message, bool binary) override
+    {
+        if (!binary || message.size() != sizeof(angles)) {
+            cerr << "Wrong angles message" << endl;
+            return;
+        }
+        memcpy(angles.data(), message.data(), sizeof(angles));
+        received_angles.store(array<float, 2>(angles));
+    }
+
+    virtual void on_open(mg_connection *connection) override
+    {
+        cout << "WebSocket opened, " << get_subscribers().size() << " subscribers" << endl;
+    }
+
+private:
+
+    array<float, 2> angles;
+
+};
+
 int main()
 {
     WebApplication app(true);
     std::unique_ptr<HTTPEventHandler> site_handler = std::make_unique<HTTPFileHandler>("../test/index.html");
     std::unique_ptr<HTTPEventHandler> angles_handler = std::make_unique<AnglesHandler>();
+    std::unique_ptr<HTTPEventHandler> metrics_handler = std::make_unique<HTTPMetricsHandler>();
+    std::unique_ptr<HTTPEventHandler> angles_socket_handler = std::make_unique<AnglesSocketHandler>();
+    AnglesSocketHandler &socket_handler = static_cast<AnglesSocketHandler &>(*angles_socket_handler);
     app.listen("http://0.0.0.0:8000");
     app.add_handler("/", site_handler);
     app.add_handler("/angles/", angles_handler);
+    app.add_handler("/metrics", metrics_handler);
+    app.add_handler("/ws/angles/", angles_socket_handler);
 
-    while (1) {
-        app.poll(1000);
-    }
-}
\ No newline at end of file
+    app.start();
+
+    // The control loop, at 50 Hz, is not delayed by the requests
+    ControlLoop loop(50.0);
+    loop.add_stage("read", []() -> expected<void, rfs::Error> {
+        array<float, 2> angles;
+        if (received_angles.load(angles))
+            cout << "horizontal: " << angles[0] << ", vertical: " << angles[1] << endl;
+        return {};
+    });
+    loop.add_stage("telemetry", [&app, &socket_handler, &loop]() -> expected<void, rfs::Error> {
+        const uint64_t ticks = loop.get_cycles_count() + 1;
+        if (ticks % 250 == 0) {
+            app.post([&socket_handler, ticks]() {
+                socket_handler.broadcast_text("ticks: " + to_string(ticks));
+            });
+        }
+        return {};
+    });
+    const expected<void, rfs::Error> loop_result = loop.run();
+    if (!loop_result)
+        cerr << "Error in the control loop: " << loop_result.error().detail() << endl;
+}